@@ -11,4 +11,15 @@ void i86_cpu_shutdown();
 // TODO: expand for all CPUID data
 const char* i86_cpu_get_vendor();
 
+// Feature bits in EDX of CPUID leaf 1
+#define CPU_FEATURE_FPU		(1 << 0)
+#define CPU_FEATURE_PSE		(1 << 3)
+#define CPU_FEATURE_PGE		(1 << 13)
+#define CPU_FEATURE_FXSR	(1 << 24)
+#define CPU_FEATURE_SSE		(1 << 25)
+#define CPU_FEATURE_SSE2	(1 << 26)
+
+// Returns EDX of CPUID leaf 1
+uint32_t i86_cpu_get_features();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef _FPU_H
+#define _FPU_H
+
+#include <lib/stdint.h>
+
+// Size and alignment of a saved FPU/SSE state, as stored by FXSAVE
+#define FPU_STATE_SIZE		512
+#define FPU_STATE_ALIGN		16
+
+// Enables the FPU, and SSE if the CPU has it. Saves the state after reset
+// for i86_fpu_init_state. Returns 0 if there is no FPU.
+int i86_fpu_initialize();
+
+int i86_fpu_is_present();
+
+// Fills a state area with the state after reset
+void i86_fpu_init_state(void* state);
+
+// Saves the FPU/SSE registers to a state area, FPU_STATE_ALIGN aligned
+void i86_fpu_save(void* state);
+
+// Loads the FPU/SSE registers from a state area
+void i86_fpu_restore(const void* state);
+
+// Sets or clears CR0.TS. While set, the first FPU/SSE instruction raises
+// a device not available fault.
+void i86_fpu_set_ts(int set);
+
+#endif
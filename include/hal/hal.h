@@ -27,6 +27,8 @@ void (*getvect(int intno))();
 
 const char* get_cpu_vendor();
 
+uint32_t get_cpu_features();
+
 int get_tick_count();
 
 #endif
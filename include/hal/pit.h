@@ -36,4 +36,20 @@ void i86_pit_start_counter(uint32_t freq, uint8_t counter, uint8_t mode);
 void i86_pit_initialize();
 int i86_pit_is_initialized();
 
+// Dynamic tick. Once started, counter 0 only interrupts when armed, at
+// most i86_pit_get_oneshot_max_ticks() ticks ahead, and the tick count is
+// read back from the counter. Uses the tick length of i86_pit_start_counter.
+void i86_pit_start_oneshot();
+int i86_pit_is_oneshot();
+
+// Adds the time passed since the last call to the tick count and returns
+// it. Call with interrupts disabled.
+uint32_t i86_pit_update_tick_count();
+
+uint32_t i86_pit_get_oneshot_max_ticks();
+
+// Raises IRQ 0 on the tick boundary 'ticks' ticks from the last update.
+// Call with interrupts disabled.
+void i86_pit_arm_oneshot(uint32_t ticks);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <lib/stdint.h>
+
+// Reads the time stamp counter
+static inline uint64_t bench_rdtsc(){
+	uint32_t low;
+	uint32_t high;
+
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+
+	return ((uint64_t)high << 32) | low;
+}
+
+// Times single block allocations and runs too long for the buddy
+// allocator, in empty and fragmented memory
+void bench_pmm();
+
+// Times address space switches with and without global kernel pages
+void bench_switch();
+
+#endif
@@ -29,10 +29,14 @@ void bounds_check_fault (unsigned int cs,
 void invalid_opcode_fault (unsigned int cs, 
                       unsigned int eip, unsigned int eflags);
 
-// device not available
+// device not available, called from no_device_isr. Loads the FPU state
+// of the current thread.
 void no_device_fault (unsigned int cs, 
                       unsigned int eip, unsigned int eflags);
 
+// device not available entry point
+void no_device_isr ();
+
 // double fault
 void double_fault_abort (unsigned int cs, unsigned int err,
                       unsigned int eip, unsigned int eflags);
@@ -53,9 +57,12 @@ void stack_fault (unsigned int cs, unsigned int err,
 void general_protection_fault (unsigned int cs, unsigned int err, 
                       unsigned int eip, unsigned int eflags);
 
-// page fault
-void page_fault (unsigned int cs, unsigned int err, 
-                      unsigned int eip, unsigned int eflags);
+// page fault, called from page_fault_isr with the faulting address
+void page_fault (unsigned int addr, unsigned int err, 
+                      unsigned int eip);
+
+// page fault entry point, removes the error code before returning
+void page_fault_isr ();
 
 // Floating Point Unit (FPU) error
 void fpu_fault (unsigned int cs, 
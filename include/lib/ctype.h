@@ -51,7 +51,6 @@ extern char _ctype[];
 #define isprint(c)      ((c) >= ' ' && (c) <= '~')
 #define toupper(c)      ((c) - 0x20 * (((c) >= 'a') && ((c) <= 'z')))
 #define tolower(c)      ((c) + 0x20 * (((c) >= 'A') && ((c) <= 'Z')))
-#define isascii(c)		((unsigned)(c) <= 0x7F)
 #define toascii(c)		((unsigned)(c) & 0x7F)
 
 #endif
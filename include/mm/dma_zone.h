@@ -0,0 +1,76 @@
+/** @file dma_zone.h
+ *  @brief Function prototypes for the DMA zone allocator.
+ *
+ *  A physically contiguous range below 16MB is set aside at boot for
+ *	device buffers. ISA DMA can only reach the first 16MB and can not cross
+ *	a 64KB boundary, and bus master PRD tables have the same boundary rule,
+ *	so buffers are handed out from the zone instead of searching the kernel
+ *	heap for physically contiguous pages.
+ *
+ *	The zone is split into 64KB segments. Buffers up to 64KB are placed
+ *	inside one segment and never cross a 64KB boundary. Larger buffers take
+ *	whole segments.
+ *
+ *  @author Joakim Bertils
+ */
+
+#ifndef _DMA_ZONE_H
+#define _DMA_ZONE_H
+
+#include <lib/stdint.h>
+#include <mm/physmem.h>
+
+/** @brief Size of the zone in bytes. */
+#define DMA_ZONE_SIZE 0x40000U
+
+/** @brief Size of a segment, buffers in a segment never cross a 64KB
+ *	boundary.
+ */
+#define DMA_ZONE_SEGMENT_SIZE 0x10000U
+
+/** @brief Number of segments in the zone. */
+#define DMA_ZONE_SEGMENTS (DMA_ZONE_SIZE / DMA_ZONE_SEGMENT_SIZE)
+
+/** @brief Highest physical address ISA DMA can reach. */
+#define DMA_ZONE_LIMIT 0x1000000U
+
+/** @brief Virtual address the zone is mapped at. */
+#define DMA_ZONE_VIRTUAL 0xEFC00000U
+
+/** @brief Sets up the zone.
+ *
+ *	Takes a 64KB aligned run of frames below DMA_ZONE_LIMIT from the PMM and
+ *	maps it at DMA_ZONE_VIRTUAL. Should be called early, while low memory is
+ *	still free.
+ *
+ *	@return 1 on success, 0 if no suitable memory was found.
+ */
+int dma_zone_init();
+
+/** @brief Allocates a buffer from the zone.
+ *
+ *	The buffer is page aligned. Buffers of up to DMA_ZONE_SEGMENT_SIZE bytes
+ *	do not cross a 64KB boundary.
+ *
+ *	@param size		Size of the buffer in bytes.
+ *	@param phys		If not 0, receives the physical address of the buffer.
+ *	@return 		Virtual address of the buffer, or 0 if the zone is full.
+ */
+void* dma_zone_alloc(size_t size, physical_addr* phys);
+
+/** @brief Frees a buffer allocated by dma_zone_alloc.
+ *
+ *	@param addr		Virtual address of the buffer.
+ *	@param size		Size passed to dma_zone_alloc.
+ */
+void dma_zone_free(void* addr, size_t size);
+
+/** @brief Returns the physical address of an address inside the zone, or 0
+ *	if the address is not in the zone.
+ */
+physical_addr dma_zone_get_physical(void* addr);
+
+/** @brief Returns the number of free pages in the zone. */
+uint32_t dma_zone_get_free_count();
+
+#endif
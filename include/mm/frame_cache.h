@@ -0,0 +1,61 @@
+/** @file frame_cache.h
+ *  @brief Function prototypes for the page frame cache.
+ *
+ *  A small stack of free frames in front of the physical memory manager.
+ *	Single frame allocations are served from the cache, which is refilled
+ *	and drained in batches so the PMM bitmaps are only touched once per
+ *	batch.
+ *
+ *	Each execution context has its own cache. There is only one context
+ *	for now, but with more processors each one would get its own cache and
+ *	only take the PMM lock when refilling or draining.
+ *
+ *  @author Joakim Bertils
+ */
+
+#ifndef _FRAME_CACHE_H
+#define _FRAME_CACHE_H
+
+#include <lib/stdint.h>
+
+/** @brief Number of frames a cache can hold. */
+#define FRAME_CACHE_SIZE 64
+
+/** @brief Number of frames moved between a cache and the PMM at a time. */
+#define FRAME_CACHE_BATCH 16
+
+/** @brief Allocates one frame.
+ *
+ *	Takes a frame from the cache of the current context, refilling the
+ *	cache from the PMM if it is empty. Frames are handed out lowest address
+ *	first within a batch.
+ *
+ *	@return Physical address of the frame, or 0 if out of memory.
+ */
+void* frame_cache_alloc();
+
+/** @brief Frees one frame.
+ *
+ *	Puts the frame in the cache of the current context. If the cache is
+ *	full a batch of frames is given back to the PMM first.
+ *
+ *	@param p	Physical address of the frame.
+ */
+void frame_cache_free(void* p);
+
+/** @brief Gives all cached frames of the current context back to the PMM.
+ *
+ *	Does nothing while the cache is being refilled.
+ */
+void frame_cache_drain();
+
+/** @brief Returns 1 while the cache of the current context is taking
+ *	frames from the PMM.
+ */
+int frame_cache_is_refilling();
+
+/** @brief Returns the number of frames held by the current context.
+ */
+uint32_t frame_cache_get_count();
+
+#endif
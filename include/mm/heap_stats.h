@@ -0,0 +1,113 @@
+/** @file heap_stats.h
+ *  @brief Kernel heap accounting.
+ *
+ *  Every allocation made through kernel_malloc_c/kernel_malloc_ac carries a
+ *  comment. The comments are mapped to a small set of tags, and live bytes,
+ *  allocation counts and peak usage are kept per tag. The bookkeeping is
+ *  a few additions per allocation, so it is always enabled.
+ *
+ *  @author Joakim Bertils
+ */
+
+#ifndef _HEAP_STATS_H
+#define _HEAP_STATS_H
+
+#include <lib/stdint.h>
+
+/** @brief Maximum number of distinct tags. Tag 0 collects everything that
+ *	does not fit in the table.
+ */
+#define HEAP_STATS_MAX_TAGS 64
+
+/** @brief Tag of the chunks backing the slabs. The objects in them are
+ *	accounted to the tags of their callers, so this tag is left out of the
+ *	per tag table to avoid counting the same bytes twice.
+ */
+#define HEAP_STATS_SLAB_TAG 1
+
+/** @brief Length of a tag name, equal to the region comment length. */
+#define HEAP_STATS_NAME_LENGTH 21
+
+/** @brief Statistics for a single tag. */
+typedef struct _heap_tag_stats_t
+{
+	char name[HEAP_STATS_NAME_LENGTH];
+
+	// Bytes currently allocated
+	uint32_t liveBytes;
+
+	// Number of objects currently allocated
+	uint32_t liveCount;
+
+	// Total number of allocations made
+	uint32_t allocCount;
+
+	// Highest value of liveBytes seen
+	uint32_t peakBytes;
+} heap_tag_stats_t;
+
+/** @brief Heap wide statistics. */
+typedef struct _heap_stats_t
+{
+	// Size of the mapped heap
+	uint32_t heapSize;
+
+	// Bytes in reserved regions, including slab chunks
+	uint32_t usedBytes;
+
+	// Highest value of usedBytes seen
+	uint32_t peakUsedBytes;
+
+	// Bytes in free regions
+	uint32_t freeBytes;
+
+	// Number of free regions
+	uint32_t freeRegionCount;
+
+	// Size of the largest free region
+	uint32_t largestFreeBlock;
+
+	// External fragmentation in per mille, 0 when all free memory is in a
+	// single block.
+	uint32_t fragmentation;
+
+	// Memory held by slabs
+	uint32_t slabBytes;
+
+	// Bytes given back to the PMM by heap_trim since boot
+	uint32_t reclaimedBytes;
+
+	// Number of distinct tags in use
+	uint32_t tagCount;
+} heap_stats_t;
+
+/** @brief Maps an allocation comment to a tag.
+ *
+ *	@param comment	Comment given to the allocation.
+ *	@return 		Tag index.
+ */
+uint8_t heap_stats_tag(const char* comment);
+
+/** @brief Records an allocation of size bytes for a tag. */
+void heap_stats_alloc(uint8_t tag, uint32_t size);
+
+/** @brief Records that size bytes belonging to a tag were freed. */
+void heap_stats_free(uint8_t tag, uint32_t size);
+
+/** @brief Returns the number of tags in use. */
+uint32_t heap_stats_tag_count();
+
+/** @brief Returns the statistics for a tag, or 0 if the index is invalid. */
+const heap_tag_stats_t* heap_stats_get_tag(uint32_t tag);
+
+/** @brief Fills in the heap wide statistics.
+ *
+ *	Walks the free regions, so the cost is proportional to the number of free
+ *	regions.
+ */
+void heap_stats_get(heap_stats_t* stats);
+
+/** @brief Dumps the heap statistics to the serial port COM1. */
+void heap_stats_dump();
+
+#endif
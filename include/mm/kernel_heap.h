@@ -11,11 +11,14 @@
 #define HEAP_WITHIN_64K BIT(25)
 #define HEAP_CONTINUOUS BIT(31)
 
+#define KERNEL_HEAP_START 0xD0200000U
+#define KERNEL_HEAP_END 0xE0000000U
+
 // Returns the current end of the heap
 void* heap_get_current_end();
 
 // Initiates the kernel heap
-void inik_kernel_heap();
+void init_kernel_heap();
 
 // Allocates a chunk of memory at least 'size' bytes large.
 void* kernel_malloc(size_t size);
@@ -35,4 +38,9 @@ void* kernel_malloc_ac(size_t size, uint32_t alignment, const char* comment);
 // Frees the memory chunk beginning at addr
 void kernel_free(void* addr); 
 
+// Gives the whole free pages of the heap back to the PMM and shrinks the
+// heap if it ends with a free region. Called automatically once enough
+// memory has been freed. Returns the number of bytes reclaimed.
+uint32_t heap_trim();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,177 @@
+/** @file mem_zone.h
+ *  @brief Free frame accounting by zone and low memory reclaim.
+ *
+ *  The PMM counts the free frames of each zone as they are allocated and
+ *	freed. Frames below 16MB form the DMA zone, the rest of memory the normal
+ *	zone. Frames that are never handed out, such as the kernel image, the
+ *	PMM maps, the VESA area and the holes in the memory map, are counted as
+ *	reserved in the zone they lie in. Blocks the PMM has not given to the
+ *	buddy allocator yet are counted as free.
+ *
+ *	Every zone has three watermarks. An allocation can be served from any
+ *	zone, so the marks are compared with the free frames of all zones
+ *	together:
+ *
+ *	- Below the low mark, the reclaim callbacks are run after an allocation
+ *	  until the free frames are back at the high mark.
+ *	- Below the min mark, caches should stop growing.
+ *	- When an allocation finds no free frames, the callbacks are run before
+ *	  it fails.
+ *
+ *  @author Joakim Bertils
+ */
+
+#ifndef _MEM_ZONE_H
+#define _MEM_ZONE_H
+
+#include <lib/stdint.h>
+
+/** @brief Zone of the frames ISA DMA can reach. */
+#define MEM_ZONE_DMA 0
+
+/** @brief Zone of the rest of memory. */
+#define MEM_ZONE_NORMAL 1
+
+#define MEM_ZONE_COUNT 2
+
+/** @brief First frame of the normal zone (16MB). */
+#define MEM_ZONE_NORMAL_FIRST_BLOCK 0x1000
+
+/** @brief Most reclaim callbacks that can be registered. */
+#define MEM_ZONE_MAX_RECLAIMERS 8
+
+/** @brief Memory pressure, from mem_zone_get_pressure. */
+#define MEM_ZONE_PRESSURE_NONE 0
+#define MEM_ZONE_PRESSURE_LOW 1
+#define MEM_ZONE_PRESSURE_MIN 2
+
+/** @brief Reclaim callback.
+ *
+ *	Gives memory back, either to the PMM or to the frame cache, which is
+ *	drained after every callback. Called with the allocation that triggered
+ *	the reclaim still in progress, so a callback must not allocate, and must
+ *	return right away if its own state is being modified.
+ *
+ *	@param target	Number of frames still wanted.
+ *	@return 		Number of frames given back.
+ */
+typedef uint32_t (*mem_zone_reclaim_t)(uint32_t target);
+
+typedef struct {
+
+	const char* name;
+
+	/** @brief First frame of the zone and the frame after the last. */
+	uint32_t firstBlock;
+	uint32_t endBlock;
+
+	/** @brief Frames of the zone that are never handed out. */
+	uint32_t reserved;
+
+	/** @brief Frames of the zone that are free in the PMM. */
+	uint32_t free;
+
+	/** @brief Watermarks, in frames. */
+	uint32_t min;
+	uint32_t low;
+	uint32_t high;
+
+} mem_zone_stats_t;
+
+typedef struct {
+
+	/** @brief Reclaims started by the low watermark. */
+	uint32_t lowRuns;
+
+	/** @brief Reclaims started by an allocation that had no free frames. */
+	uint32_t failRuns;
+
+	/** @brief Frames that reached the PMM through reclaiming. */
+	uint32_t reclaimed;
+
+	/** @brief Allocations that found nothing to reclaim. */
+	uint32_t failures;
+
+} mem_zone_reclaim_stats_t;
+
+/** @brief Resets the counters of all zones.
+ *
+ *	Called by pmmngr_init, when every frame is still in use.
+ *
+ *	@param blocks	Number of frames managed by the PMM.
+ */
+void mem_zone_reset(uint32_t blocks);
+
+/** @brief Counts a frame becoming free (delta 1) or used (delta -1).
+ *
+ *	Called by the PMM for every frame that changes state.
+ */
+void mem_zone_account(uint32_t block, int32_t delta);
+
+/** @brief Counts count frames from block becoming free or used.
+ */
+void mem_zone_account_range(uint32_t block, uint32_t count, int32_t delta);
+
+/** @brief Sets the watermarks of the zones.
+ *
+ *	Must be called once the memory map has been given to the PMM and before
+ *	anything is allocated, every frame that is not free at that point is
+ *	counted as reserved. Registers the reclaim callback of the zeroed page
+ *	pool.
+ */
+void mem_zone_init();
+
+/** @brief Registers a reclaim callback.
+ *
+ *	Callbacks are run in the order they were registered. Registering a
+ *	callback twice has no effect.
+ *
+ *	@param name		Name shown by mem_zone_get_reclaimer_name.
+ *	@param callback	The callback.
+ *	@return 		1 on success, 0 if there is no room for another callback.
+ */
+int mem_zone_register_reclaim(const char* name, mem_zone_reclaim_t callback);
+
+/** @brief Runs the reclaim callbacks until target frames have been freed.
+ *
+ *	Nested calls, from an allocation made while reclaiming, return 0.
+ *
+ *	@return 		Number of frames that reached the PMM.
+ */
+uint32_t mem_zone_reclaim(uint32_t target);
+
+/** @brief Called by the PMM after an allocation, reclaims if the free
+ *	frames are below the low watermark.
+ *
+ *	Does nothing while the frame cache is being refilled, the frame cache
+ *	calls it once the refill is done.
+ */
+void mem_zone_balance();
+
+/** @brief Called by the PMM when an allocation of count frames found no
+ *	free memory.
+ *
+ *	@return 		1 if frames were reclaimed and the allocation should be
+ *					retried, 0 if it fails.
+ */
+int mem_zone_reclaim_for(uint32_t count);
+
+/** @brief Returns the memory pressure, one of MEM_ZONE_PRESSURE_*.
+ */
+uint32_t mem_zone_get_pressure();
+
+/** @brief Returns the counters and watermarks of a zone.
+ *
+ *	@return 		1 on success, 0 if there is no such zone.
+ */
+int mem_zone_get_stats(uint32_t zone, mem_zone_stats_t* stats);
+
+/** @brief Returns the reclaim counters.
+ */
+void mem_zone_get_reclaim_stats(mem_zone_reclaim_stats_t* stats);
+
+/** @brief Returns the name of a reclaim callback, or 0 past the last one.
+ */
+const char* mem_zone_get_reclaimer_name(uint32_t index);
+
+#endif
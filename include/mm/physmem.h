@@ -21,12 +21,49 @@
 typedef uint32_t physical_addr;
 
 
+/** @brief Most extents of usable memory the PMM keeps track of. */
+#define PMMNGR_MAX_EXTENTS 32
+
+/** @brief Adds an extent of usable memory.
+ *
+ *	Called for every usable entry of the memory map before pmmngr_init.
+ *	Overlapping and touching extents are merged, so the list stays compact.
+ *	Only whole blocks inside the extent are used.
+ *
+ *	@param base		Base address of the extent, in the same form as for
+ *					pmmngr_init_region.
+ *	@param size		Size of the extent.
+ */
+void pmmngr_add_extent(physical_addr base, size_t size);
+
+/** @brief Returns the memory size, in KB, up to the end of the highest
+ *	extent.
+ */
+size_t pmmngr_get_extent_memory_size();
+
+/** @brief Returns the size of the PMM metadata for a memory size, before
+ *	pmmngr_init.
+ *
+ *	The metadata grows with the memory size and the extents, the caller of
+ *	pmmngr_init has to find room for it.
+ *
+ *	@param memsize	Size of memory in KB, as for pmmngr_init.
+ *	@return 		Size in bytes, the same as pmmngr_get_bitmap_size will
+ *					return after pmmngr_init.
+ */
+uint32_t pmmngr_get_metadata_size(size_t memsize);
+
 /** @brief Initializes the physical memory manager
  *
  *  Initializes the physical memory manager with given memory size and a 
- *	location where the bitmap is going to be stored. When the manager is
- *	initialized, all memory will be treated as used until we initialize a
- *	region where we have available memory to use.
+ *	location where the bitmap is going to be stored. The blocks of the
+ *	extents are counted as free right away, but are only given to the buddy
+ *	allocator a chunk at a time when the free blocks run out, so boot does
+ *	not touch every block. Memory outside the extents is never used. If no
+ *	extents were added, all of memory is one extent.
+ *
+ *	The buddy allocator keeps its free maps directly after the bitmap, see
+ *	pmmngr_get_bitmap_size.
  *
  *  @param memsize 		Size of memory
  *	@param bitmap		Address where the PMM can store the bitmap
@@ -37,9 +74,9 @@ void pmmngr_init(size_t memsize, physical_addr bitmap);
 
 /** @brief Initializes a region for the physical memory manager to use.
  *
- *  Marks a given region as available for use by the PMM. The start address and
- *	the size are rounded down to nearest multiple of the block size used in
- *	the manager.
+ *  Gives the blocks of the extents up to the end of the region to the buddy
+ *	allocator right away, instead of when they are first needed. Parts of
+ *	the region outside the extents stay unavailable.
  *
  *  @param base		Base address of the region
  *  @param size 	Size of the region to be initiated.
@@ -70,17 +107,47 @@ void* pmmngr_alloc_block();
  *
  *	Allocates a block from the memory available in the PMM and sets all bytes 
  *  in memory range to 0. If the allocation fails, the returned value will be 0.
+ *	The block is taken from the zeroed page pool when possible.
  *
  *	@return 		Address of start of allocated block if successful, else 0.
  */
 void* pmmngr_alloc_block_z();
 
+/** @brief Frees a block of memory
+ *
+ *	If the block is shared, one owner is dropped and the block stays
+ *	allocated until the last owner frees it.
+ *
+ *	@param p		Address of the block.
+ */
 void pmmngr_free_block(void* p);
 
+/** @brief Adds an owner to an allocated block.
+ *
+ *	Used when a frame is mapped into more than one address space, for
+ *	example by copy-on-write cloning.
+ *
+ *	@param p		Address of the block.
+ */
+void pmmngr_share_block(void* p);
+
+/** @brief Drops one extra owner of a shared block.
+ *
+ *	@param p		Address of the block.
+ *	@return 		1 if the block was shared and an owner was dropped, 0 if
+ *					the block has a single owner.
+ */
+int pmmngr_unshare_block(void* p);
+
+/** @brief Returns the number of owners of a block, 0 if it is free.
+ */
+uint32_t pmmngr_get_block_owners(void* p);
+
 /** @brief Allocates a series of blocks of memory
  *
  *	Allocates given number of blocks contiguous in physical memory. If the
- *	allocation fails, the returned value will be 0.
+ *	allocation fails, the returned value will be 0. Runs of up to 1024 blocks
+ *	are served by the buddy allocator in O(log n).
  *
  *	@return 		Address of start of allocated blocks if successful, else 0.
  */
@@ -104,10 +171,28 @@ uint32_t pmmngr_get_block_count();
 
 uint32_t pmmngr_get_use_block_count();
 
+/** @brief Returns the number of free blocks, including the blocks not yet
+ *	given to the buddy allocator.
+ */
 uint32_t pmmngr_get_free_block_count();
 
+/** @brief Returns the number of free blocks not yet given to the buddy
+ *	allocator.
+ */
+uint32_t pmmngr_get_pending_block_count();
+
 uint32_t pmmngr_get_block_size();
 
+/** @brief Returns the number of bytes used by the PMM at the bitmap address.
+ *
+ *	The bitmap is followed by the free maps of the buddy allocator and the
+ *	reference counts of the blocks in the extents. The whole area must be
+ *	kept out of the memory handed out by the PMM.
+ *
+ *	@return 		Size of the PMM metadata in bytes.
+ */
+uint32_t pmmngr_get_bitmap_size();
+
 void pmmngr_paging_enable(int b);
 
 int pmmngr_is_paging();
@@ -0,0 +1,72 @@
+/** @file slab.h
+ *  @brief Function prototypes for the kernel slab allocator.
+ *
+ *  Small kernel objects are served from size-classed caches. Each cache owns
+ *  a number of slabs, which are SLAB_SIZE large chunks carved out of the
+ *  kernel heap and split into equally sized objects. Allocation and freeing
+ *  of an object is O(1). Larger objects are left to the region allocator in
+ *  kernel_heap.c.
+ *
+ *  @author Joakim Bertils
+ */
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <lib/stdint.h>
+
+/** @brief Size of a slab in bytes.
+ *
+ *	Slabs are aligned at their own size, which makes it possible to find the
+ *	slab header of an object by masking the object address.
+ */
+#define SLAB_SIZE 0x4000U
+
+/** @brief Smallest object size served by the slab allocator. */
+#define SLAB_MIN_OBJECT_SIZE 16U
+
+/** @brief Largest object size served by the slab allocator. */
+#define SLAB_MAX_OBJECT_SIZE 2048U
+
+/** @brief Number of size classes, one for each power of two between
+ *	SLAB_MIN_OBJECT_SIZE and SLAB_MAX_OBJECT_SIZE.
+ */
+#define SLAB_CACHE_COUNT 8
+
+/** @brief Initializes the slab caches.
+ *
+ *	Must be called once the region allocator is up, since the slabs are
+ *	allocated from the kernel heap.
+ */
+void slab_init();
+
+/** @brief Allocates an object from the slab caches.
+ *
+ *	@param size		Requested size in bytes.
+ *	@param tag		Heap statistics tag the object is accounted to.
+ *	@return 		Address of the object, or 0 if the size is not served
+ *					by the slab allocator or if no memory was available.
+ */
+void* slab_alloc(size_t size, uint8_t tag);
+
+/** @brief Frees an object allocated by slab_alloc.
+ *
+ *	@param addr		Address of the object.
+ *	@return 		1 if the address belonged to a slab and was freed,
+ *					0 if the address is not owned by the slab allocator.
+ */
+int slab_free(void* addr);
+
+/** @brief Checks whether an address belongs to a slab.
+ *
+ *	@param addr		Address to check.
+ *	@return 		Non-zero if the address lies inside a slab.
+ */
+int slab_owns(void* addr);
+
+/** @brief Returns the number of bytes held by slabs, including the spare
+ *	empty slab of each cache.
+ */
+uint32_t slab_get_memory_usage();
+
+#endif
@@ -22,6 +22,7 @@ enum PAGE_PTE_FLAGS {
 	I86_PTE_PAT				=	0x80,		//0000000000000000000000010000000
 	I86_PTE_CPU_GLOBAL		=	0x100,		//0000000000000000000000100000000
 	I86_PTE_LV4_GLOBAL		=	0x200,		//0000000000000000000001000000000
+	I86_PTE_COW				=	0x400,		//0000000000000000000010000000000
    	I86_PTE_FRAME			=	0x7FFFF000 	//1111111111111111111000000000000
 };
 
@@ -90,8 +91,8 @@ int pd_entry_is_writable (pd_entry e);
 // Get page table entry frame address
 physical_addr pd_entry_pfn (pd_entry e);
 
-// Enable global pages
-void pd_entry_enable_global (pd_entry e);
+// Marks a large page global
+void pd_entry_enable_global (pd_entry* e);
 
 //===================================================================
 // Virtual Memory Manager
@@ -136,6 +137,44 @@ void vmmngr_free_page (pt_entry* e);
 // switch to a new page directory
 int vmmngr_switch_pdirectory (pdirectory*);
 
+// Start of the kernel half of every address space
+#define VMMNGR_KERNEL_SPACE 0xC0000000
+
+// The last directory entry of every address space points to the directory
+// itself. The page tables of the current address space then show up at
+// VMMNGR_SELF_MAP_TABLES and the directory at VMMNGR_SELF_MAP_DIRECTORY.
+#define VMMNGR_SELF_MAP_INDEX		1023
+#define VMMNGR_SELF_MAP_TABLES		0xFFC00000
+#define VMMNGR_SELF_MAP_DIRECTORY	0xFFFFF000
+
+// The entry below the self-map holds a few scratch pages shared by all
+// address spaces, used to reach frames that are not mapped anywhere, like
+// a new page directory or the copy of a copy-on-write page.
+#define VMMNGR_TEMP_MAP_INDEX		1022
+#define VMMNGR_TEMP_MAP_BASE		0xFF800000
+#define VMMNGR_TEMP_MAP_SLOTS		4
+
+// Each slot has one user, so the users can nest
+#define VMMNGR_TEMP_DIR				0	// directory that is not current
+#define VMMNGR_TEMP_TABLE			1	// page table of that directory
+#define VMMNGR_TEMP_COPY			2	// copy of a copy-on-write page
+#define VMMNGR_TEMP_ZERO			3	// frame being cleared by the zero pool
+
+// maps a frame at a scratch slot and returns its address. The slots are
+// not locked, so call with interrupts disabled and unmap before enabling
+// them again.
+void* vmmngr_map_temp (uint32_t slot, physical_addr frame);
+
+// removes the mapping of a scratch slot
+void vmmngr_unmap_temp (uint32_t slot);
+
+// marks the kernel mappings global if the CPU supports it, so they survive
+// address space switches. Returns 1 if global pages are in use.
+int vmmngr_enable_global_pages ();
+
+// turns CR4.PGE on or off without touching the mappings
+void vmmngr_set_global_pages (int enable);
+
 // get current page directory
 pdirectory* vmmngr_get_directory ();
 
@@ -164,14 +203,75 @@ int vmmngr_createPageTable(pdirectory* dir, uint32_t virt, uint32_t flags);
 
 void vmmngr_mapPhysicalAddress(pdirectory* dir, uint32_t virt, uint32_t phys, uint32_t flags);
 
+// Size of a large page
+#define LARGE_PAGE_SIZE 0x400000
+
+// maps a 4MB page. Both addresses must be 4MB aligned and the directory
+// entry must be unused. Returns 1 on success.
+int vmmngr_mapLargePage(pdirectory* dir, uint32_t virt, uint32_t phys, uint32_t flags);
+
+// maps a physically contiguous region, using 4MB pages where the addresses
+// allow it and 4KB pages elsewhere
+void vmmngr_mapPhysicalRegion(pdirectory* dir, uint32_t virt, uint32_t phys, size_t size, uint32_t flags);
+
+// maps a physically contiguous range with 4KB pages. Each page table is
+// walked once and the TLB is flushed once at the end. Returns 1 on success.
+int vmmngr_map_range(pdirectory* dir, virtual_addr virt, physical_addr phys, size_t size, uint32_t flags);
+
+// unmaps a range without freeing the frames, flushing the TLB once
+void vmmngr_unmap_range(pdirectory* dir, virtual_addr virt, size_t size);
+
+// unmaps the 4KB pages of a page aligned range and gives their frames back
+// to the PMM. 4MB pages are kept, since every address space has its own
+// copy of the kernel directory entries. Returns the number of bytes released.
+uint32_t vmmngr_release_range(pdirectory* dir, virtual_addr virt, size_t size);
+
+// returns the size of the page mapping an address, 0 if it is not mapped
+uint32_t vmmngr_page_size(pdirectory* dir, virtual_addr virt);
+
 void vmmngr_unmapPageTable(pdirectory* dir, uint32_t virt);
 
 void vmmngr_unmapPhysicalAddress(pdirectory* dir, uint32_t virt);
 
 pdirectory* vmmngr_createAddressSpace();
 
+// clones the current address space. The kernel part is shared and user
+// pages are shared copy-on-write.
 pdirectory* vmmngr_cloneAddressSpace();
 
+// frees the user page tables and pages of an address space, and the
+// directory itself. The directory must not be in use.
+void vmmngr_destroyAddressSpace(pdirectory* dir);
+
+// returns the physical address a virtual address maps to, or 0 if it is
+// not mapped. Lookups in the current address space go through the self-map.
 void* vmmngr_getPhysicalAddress(pdirectory* dir, uint32_t virt);
 
+//===================================================================
+// Demand paging
+//===================================================================
+
+// Page fault error code bits
+#define PAGE_FAULT_PRESENT	1
+#define PAGE_FAULT_WRITE	2
+#define PAGE_FAULT_USER		4
+
+// Maximum number of reserved ranges
+#define VMMNGR_MAX_RESERVED_RANGES 32
+
+// reserves a virtual range that is backed with frames on first touch.
+// A range reserved with dir 0 belongs to the kernel and is mapped into
+// whatever directory is current when the fault happens.
+int vmmngr_reserve_range(pdirectory* dir, virtual_addr start, size_t size, uint32_t flags);
+
+// removes a virtual range from the reserved ranges of a directory. Frames
+// already mapped in the range are left alone.
+void vmmngr_unreserve_range(pdirectory* dir, virtual_addr start, size_t size);
+
+// backs every unbacked page of a reserved range right away
+void vmmngr_commit_range(pdirectory* dir, virtual_addr start, size_t size);
+
+// resolves a page fault, returns 1 if the faulting page was mapped
+int vmmngr_handle_fault(virtual_addr addr, uint32_t err);
+
 #endif
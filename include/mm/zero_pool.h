@@ -0,0 +1,66 @@
+/** @file zero_pool.h
+ *  @brief Function prototypes for the zeroed page pool.
+ *
+ *  Keeps a number of frames that have already been cleared, so callers
+ *	that need a zeroed frame do not have to clear it themselves. The pool
+ *	is refilled outside of the allocation path, by a low priority kernel
+ *	thread calling zero_pool_refill.
+ *
+ *  @author Joakim Bertils
+ */
+
+#ifndef _ZERO_POOL_H
+#define _ZERO_POOL_H
+
+#include <lib/stdint.h>
+
+/** @brief Number of zeroed frames the pool can hold. */
+#define ZERO_POOL_SIZE 64
+
+/** @brief Statistics of the zeroed page pool.
+ */
+typedef struct {
+
+	/** @brief Allocations served from the pool. */
+	uint32_t hits;
+
+	/** @brief Allocations that had to zero a frame themselves. */
+	uint32_t misses;
+
+	/** @brief Frames zeroed by zero_pool_refill. */
+	uint32_t refilled;
+
+	/** @brief Frames currently in the pool. */
+	uint32_t count;
+
+} zero_pool_stats_t;
+
+/** @brief Allocates a zeroed frame.
+ *
+ *	Takes a frame from the pool if there is one, otherwise allocates a frame
+ *	and clears it.
+ *
+ *	@return Physical address of the frame, or 0 if out of memory.
+ */
+void* zero_pool_alloc();
+
+/** @brief Fills the pool with zeroed frames.
+ *
+ *	Clears frames one at a time until the pool is full or memory runs out.
+ *	Meant to be called from a background thread.
+ *
+ *	@return Number of frames added to the pool.
+ */
+uint32_t zero_pool_refill();
+
+/** @brief Gives all frames in the pool back to the PMM.
+ */
+void zero_pool_drain();
+
+/** @brief Fills in the statistics of the pool.
+ *
+ *	@param stats	Structure to fill in.
+ */
+void zero_pool_get_stats(zero_pool_stats_t* stats);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _RUN_QUEUE_H
+#define _RUN_QUEUE_H
+
+#include <lib/stdint.h>
+
+// Number of priority levels, 0 is the lowest
+#define RUN_QUEUE_LEVELS		32
+
+struct _Thread;
+
+/*
+	Ready threads are kept in one FIFO per priority level:
+
+	levels:	1 0 0 ... 1 0		(bit i is set when queue i is not empty)
+			|         |
+			V         V
+	queue:	T -> T    T -> T -> T
+
+	The highest ready level is found with bsr on the level bitmap, so
+	picking a thread takes the same time however many threads there are.
+	Threads are linked through nextQueued/prevQueued, a thread is in at
+	most one queue.
+*/
+
+typedef struct _RunQueue
+{
+	struct _Thread*		head[RUN_QUEUE_LEVELS];
+	struct _Thread*		tail[RUN_QUEUE_LEVELS];
+
+	uint32_t			levels;
+	uint32_t			count;
+} RunQueue;
+
+void run_queue_init(RunQueue* queue);
+
+// Appends a thread to the queue of its priority
+void run_queue_push(RunQueue* queue, struct _Thread* thread);
+
+// Removes a thread from the queue, if it is queued
+void run_queue_remove(RunQueue* queue, struct _Thread* thread);
+
+// Takes the first thread of the highest level, or of the lowest level if
+// 'lowest' is set. Returns 0 if the queue is empty.
+struct _Thread* run_queue_pop(RunQueue* queue, int lowest);
+
+// Returns the highest level with a ready thread, or -1
+int run_queue_highest(RunQueue* queue);
+
+#endif
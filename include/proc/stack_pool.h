@@ -0,0 +1,81 @@
+#ifndef _STACK_POOL_H
+#define _STACK_POOL_H
+
+#include <lib/stdint.h>
+
+#include <mm/virtmem.h>
+
+// Maximum number of stacks in a pool
+#define STACK_POOL_MAX_SLOTS	256
+
+// Unmapped pages below each stack, catching overflows
+#define STACK_POOL_GUARD_PAGES	1
+
+// Pages of a kernel and a user thread stack
+#define KERNEL_STACK_PAGES		2
+#define USER_STACK_PAGES		4
+
+/*
+	Each stack lives in a slot of its own:
+
+	base + i * slotSize
+	|
+	V
+	+-------------+--------------------------+
+	| Guard pages | Stack pages          <-- | top, returned by stack_pool_alloc
+	+-------------+--------------------------+
+
+	Freed slots go to a free list and are handed out again before a new
+	slot is used. Kernel pools keep the frames of freed stacks mapped, so a
+	reused kernel stack costs nothing to set up. User pools give the frames
+	back, since the next owner may be another address space.
+*/
+
+typedef struct _StackPool
+{
+	virtual_addr		base;
+	uint32_t			pages;
+	uint32_t			slotSize;
+	uint32_t			maxSlots;
+	uint32_t			flags;
+
+	// Slots handed out at least once
+	uint32_t			usedSlots;
+
+	// Freed slots, the next one to reuse is at freeSlots[freeCount - 1]
+	uint16_t			freeSlots[STACK_POOL_MAX_SLOTS];
+	uint32_t			freeCount;
+
+	// Set for slots whose stack pages are mapped
+	uint8_t				mapped[STACK_POOL_MAX_SLOTS];
+} StackPool;
+
+typedef struct _StackPoolStats
+{
+	// Stacks owned by threads
+	uint32_t			inUse;
+
+	// Freed stacks waiting to be reused
+	uint32_t			free;
+
+	// Stacks the pool can hold
+	uint32_t			capacity;
+
+	// Bytes of a stack, not counting the guard pages
+	uint32_t			stackSize;
+} StackPoolStats;
+
+// Sets up a pool of stacks of 'pages' pages each, mapped with 'flags'
+void stack_pool_init(StackPool* pool, virtual_addr base, uint32_t pages, uint32_t maxSlots, uint32_t flags);
+
+// Returns the top of a free stack mapped in 'dir', or 0 if the pool is full
+// or out of memory
+void* stack_pool_alloc(StackPool* pool, pdirectory* dir);
+
+// Returns a stack to the pool. A kernel stack is not touched, so a thread
+// can free its own stack right before switching away for the last time.
+void stack_pool_free(StackPool* pool, pdirectory* dir, void* top);
+
+void stack_pool_get_stats(StackPool* pool, StackPoolStats* stats);
+
+#endif
@@ -5,6 +5,12 @@
 
 #include <mm/virtmem.h>
 
+#include <proc/stack_pool.h>
+#include <proc/run_queue.h>
+#include <proc/timer_wheel.h>
+
+#include <sync/wait_queue.h>
+
 #define KE_USER_START	0x00400000
 #define KE_KERNEL_START	0x80000000
 
@@ -43,6 +49,14 @@ typedef struct _TrapFrame
 typedef unsigned int ktime_t;
 
 #define THREAD_STATE_SLEEP		1
+#define THREAD_STATE_TERMINATED	2
+#define THREAD_STATE_BLOCKED	4
+
+// Higher priorities run first. Threads of the same priority take turns.
+#define THREAD_PRIORITY_IDLE	0
+#define THREAD_PRIORITY_NORMAL	1
+#define THREAD_PRIORITY_HIGH	2
+#define THREAD_PRIORITY_MAX		(RUN_QUEUE_LEVELS - 1)
 
 struct _Process;
 
@@ -61,15 +75,24 @@ struct _Process;
 		  Nullptr
 
 	Scheduler:
-	
-	Thread* t= getCurrentThread();
-	if(t->nextThread)
-		switch(t->nextThread);
-	Process* p = t->parent;
-	if(p->nextProcess)
-		switch(p->nextProcess->firstThread):
-	
-	switch(rootProcess->firstThread);
+
+	Threads that can run are kept in a run queue, see run_queue.h. On each
+	tick the current thread goes to the back of its priority level and the
+	first thread of the highest ready level runs. Every few ticks the lowest
+	ready level gets a turn instead, so low priority threads still make
+	progress. Sleeping threads are kept in a timing wheel, see timer_wheel.h,
+	and go back to the queue on the tick they wake up. When nothing is ready
+	the scheduler's idle thread runs.
+
+	The timer runs in one-shot mode and is armed for the end of the
+	timeslice when other threads are ready, otherwise for the next wakeup,
+	so a thread running alone or the idle thread is not interrupted on
+	every tick.
+
+	The FPU is switched lazily. Dispatch sets CR0.TS unless the next thread
+	owns the FPU, and the device not available fault it raises on first use
+	saves the owner's registers and loads those of the current thread, see
+	thread_fpu_fault. Threads that do not use the FPU never pay for it.
 		
 */
 
@@ -90,9 +113,30 @@ typedef struct _Thread
 	ktime_t				sleepTimeEnd;
 
 	uint32_t			is_kernel;
+
+	// Top of the stack, as handed out by the stack pool
+	void*				stack;
+
+	// FPU/SSE registers while another thread owns the FPU, FPU_STATE_SIZE
+	// bytes. 0 if there is no FPU.
+	void*				fpuState;
 	
 	struct _Thread*		nextThread;
 
+	// Links in the run queue, valid while 'queued' is set
+	struct _Thread*		nextQueued;
+	struct _Thread*		prevQueued;
+	uint32_t			queued;
+
+	// Links in the timing wheel, valid while 'sleepSlot' is set
+	struct _Thread*		nextSleeping;
+	struct _Thread*		prevSleeping;
+	struct _Thread**	sleepSlot;
+
+	// Wait queue the thread is blocked in, and the next thread in it
+	struct _WaitQueue*	waitQueue;
+	struct _Thread*		nextWaiting;
+
 	unsigned int 		id;
 
 } Thread;
@@ -133,10 +177,26 @@ void TerminateProcess(int retCode);
 
 void thread_sleep(uint32_t ticks);
 
+// Moves a thread to another priority level, clamped to THREAD_PRIORITY_MAX
+void thread_set_priority(Thread* thread, uint32_t priority);
+
+// Takes the current thread off the CPU until thread_unblock, used by wait
+// queues
+void thread_block();
+
+// Makes a blocked thread ready again, may be called from interrupt handlers
+void thread_unblock(Thread* thread);
+
+// Gives the FPU to the current thread, called on a device not available
+// fault. Returns 0 if the fault was not caused by a lazy switch.
+int thread_fpu_fault();
+
 void initialize_scheduler();
 
 void thread_execute(Thread* t);
 
 void printProcessTree();
 
+void thread_get_stack_stats(StackPoolStats* kernel, StackPoolStats* user);
+
 #endif
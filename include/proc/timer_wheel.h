@@ -0,0 +1,69 @@
+#ifndef _TIMER_WHEEL_H
+#define _TIMER_WHEEL_H
+
+#include <lib/stdint.h>
+
+// Each level has 2^TIMER_WHEEL_BITS slots
+#define TIMER_WHEEL_BITS		6
+#define TIMER_WHEEL_SLOTS		(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK		(TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS		4
+
+// Furthest a thread can be placed from the current tick, 2^24 ticks
+#define TIMER_WHEEL_RANGE		(1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct _Thread;
+
+/*
+	Sleeping threads are kept in a hierarchical timing wheel, keyed on the
+	tick they wake up on:
+
+	level 0:	64 slots of 1 tick			(wake within 64 ticks)
+	level 1:	64 slots of 64 ticks		(within 4096 ticks)
+	level 2:	64 slots of 4096 ticks
+	level 3:	64 slots of 262144 ticks
+
+	Each tick the next level 0 slot is emptied and its threads woken. When
+	the level 0 index wraps around, the due slot of level 1 is emptied and
+	its threads put back in the wheel, which moves them down a level, and
+	so on for the higher levels. Adding and removing a thread takes the
+	same time however many threads sleep, and a tick only touches the
+	threads that wake up or move down.
+
+	A thread wakes up on the tick of its sleepTimeEnd, or on the next tick
+	processed if that has already passed. Threads further away than
+	TIMER_WHEEL_RANGE are parked in the last slot of the top level and
+	placed again when it is emptied. Threads are linked through
+	nextSleeping/prevSleeping, sleepSlot points at the list head of the slot
+	they are in.
+*/
+
+typedef struct _TimerWheel
+{
+	struct _Thread*		slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+
+	// Next tick to be processed
+	uint32_t			now;
+
+	uint32_t			count;
+} TimerWheel;
+
+// Starts the wheel at tick 'now'
+void timer_wheel_init(TimerWheel* wheel, uint32_t now);
+
+// Adds a thread that wakes on the tick of its sleepTimeEnd
+void timer_wheel_add(TimerWheel* wheel, struct _Thread* thread);
+
+// Removes a thread from the wheel, if it is in it
+void timer_wheel_remove(TimerWheel* wheel, struct _Thread* thread);
+
+// Processes all ticks up to and including 'now' and returns the threads
+// that woke up, linked through nextSleeping.
+struct _Thread* timer_wheel_advance(TimerWheel* wheel, uint32_t now);
+
+// Returns how many ticks after the last processed tick the wheel next has
+// work, a thread to wake or a slot to move down, or 'limit' if it has none
+// that soon. Only looks at level 0, so 'limit' should be small.
+uint32_t timer_wheel_next_expiry(TimerWheel* wheel, uint32_t limit);
+
+#endif
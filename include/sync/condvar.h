@@ -0,0 +1,36 @@
+#ifndef _CONDVAR_H
+#define _CONDVAR_H
+
+#include <sync/mutex.h>
+#include <sync/wait_queue.h>
+
+/*
+	Condition variable used with a mutex_t. Waiters may wake without a
+	signal, so the condition must be checked again in a loop:
+
+		mutex_lock(&m);
+		while (!ready)
+			condvar_wait(&cv, &m);
+		mutex_unlock(&m);
+
+	A zeroed condvar_t has no waiters.
+*/
+
+typedef struct
+{
+	WaitQueue			waiters;
+} condvar_t;
+
+void condvar_init(condvar_t* cv);
+
+// Unlocks the mutex and waits for a signal, then locks it again. No
+// signal is lost between the unlock and the wait.
+void condvar_wait(condvar_t* cv, mutex_t* m);
+
+// Wakes the thread that has waited longest
+void condvar_signal(condvar_t* cv);
+
+// Wakes all waiting threads
+void condvar_broadcast(condvar_t* cv);
+
+#endif
@@ -1,9 +1,42 @@
 #ifndef _MUTEX_H
 #define _MUTEX_H
 
-typedef unsigned char mutex_t;
+#include <lib/stdint.h>
 
-void lock(mutex_t* m);
-void unlock(mutex_t* m);
+#include <sync/wait_queue.h>
+
+struct _Thread;
+
+/*
+	Sleeping mutex. A thread that finds the mutex taken waits in the mutex's
+	wait queue. There is only one CPU, so the owner can not be running while
+	another thread waits and spinning would never help. Unlocking hands the
+	mutex straight to the thread that has waited longest, so waiters get it
+	in order.
+
+	Waiting blocks the current thread, so a mutex that is also locked from
+	interrupt handlers must only be held with interrupts disabled, as the
+	monitor does. A zeroed mutex_t is unlocked.
+
+	Nothing records which mutexes a thread holds, so a thread that
+	terminates with a mutex locked leaves it locked for good and its
+	waiters blocked. Unlock every mutex before terminating the thread.
+*/
+
+typedef struct
+{
+	volatile uint32_t	locked;
+	struct _Thread*		owner;
+	WaitQueue			waiters;
+} mutex_t;
+
+void mutex_init(mutex_t* m);
+
+void mutex_lock(mutex_t* m);
+
+// Returns 1 if the mutex was taken, 0 if it is locked
+int mutex_trylock(mutex_t* m);
+
+void mutex_unlock(mutex_t* m);
 
 #endif
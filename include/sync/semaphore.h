@@ -0,0 +1,31 @@
+#ifndef _SEMAPHORE_H
+#define _SEMAPHORE_H
+
+#include <lib/stdint.h>
+
+#include <sync/wait_queue.h>
+
+/*
+	Counting semaphore. semaphore_signal may be called from interrupt
+	handlers. A waiter woken by a signal is given the unit directly, so
+	waiters are served in order.
+*/
+
+typedef struct
+{
+	volatile uint32_t	count;
+	WaitQueue			waiters;
+} semaphore_t;
+
+void semaphore_init(semaphore_t* s, uint32_t count);
+
+// Takes a unit, waiting until one is available
+void semaphore_wait(semaphore_t* s);
+
+// Returns 1 if a unit was taken, 0 if none is available
+int semaphore_trywait(semaphore_t* s);
+
+// Gives a unit back, waking a waiter if there is one
+void semaphore_signal(semaphore_t* s);
+
+#endif
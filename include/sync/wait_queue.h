@@ -0,0 +1,69 @@
+#ifndef _WAIT_QUEUE_H
+#define _WAIT_QUEUE_H
+
+#include <lib/stdint.h>
+
+struct _Thread;
+
+/*
+	Threads waiting for an event. A waiting thread is out of the run queue
+	until it is woken, in the order it started waiting.
+
+	The condition waited for must be checked with interrupts disabled, and
+	they must stay disabled until wait_queue_wait, or a wakeup between the
+	check and the wait is lost. wait_queue_wait_until does this. Waking may
+	be done from interrupt handlers.
+
+	Before the scheduler runs, waiting halts until the next interrupt
+	instead, so callers must check their condition again after waking.
+
+	A zeroed WaitQueue is empty.
+*/
+
+typedef struct _WaitQueue
+{
+	struct _Thread*		head;
+	struct _Thread*		tail;
+} WaitQueue;
+
+// Disables interrupts and returns the previous flags
+static inline uint32_t wait_queue_lock()
+{
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void wait_queue_unlock(uint32_t flags)
+{
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+void wait_queue_init(WaitQueue* queue);
+
+// Blocks the current thread until it is woken. Call with interrupts
+// disabled. Returns 1 if the thread was woken, 0 if the scheduler is not
+// running and it only waited for an interrupt.
+int wait_queue_wait(WaitQueue* queue);
+
+// Wakes the thread that has waited longest, returns it or 0
+struct _Thread* wait_queue_wake_one(WaitQueue* queue);
+
+// Wakes all waiting threads, returns how many there were
+uint32_t wait_queue_wake_all(WaitQueue* queue);
+
+// Removes a thread from the queue without waking it
+void wait_queue_remove(WaitQueue* queue, struct _Thread* thread);
+
+// Waits until 'condition' is true
+#define wait_queue_wait_until(queue, condition)		\
+	do {											\
+		uint32_t _wq_flags = wait_queue_lock();		\
+		while (!(condition))						\
+			wait_queue_wait(queue);					\
+		wait_queue_unlock(_wq_flags);				\
+	} while (0)
+
+#endif
@@ -1,5 +1,6 @@
 #include <ata/ata.h>
 #include <hal/hal.h>
+#include <sync/wait_queue.h>
 
 #define ATA_SR_BSY     0x80    // Busy
 #define ATA_SR_DRDY    0x40    // Drive ready
@@ -99,6 +100,7 @@ struct IDEChannelRegisters {
 
 uint8_t ide_buf[2048] = {0};
 static volatile uint8_t ide_irq_invoked = 0;
+static WaitQueue ide_irq_queue;
 static uint8_t atapi_packet[12] = {0xA8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
 struct ide_device {
@@ -490,8 +492,7 @@ unsigned char ide_ata_access(
 }
 
 void ide_wait_irq() {
-   while (!ide_irq_invoked)
-      ;
+   wait_queue_wait_until(&ide_irq_queue, ide_irq_invoked);
    ide_irq_invoked = 0;
 }
 
@@ -499,6 +500,7 @@ void ide_irq() {
    	__asm__("pushal");
 
 	 ide_irq_invoked = 1;
+	wait_queue_wake_all(&ide_irq_queue);
 	interruptdone(46);
 	__asm__("popal; leave; iret");
 }
@@ -10,6 +10,8 @@
 #include <floppy/floppy.h>
 
 #include <hal/hal.h>
+#include <sync/wait_queue.h>
+#include <mm/dma_zone.h>
 #include <lib/string.h>
 #include <lib/stdio.h>
 
@@ -506,6 +508,7 @@ static uint8_t _CurrentDrive = 0;
 * Floppy disk IRQ status.
 */
 static volatile uint8_t _FloppyDiskIRQ = 0;
+static WaitQueue _FloppyDiskIRQQueue;
 
 /**
 * Start of DMA buffer.
@@ -513,6 +516,16 @@ static volatile uint8_t _FloppyDiskIRQ = 0;
 */
 int DMA_BUFFER = 0x1000;
 
+/**
+* Physical address of the DMA buffer, as seen by the DMA controller.
+*/
+static physical_addr _DmaBufferPhysical = 0x1000;
+
+/**
+* Size of the DMA buffer taken from the DMA zone.
+*/
+#define FLOPPY_DMA_BUFFER_SIZE 512
+
 // =====================================
 // Private function forward declarations
 // =====================================
@@ -737,7 +750,7 @@ void floppy_disk_write_ccr(const uint8_t val)
 void floppy_disk_wait_irq()
 {
 	printf("Waiting...\n");
-	while (_FloppyDiskIRQ == 0);
+	wait_queue_wait_until(&_FloppyDiskIRQQueue, _FloppyDiskIRQ != 0);
 	_FloppyDiskIRQ = 0;
 }
 
@@ -750,6 +763,7 @@ void i86_floppy_irq()
 
 	//! irq fired
 	_FloppyDiskIRQ = 1;
+	wait_queue_wake_all(&_FloppyDiskIRQQueue);
 
 	//! tell hal we are done
 	interruptdone(FLOPPY_IRQ);
@@ -906,7 +920,7 @@ void floppy_disk_read_sector_imp(const uint8_t head, const uint8_t track, const
 	uint32_t cyl;
 
 	// Set DMA to read
-	dma_initialize_floppy((uint8_t*)DMA_BUFFER, 512);
+	dma_initialize_floppy((uint8_t*)_DmaBufferPhysical, 512);
 	dma_set_read(FDC_DMA_CHANNEL);
 
 	_FloppyDiskIRQ = 0;
@@ -966,7 +980,7 @@ void floppy_disk_write_sector_imp(const uint8_t head, const uint8_t track, const
 	uint32_t cyl;
 
 	// Set DMA to write
-	dma_initialize_floppy((uint8_t*)DMA_BUFFER, 512);
+	dma_initialize_floppy((uint8_t*)_DmaBufferPhysical, 512);
 	dma_set_write(FDC_DMA_CHANNEL);
 
 	// Read in a sector
@@ -1055,11 +1069,23 @@ const FLOPPY_DISK_ERROR floppy_disk_seek(const uint32_t cyl, const uint32_t head
 
 void floppy_disk_set_dma(const int addr) 
 {
+	// The address has to be identity mapped
 	DMA_BUFFER = addr;
+	_DmaBufferPhysical = addr;
 }
 
 void floppy_disk_install(const int irq)
 {
+	// Take the DMA buffer from the DMA zone if there is one
+	physical_addr phys;
+	void* buffer = dma_zone_alloc(FLOPPY_DMA_BUFFER_SIZE, &phys);
+
+	if (buffer)
+	{
+		DMA_BUFFER = (int)buffer;
+		_DmaBufferPhysical = phys;
+	}
+
 	// Install IRQ handler
 	setvect(irq, i86_floppy_irq, 0);
 
@@ -54,4 +54,19 @@ const char* i86_cpu_get_vendor(){
 
 	return (const char*) vendor;
 
-}
\ No newline at end of file
+}
+
+uint32_t i86_cpu_get_features(){
+	static uint32_t features = 0;
+	static int read = 0;
+
+	if(!read)
+	{
+		uint32_t a, b, c;
+
+		cpuid(1, &a, &b, &c, &features);
+		read = 1;
+	}
+
+	return features;
+}
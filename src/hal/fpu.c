@@ -0,0 +1,106 @@
+#include <hal/fpu.h>
+#include <hal/cpu.h>
+
+#include <lib/string.h>
+
+#define CR0_MP			(1 << 1)
+#define CR0_EM			(1 << 2)
+#define CR0_TS			(1 << 3)
+#define CR0_NE			(1 << 5)
+
+#define CR4_OSFXSR		(1 << 9)
+#define CR4_OSXMMEXCPT	(1 << 10)
+
+static int _fpu_bIsPresent = 0;
+
+// FXSAVE/FXRSTOR are used when the CPU has them, otherwise FNSAVE/FRSTOR,
+// which only cover the x87 registers
+static int _fpu_bHasFxsr = 0;
+
+static uint8_t _fpu_initial_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+
+static inline uint32_t i86_fpu_read_cr0(){
+	uint32_t cr0;
+
+	asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+
+	return cr0;
+}
+
+static inline void i86_fpu_write_cr0(uint32_t cr0){
+	asm volatile ("mov %0, %%cr0" :: "r"(cr0) : "memory");
+}
+
+int i86_fpu_initialize(){
+	uint32_t features = i86_cpu_get_features();
+
+	if(!(features & CPU_FEATURE_FPU))
+		return 0;
+
+	// Native FPU errors, and WAIT honours TS
+	uint32_t cr0 = i86_fpu_read_cr0();
+	cr0 &= ~(CR0_EM | CR0_TS);
+	cr0 |= CR0_MP | CR0_NE;
+	i86_fpu_write_cr0(cr0);
+
+	if(features & CPU_FEATURE_FXSR){
+		uint32_t cr4;
+
+		asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+
+		cr4 |= CR4_OSFXSR;
+
+		if(features & CPU_FEATURE_SSE)
+			cr4 |= CR4_OSXMMEXCPT;
+
+		asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+
+		_fpu_bHasFxsr = 1;
+	}
+
+	_fpu_bIsPresent = 1;
+
+	asm volatile ("fninit");
+
+	memset(_fpu_initial_state, 0, FPU_STATE_SIZE);
+	i86_fpu_save(_fpu_initial_state);
+
+	return 1;
+}
+
+int i86_fpu_is_present(){
+	return _fpu_bIsPresent;
+}
+
+void i86_fpu_init_state(void* state){
+	memcpy(state, _fpu_initial_state, FPU_STATE_SIZE);
+}
+
+void i86_fpu_save(void* state){
+	if(_fpu_bHasFxsr)
+		asm volatile ("fxsave (%0)" :: "r"(state) : "memory");
+	else
+		asm volatile ("fnsave (%0); fwait" :: "r"(state) : "memory");
+}
+
+void i86_fpu_restore(const void* state){
+	if(_fpu_bHasFxsr)
+		asm volatile ("fxrstor (%0)" :: "r"(state) : "memory");
+	else
+		asm volatile ("frstor (%0)" :: "r"(state) : "memory");
+}
+
+void i86_fpu_set_ts(int set){
+	if(!_fpu_bIsPresent)
+		return;
+
+	uint32_t cr0 = i86_fpu_read_cr0();
+
+	if(set == ((cr0 & CR0_TS) != 0))
+		return;
+
+	if(set)
+		i86_fpu_write_cr0(cr0 | CR0_TS);
+	else
+		asm volatile ("clts");
+}
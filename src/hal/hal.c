@@ -4,11 +4,13 @@
 #include <hal/idt.h>
 #include <hal/pic.h>
 #include <hal/pit.h>
+#include <hal/fpu.h>
 
 #include <lib/stdio.h>
 
 int hal_initialize(){
 	i86_cpu_initialize();
+	i86_fpu_initialize();
 	i86_pic_initialize(0x20, 0x28);
 	i86_pit_initialize();
 	i86_pit_start_counter (100,I86_PIT_OCW_COUNTER_0, I86_PIT_OCW_MODE_SQUAREWAVEGEN);
@@ -108,6 +110,10 @@ const char* get_cpu_vendor(){
 	return i86_cpu_get_vendor();
 }
 
+uint32_t get_cpu_features(){
+	return i86_cpu_get_features();
+}
+
 int get_tick_count(){
 	return i86_pit_get_tick_count();
 }
@@ -8,10 +8,40 @@
 #define		I86_PIT_REG_COUNTER2		0x42
 #define		I86_PIT_REG_COMMAND			0x43
 
+#define		I86_PIT_FREQUENCY			1193181
+
 volatile uint32_t _pit_ticks = 0;
 
 int _pit_bIsInit = 0;
 
+// Counter 0 input clocks per tick
+static uint32_t _pit_divisor = 0;
+
+// In one-shot mode counter 0 counts down once from the value it was last
+// loaded with and raises IRQ 0 when it reaches zero. The tick count is kept
+// by reading how far it has counted since the last read. Clocks short of a
+// whole tick are kept in _pit_clocks.
+
+static int _pit_bIsOneshot = 0;
+
+static uint32_t _pit_clocks = 0;
+
+// Counter value at the last read or load
+static uint16_t _pit_last_count = 0;
+
+// Disables interrupts and returns the previous flags
+static inline uint32_t i86_pit_lock(){
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void i86_pit_unlock(uint32_t flags){
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
 void i86_pit_irq();
 
 void i86_pit_irq(){
@@ -49,6 +79,14 @@ uint32_t i86_pit_set_tick_count(uint32_t i){
 }
 
 uint32_t i86_pit_get_tick_count(){
+	if(_pit_bIsOneshot){
+		uint32_t flags = i86_pit_lock();
+		uint32_t ticks = i86_pit_update_tick_count();
+		i86_pit_unlock(flags);
+
+		return ticks;
+	}
+
 	return _pit_ticks;
 }
 
@@ -56,7 +94,7 @@ void i86_pit_start_counter(uint32_t freq, uint8_t counter, uint8_t mode){
 	if(freq == 0)
 		return;
 
-	uint16_t divisor = (uint16_t)(1193181/(uint16_t)freq);
+	uint16_t divisor = (uint16_t)(I86_PIT_FREQUENCY/(uint16_t)freq);
 
 	uint8_t ocw=0;
 	ocw = (ocw & ~I86_PIT_OCW_MASK_MODE) | mode;
@@ -67,9 +105,90 @@ void i86_pit_start_counter(uint32_t freq, uint8_t counter, uint8_t mode){
 	i86_pit_send_data (divisor & 0xff, 0);
 	i86_pit_send_data ((divisor >> 8) & 0xff, 0);
 
+	_pit_divisor = divisor;
+	_pit_bIsOneshot = 0;
 	_pit_ticks=0;
 }
 
+static uint16_t i86_pit_read_counter0(){
+	i86_pit_send_command(I86_PIT_OCW_COUNTER_0 | I86_PIT_OCW_RL_LATCH);
+
+	uint16_t count = i86_pit_read_data(I86_PIT_OCW_COUNTER_0);
+	count |= (uint16_t)i86_pit_read_data(I86_PIT_OCW_COUNTER_0) << 8;
+
+	return count;
+}
+
+void i86_pit_start_oneshot(){
+	if(_pit_divisor == 0)
+		return;
+
+	uint32_t flags = i86_pit_lock();
+
+	_pit_clocks = 0;
+	_pit_bIsOneshot = 1;
+
+	i86_pit_arm_oneshot(1);
+
+	i86_pit_unlock(flags);
+}
+
+int i86_pit_is_oneshot(){
+	return _pit_bIsOneshot;
+}
+
+uint32_t i86_pit_update_tick_count(){
+	if(!_pit_bIsOneshot)
+		return _pit_ticks;
+
+	uint16_t count = i86_pit_read_counter0();
+
+	// The counter wraps around and keeps counting once it has reached
+	// zero, so this also holds if the interrupt is late
+	_pit_clocks += (uint16_t)(_pit_last_count - count);
+	_pit_last_count = count;
+
+	while(_pit_clocks >= _pit_divisor){
+		_pit_clocks -= _pit_divisor;
+		_pit_ticks++;
+	}
+
+	return _pit_ticks;
+}
+
+uint32_t i86_pit_get_oneshot_max_ticks(){
+	if(_pit_divisor == 0)
+		return 1;
+
+	return 0xFFFF / _pit_divisor;
+}
+
+void i86_pit_arm_oneshot(uint32_t ticks){
+	if(!_pit_bIsOneshot)
+		return;
+
+	if(ticks == 0)
+		ticks = 1;
+
+	if(ticks > i86_pit_get_oneshot_max_ticks())
+		ticks = i86_pit_get_oneshot_max_ticks();
+
+	// Fire on a tick boundary, the clocks of the current tick have passed
+	uint32_t count = ticks * _pit_divisor - _pit_clocks;
+
+	if(count > 0xFFFF)
+		count = 0xFFFF;
+
+	// Clocks between the read above and the load are lost, a few per
+	// interrupt
+	i86_pit_send_command(I86_PIT_OCW_COUNTER_0 | I86_PIT_OCW_RL_DATA | I86_PIT_OCW_MODE_TERMINALCOUNT);
+
+	i86_pit_send_data(count & 0xff, I86_PIT_OCW_COUNTER_0);
+	i86_pit_send_data((count >> 8) & 0xff, I86_PIT_OCW_COUNTER_0);
+
+	_pit_last_count = (uint16_t)count;
+}
+
 void i86_pit_initialize(){
 	setvect (32, i86_pit_irq, 0);
 
@@ -0,0 +1,166 @@
+#include <kernel/bench.h>
+
+#include <mm/physmem.h>
+#include <mm/virtmem.h>
+#include <hal/hal.h>
+#include <hal/cpu.h>
+
+#include <lib/string.h>
+#include <lib/stdio.h>
+
+#define BENCH_PMM_ITERATIONS 10000
+#define BENCH_PMM_RUN_ITERATIONS 100
+
+// Blocks pinned to fragment memory, at most half of the free blocks
+#define BENCH_PMM_PINNED 16384
+
+// Runs longer than the largest buddy block are found by scanning the bitmap
+#define BENCH_PMM_RUN 2048
+
+// Returns the average number of cycles for an alloc/free pair of one block
+static uint32_t bench_pmm_pair(){
+
+	uint64_t start = bench_rdtsc();
+
+	for(int i = 0; i < BENCH_PMM_ITERATIONS; ++i){
+		void* block = pmmngr_alloc_block();
+
+		if(block)
+			pmmngr_free_block(block);
+	}
+
+	// Avoid the 64 bit division, the run is short enough for 32 bits.
+	return (uint32_t)(bench_rdtsc() - start) / BENCH_PMM_ITERATIONS;
+}
+
+// Returns the average number of cycles for an alloc/free pair of a run
+// that is too long for the buddy allocator
+static uint32_t bench_pmm_run(){
+
+	uint64_t start = bench_rdtsc();
+
+	for(int i = 0; i < BENCH_PMM_RUN_ITERATIONS; ++i){
+		void* run = pmmngr_alloc_blocks(BENCH_PMM_RUN);
+
+		if(run)
+			pmmngr_free_blocks(run, BENCH_PMM_RUN);
+	}
+
+	return (uint32_t)(bench_rdtsc() - start) / BENCH_PMM_RUN_ITERATIONS;
+}
+
+void bench_pmm(){
+
+	uint32_t blocks = pmmngr_get_free_block_count();
+
+	printf("\nPMM benchmark, %i free blocks (%i MB)", blocks, blocks / 256);
+
+	printf("\nEmpty: %i cycles per alloc/free", bench_pmm_pair());
+	printf("\nEmpty: %i cycles per %i block run", bench_pmm_run(), BENCH_PMM_RUN);
+
+	// Pin the lowest blocks, then free every second one. That leaves single
+	// free blocks scattered over the start of the bitmap, which the searches
+	// have to get past, and keeps the rest of memory free for the runs.
+	uint32_t pin = blocks / 2;
+
+	if(pin > BENCH_PMM_PINNED)
+		pin = BENCH_PMM_PINNED;
+
+	void** pinned = kmalloc(pin * sizeof(void*));
+
+	if(!pinned){
+		printf("\nOut of memory");
+		return;
+	}
+
+	uint32_t count;
+
+	for(count = 0; count < pin; ++count){
+		pinned[count] = pmmngr_alloc_block();
+
+		if(!pinned[count])
+			break;
+	}
+
+	for(uint32_t i = 0; i < count; i += 2){
+		pmmngr_free_block(pinned[i]);
+		pinned[i] = 0;
+	}
+
+	printf("\nFragmented, %i holes: %i cycles per alloc/free", count / 2, bench_pmm_pair());
+	printf("\nFragmented, %i holes: %i cycles per %i block run", count / 2, bench_pmm_run(), BENCH_PMM_RUN);
+
+	for(uint32_t i = 0; i < count; ++i){
+		if(pinned[i])
+			pmmngr_free_block(pinned[i]);
+	}
+
+	kfree(pinned);
+}
+
+#define BENCH_SWITCH_ITERATIONS 1000
+#define BENCH_SWITCH_PAGES 64
+
+// Returns the average number of cycles for a switch to another address
+// space and back, touching a set of kernel pages after each switch.
+static uint32_t bench_switch_round(pdirectory* other, volatile uint8_t* pages){
+
+	pdirectory* home = vmmngr_get_directory();
+
+	uint64_t start = bench_rdtsc();
+
+	for(int i = 0; i < BENCH_SWITCH_ITERATIONS; ++i){
+		vmmngr_switch_pdirectory(other);
+
+		for(int p = 0; p < BENCH_SWITCH_PAGES; ++p)
+			(void)pages[p * 4096];
+
+		vmmngr_switch_pdirectory(home);
+
+		for(int p = 0; p < BENCH_SWITCH_PAGES; ++p)
+			(void)pages[p * 4096];
+	}
+
+	return (uint32_t)(bench_rdtsc() - start) / BENCH_SWITCH_ITERATIONS;
+}
+
+void bench_switch(){
+
+	if(!(get_cpu_features() & CPU_FEATURE_PGE)){
+		printf("\nThe CPU does not support global pages");
+		return;
+	}
+
+	volatile uint8_t* pages = kmalloc_a(BENCH_SWITCH_PAGES * 4096, 4096);
+
+	if(!pages){
+		printf("\nOut of memory");
+		return;
+	}
+
+	// Touch the pages once so they are backed in both address spaces
+	for(int p = 0; p < BENCH_SWITCH_PAGES; ++p)
+		pages[p * 4096] = 0;
+
+	pdirectory* other = vmmngr_cloneAddressSpace();
+
+	if(!other){
+		kfree((void*)pages);
+		printf("\nOut of memory");
+		return;
+	}
+
+	printf("\nSwitch benchmark, %i kernel pages touched per switch", BENCH_SWITCH_PAGES);
+
+	printf("\nGlobal pages: %i cycles per switch pair", bench_switch_round(other, pages));
+
+	vmmngr_set_global_pages(0);
+
+	printf("\nNo global pages: %i cycles per switch pair", bench_switch_round(other, pages));
+
+	vmmngr_set_global_pages(1);
+
+	vmmngr_destroyAddressSpace(other);
+
+	kfree((void*)pages);
+}
@@ -1,5 +1,7 @@
 #include <kernel/exception.h>
 #include <kernel/panic.h>
+#include <mm/virtmem.h>
+#include <proc/task.h>
 #include <lib/stdint.h>
 
 void divide_by_zero_fault (
@@ -71,6 +73,11 @@ void no_device_fault (
     unsigned int eip, 
     unsigned int eflags
     ){
+
+	// The FPU was left to another thread at the last switch
+	if(thread_fpu_fault())
+		return;
+
 	kernel_panic("Device not found");
 	for(;;);
 }
@@ -128,22 +135,17 @@ void general_protection_fault (
 }
 
 void page_fault (
-	unsigned int cs, 
+	unsigned int addr,
 	unsigned int err,
-    unsigned int eip, 
-    unsigned int eflags
-    ){
-	asm volatile ("cli");
-	asm volatile ("sub $4, %ebp");
-	
-	int faultAddr;
-
-	asm volatile ("mov %%cr2, %0" : "=r"(faultAddr));
+	unsigned int eip
+	){
 
-	kernel_panic("Page fault at %#0(6)p:%#0(10)p: referenced memory at %#0(10)p(flags: %#x)", 
-		cs, err, faultAddr, eip);
+	// Reserved memory is backed on first touch
+	if(vmmngr_handle_fault(addr, err))
+		return;
 
-	//asm volatile ("popal; leave; iret");
+	kernel_panic("Page fault at %#0(10)p: referenced memory at %#0(10)p(flags: %#x)", 
+		eip, addr, err);
 	
 	asm volatile ("cli");
 	asm volatile ("hlt");
@@ -57,7 +57,8 @@ _loader:
     mov cr4, ecx
  
     mov ecx, cr0
-    or ecx, 0x80000000                          ; Set PG bit in CR0 to enable paging.
+    or ecx, 0x80010000                          ; Set PG bit in CR0 to enable paging, and WP
+                                                ; so the kernel honours read-only pages.
     mov cr0, ecx
  
     ; Start fetching instructions in kernel space.
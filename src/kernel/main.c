@@ -5,11 +5,17 @@
 #include <hal/idt.h>
 #include <hal/tss.h>
 #include <kernel/exception.h>
+#include <kernel/panic.h>
+#include <kernel/bench.h>
 #include <kernel/multiboot.h>
 #include <lib/size_t.h>
 #include <mm/physmem.h>
 #include <mm/virtmem.h>
 #include <mm/kernel_heap.h>
+#include <mm/heap_stats.h>
+#include <mm/zero_pool.h>
+#include <mm/dma_zone.h>
+#include <mm/mem_zone.h>
 #include <input/keyboard.h>
 #include <input/mouse.h>
 #include <floppy/floppy.h>
@@ -272,13 +278,13 @@ void init(multiboot_info_t* mb_ptr, unsigned int esp){
 	setvect (4,(void (*)(void))overflow_trap, 0);
 	setvect (5,(void (*)(void))bounds_check_fault, 0);
 	setvect (6,(void (*)(void))invalid_opcode_fault, 0);
-	setvect (7,(void (*)(void))no_device_fault, 0);
+	setvect (7,(void (*)(void))no_device_isr, 0);
 	setvect (8,(void (*)(void))double_fault_abort, 0);
 	setvect (10,(void (*)(void))invalid_tss_fault, 0);
 	setvect (11,(void (*)(void))no_segment_fault, 0);
 	setvect (12,(void (*)(void))stack_fault, 0);
 	setvect (13,(void (*)(void))general_protection_fault, 0);
-	setvect (14,(void (*)(void))page_fault, 0);
+	setvect (14,(void (*)(void))page_fault_isr, 0);
 	setvect (16,(void (*)(void))fpu_fault, 0);
 	setvect (17,(void (*)(void))alignment_check_fault, 0);
 	setvect (18,(void (*)(void))machine_check_abort, 0);
@@ -290,10 +296,6 @@ void init(multiboot_info_t* mb_ptr, unsigned int esp){
 
 	//clearScreen();
 
-	uint32_t memSize = 1024 + mb_ptr->mem_lower + mb_ptr->mem_upper;
-
-	//printf("Memory size: %i kB (%i MB)\n", memSize, memSize/1024);
-
 	uint32_t kernel_end = (uint32_t)(&end);
 
 	//printf("End: %#p\n", kernel_end);
@@ -302,8 +304,6 @@ void init(multiboot_info_t* mb_ptr, unsigned int esp){
 
 	//printf("Kernel size: %#i\n", kernel_size);
 
-	pmmngr_init(memSize, 0xC0000000 + kernel_size);
-
 	// Calculate number of mmap entries
 	size_t entries = mb_ptr->mmap_length / sizeof(memory_map_t);
 	
@@ -311,6 +311,7 @@ void init(multiboot_info_t* mb_ptr, unsigned int esp){
 
 	//printf("Mem_map: %#p\n", mem_map);
 
+	// Collect the usable memory first, the PMM sizes its maps after it
 	for(int i = 0; i < entries; ++i){
 		/*printf("[Entry %i] Size: %i, addr_high: %p, addr_low: %p\n, length_high: %i, length_low: %i, type: %s\n",
 			i,
@@ -321,16 +322,45 @@ void init(multiboot_info_t* mb_ptr, unsigned int esp){
 			mem_map[i].length_low,
 			strMemoryTypes[mem_map[i].type]);*/
 		
+		// Memory above 4GB can not be reached
+		if(mem_map[i].type != 1 || mem_map[i].base_addr_high)
+			continue;
 
-		if(mem_map[i].type == 1){
-			pmmngr_init_region(mem_map[i].base_addr_low + 0xC0000000, mem_map[i].length_low);
-			//printf("Initializing region: A:%#p, S:%i\n", mem_map[i].base_addr_low  + 0xC0000000, mem_map[i].length_low);
-		}
+		size_t length = mem_map[i].length_low;
+
+		if(mem_map[i].length_high || mem_map[i].base_addr_low + length < mem_map[i].base_addr_low)
+			length = 0xFFFFFFFF - mem_map[i].base_addr_low;
+
+		pmmngr_add_extent(mem_map[i].base_addr_low + 0xC0000000, length);
+		//printf("Adding extent: A:%#p, S:%i\n", mem_map[i].base_addr_low  + 0xC0000000, length);
 	}
 
+	// Without a memory map, use the lower and upper memory
+	if(!pmmngr_get_extent_memory_size()){
+		pmmngr_add_extent(0xC0000000, mb_ptr->mem_lower * 1024);
+		pmmngr_add_extent(0xC0100000, mb_ptr->mem_upper * 1024);
+	}
+
+	uint32_t memSize = pmmngr_get_extent_memory_size();
+
+	//printf("Memory size: %i kB (%i MB)\n", memSize, memSize/1024);
+
+	// The PMM metadata follows the kernel image. It is written before the
+	// VMM runs, so it has to fit in the 4MB mapped at boot.
+	uint32_t pmmMetadata = (kernel_end + 0xFFF) & ~0xFFF;
+	uint32_t pmmMetadataSize = pmmngr_get_metadata_size(memSize);
+
+	if(pmmMetadata + pmmMetadataSize > 0xC0400000)
+		kernel_panic("PMM metadata (%i bytes) does not fit below 4MB", pmmMetadataSize);
+
+	pmmngr_init(memSize, pmmMetadata);
+
 	pmmngr_deinit_region(0xC0100000, kernel_size);
+	pmmngr_deinit_region(pmmMetadata, pmmngr_get_bitmap_size());
 	pmmngr_deinit_region(0xC0001000, 0x4000); // For VESA
 
+	mem_zone_init();
+
 	//printf ("\npmm regions initialized: %i allocation blocks; used or reserved blocks: %i\nfree blocks: %i\n",
 	//	pmmngr_get_block_count (),  pmmngr_get_use_block_count (), pmmngr_get_free_block_count () );
 
@@ -338,6 +368,13 @@ void init(multiboot_info_t* mb_ptr, unsigned int esp){
 
 	vmmngr_initialize();
 
+	if(vmmngr_enable_global_pages())
+		printf("Global kernel pages enabled\n");
+
+	printf("Initializing DMA zone\n");
+
+	dma_zone_init();
+
 	printf("Initializing ACPI\n");
 
 	initAcpi();
@@ -571,6 +608,99 @@ int run_cmd (char* cmd_buf) {
 
 	}
 
+	//! dump heap statistics to COM1
+	else if (strcmp(cmd_buf, "heapstat") == 0) {
+		heap_stats_t stats;
+
+		heap_stats_get(&stats);
+
+		printf("\nHeap: %i bytes, used: %i (peak %i), largest free: %i, fragmentation: %i/1000",
+			stats.heapSize,
+			stats.usedBytes,
+			stats.peakUsedBytes,
+			stats.largestFreeBlock,
+			stats.fragmentation);
+
+		heap_stats_dump();
+
+		printf("\nPer tag statistics written to COM1");
+	}
+
+	//! give free heap pages back to the PMM
+	else if (strcmp(cmd_buf, "heaptrim") == 0) {
+		uint32_t reclaimed = heap_trim();
+
+		printf("\nReclaimed %i bytes, heap is now %i bytes",
+			reclaimed,
+			(uint32_t)heap_get_current_end() - KERNEL_HEAP_START);
+	}
+
+	//! zeroed page pool statistics
+	else if (strcmp(cmd_buf, "zeropool") == 0) {
+		zero_pool_stats_t stats;
+
+		zero_pool_get_stats(&stats);
+
+		printf("\nZeroed pages: %i, hits: %i, misses: %i, refilled: %i",
+			stats.count,
+			stats.hits,
+			stats.misses,
+			stats.refilled);
+	}
+
+	//! free frames by zone and reclaim counters
+	else if (strcmp(cmd_buf, "zones") == 0) {
+		mem_zone_stats_t zone;
+		mem_zone_reclaim_stats_t reclaim;
+
+		for (uint32_t i = 0; mem_zone_get_stats(i, &zone); ++i) {
+			printf("\n%s: frames %i-%i, free %i, reserved %i, watermarks %i/%i/%i",
+				zone.name,
+				zone.firstBlock,
+				zone.endBlock,
+				zone.free,
+				zone.reserved,
+				zone.min,
+				zone.low,
+				zone.high);
+		}
+
+		mem_zone_get_reclaim_stats(&reclaim);
+
+		printf("\nReclaim: %i low, %i failing, %i frames reclaimed, %i failures",
+			reclaim.lowRuns,
+			reclaim.failRuns,
+			reclaim.reclaimed,
+			reclaim.failures);
+
+		for (uint32_t i = 0; mem_zone_get_reclaimer_name(i); ++i) {
+			printf("\n  %s", mem_zone_get_reclaimer_name(i));
+		}
+	}
+
+	//! kernel and user stack pool occupancy
+	else if (strcmp(cmd_buf, "stacks") == 0) {
+		StackPoolStats kernel;
+		StackPoolStats user;
+
+		thread_get_stack_stats(&kernel, &user);
+
+		printf("\nKernel stacks: %i in use, %i free, %i max, %i bytes each",
+			kernel.inUse, kernel.free, kernel.capacity, kernel.stackSize);
+		printf("\nUser stacks: %i in use, %i free, %i max, %i bytes each",
+			user.inUse, user.free, user.capacity, user.stackSize);
+	}
+
+	//! time the physical memory manager
+	else if (strcmp(cmd_buf, "pmmbench") == 0) {
+		bench_pmm();
+	}
+
+	//! time address space switches
+	else if (strcmp(cmd_buf, "switchbench") == 0) {
+		bench_switch();
+	}
+
 	//! help
 	else if (strcmp (cmd_buf, "help") == 0) {
 
@@ -848,6 +978,19 @@ void time_updater()
 	}
 }
 
+// Ticks between refills of the zeroed page pool
+#define ZERO_POOL_INTERVAL 5
+
+void zero_pool_worker()
+{
+	while(1)
+	{
+		zero_pool_refill();
+
+		thread_sleep(ZERO_POOL_INTERVAL);
+	}
+}
+
 void idle_func()
 {
 	
@@ -858,6 +1001,9 @@ void idle_func()
 
 	Thread* time_updater_thread = createThread(getKernelProcess(), time_updater, 1);
 
+	Thread* zero_pool_thread = createThread(getKernelProcess(), zero_pool_worker, 1);
+	thread_set_priority(zero_pool_thread, THREAD_PRIORITY_IDLE);
+
 	run();
 
 	acpiPowerOff();
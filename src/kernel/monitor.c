@@ -114,7 +114,7 @@ void monitor_putch(char c) {
 void monitor_puts(const char* s){
 
 	asm volatile ("cli");
-	lock(&mon_mutex);
+	mutex_lock(&mon_mutex);
 
 	while(*s){
 
@@ -122,7 +122,7 @@ void monitor_puts(const char* s){
 		
 	}
 
-	unlock(&mon_mutex);
+	mutex_unlock(&mon_mutex);
 	asm volatile ("sti");
 
 }
@@ -0,0 +1,27 @@
+[bits 32]
+
+[global no_device_isr]
+[extern no_device_fault]
+
+;*
+;	Device not available handler
+;
+;	Raised by the first FPU/SSE instruction after a task switch set CR0.TS.
+;	Unlike the other exceptions it is handled and returns, retrying the
+;	instruction with the state of the current thread loaded.
+;
+no_device_isr:
+
+	; Save state
+	pushad
+
+	push	dword [esp + 40]	; Push EFLAGS
+	push	dword [esp + 36]	; Push EIP
+	push	dword [esp + 44]	; Push CS
+	call	no_device_fault
+	add		esp, 12
+
+	; Restore state
+	popad
+
+	iretd
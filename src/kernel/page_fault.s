@@ -0,0 +1,33 @@
+[bits 32]
+
+[global page_fault_isr]
+[extern page_fault]
+
+;*
+;	Page fault handler
+;
+;	The CPU pushes an error code for page faults, which has to be removed
+;	before returning. The C handler gets the faulting address from CR2, the
+;	error code and the faulting EIP.
+;
+page_fault_isr:
+
+	; Save state
+	pushad
+
+	mov		eax, cr2
+
+	push	dword [esp + 36]	; Push EIP
+	push	dword [esp + 36]	; Push error code
+	push	eax					; Push faulting address
+	call	page_fault
+	add		esp, 12
+
+	; Restore state
+	popad
+
+	; Pop error code
+	add		esp, 4
+
+	; Return from interrupt, retrying the faulting instruction.
+	iretd
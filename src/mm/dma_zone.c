@@ -0,0 +1,231 @@
+/** @file dma_zone.c
+ *  @brief DMA zone allocator.
+ *
+ *	Every 64KB segment of the zone has a 16 bit map with one bit per page.
+ *	A buffer of n pages is placed by and'ing the free bits of a segment with
+ *	itself shifted by 1 to n - 1, which leaves the bits where a free run of
+ *	n pages starts. With four segments and at most 16 shifts per segment
+ *	the search is bounded, and nothing outside the zone is ever looked at.
+ *
+ *	Buffers larger than a segment are given whole segments, which keeps
+ *	them 64KB aligned.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include <mm/dma_zone.h>
+
+#include <mm/virtmem.h>
+
+#include <lib/stdio.h>
+
+#define PAGE_SIZE 4096
+
+// Pages in a segment, one bit each in the segment map
+#define DMA_ZONE_SEGMENT_PAGES (DMA_ZONE_SEGMENT_SIZE / PAGE_SIZE)
+
+#define DMA_ZONE_SEGMENT_FULL 0xFFFF
+
+static physical_addr _dma_zone_base = 0;
+
+// Set bits are used pages
+static uint16_t _dma_zone_map[DMA_ZONE_SEGMENTS];
+
+static uint32_t _dma_zone_free = 0;
+
+//=============================================================================
+// Helpers
+//=============================================================================
+
+// Disables interrupts and returns the previous flags
+static inline uint32_t dma_zone_lock(){
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void dma_zone_unlock(uint32_t flags){
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+// Finds a run of free pages inside one segment. Returns the page index
+// within the zone, or -1.
+static int dma_zone_find_pages(uint32_t pages){
+
+	for(uint32_t s = 0; s < DMA_ZONE_SEGMENTS; ++s){
+
+		uint32_t free = ~_dma_zone_map[s] & DMA_ZONE_SEGMENT_FULL;
+		uint32_t runs = free;
+
+		for(uint32_t i = 1; i < pages && runs; ++i)
+			runs &= free >> i;
+
+		if(runs){
+			uint32_t first;
+
+			asm ("bsf %1, %0" : "=r"(first) : "rm"(runs));
+
+			return s * DMA_ZONE_SEGMENT_PAGES + first;
+		}
+	}
+
+	return -1;
+}
+
+// Finds a run of free segments. Returns the index of the first, or -1.
+static int dma_zone_find_segments(uint32_t segments){
+
+	uint32_t run = 0;
+
+	for(uint32_t s = 0; s < DMA_ZONE_SEGMENTS; ++s){
+
+		if(_dma_zone_map[s]){
+			run = 0;
+			continue;
+		}
+
+		if(++run == segments)
+			return s + 1 - segments;
+	}
+
+	return -1;
+}
+
+// Sets or clears the bits of pages [first, first + pages)
+static void dma_zone_mark(uint32_t first, uint32_t pages, int used){
+
+	for(uint32_t page = first; page < first + pages; ++page){
+
+		uint16_t bit = 1 << (page % DMA_ZONE_SEGMENT_PAGES);
+
+		if(used)
+			_dma_zone_map[page / DMA_ZONE_SEGMENT_PAGES] |= bit;
+		else
+			_dma_zone_map[page / DMA_ZONE_SEGMENT_PAGES] &= ~bit;
+	}
+}
+
+// Number of pages a buffer of the given size takes
+static uint32_t dma_zone_pages(size_t size){
+
+	uint32_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	// Buffers larger than a segment take whole segments
+	if(pages > DMA_ZONE_SEGMENT_PAGES)
+		pages = (pages + DMA_ZONE_SEGMENT_PAGES - 1) & ~(DMA_ZONE_SEGMENT_PAGES - 1);
+
+	return pages;
+}
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+int dma_zone_init(){
+
+	// Take enough frames to find a 64KB aligned run in them
+	uint32_t blocks = (DMA_ZONE_SIZE + DMA_ZONE_SEGMENT_SIZE) / PAGE_SIZE - 1;
+
+	physical_addr frames = (physical_addr)pmmngr_alloc_blocks(blocks);
+
+	if(!frames)
+		return 0;
+
+	physical_addr base = (frames + DMA_ZONE_SEGMENT_SIZE - 1) & ~(DMA_ZONE_SEGMENT_SIZE - 1);
+
+	if(base + DMA_ZONE_SIZE > DMA_ZONE_LIMIT){
+		pmmngr_free_blocks((void*)frames, blocks);
+		printf("[DMA] No memory below 16MB for the DMA zone\n");
+		return 0;
+	}
+
+	// Give back what is left over around the zone
+	uint32_t head = (base - frames) / PAGE_SIZE;
+	uint32_t tail = blocks - head - DMA_ZONE_SIZE / PAGE_SIZE;
+
+	if(head)
+		pmmngr_free_blocks((void*)frames, head);
+
+	if(tail)
+		pmmngr_free_blocks((void*)(base + DMA_ZONE_SIZE), tail);
+
+	vmmngr_mapPhysicalRegion(vmmngr_get_directory(), DMA_ZONE_VIRTUAL, base,
+		DMA_ZONE_SIZE, I86_PTE_PRESENT | I86_PTE_WRITABLE);
+
+	for(uint32_t s = 0; s < DMA_ZONE_SEGMENTS; ++s)
+		_dma_zone_map[s] = 0;
+
+	_dma_zone_base = base;
+	_dma_zone_free = DMA_ZONE_SIZE / PAGE_SIZE;
+
+	return 1;
+}
+
+void* dma_zone_alloc(size_t size, physical_addr* phys){
+
+	if(!_dma_zone_base || size == 0 || size > DMA_ZONE_SIZE)
+		return 0;
+
+	uint32_t pages = dma_zone_pages(size);
+	int first;
+
+	uint32_t flags = dma_zone_lock();
+
+	if(pages <= DMA_ZONE_SEGMENT_PAGES)
+		first = dma_zone_find_pages(pages);
+	else {
+		first = dma_zone_find_segments(pages / DMA_ZONE_SEGMENT_PAGES);
+
+		if(first >= 0)
+			first *= DMA_ZONE_SEGMENT_PAGES;
+	}
+
+	if(first >= 0){
+		dma_zone_mark(first, pages, 1);
+		_dma_zone_free -= pages;
+	}
+
+	dma_zone_unlock(flags);
+
+	if(first < 0)
+		return 0;
+
+	if(phys)
+		*phys = _dma_zone_base + first * PAGE_SIZE;
+
+	return (void*)(DMA_ZONE_VIRTUAL + first * PAGE_SIZE);
+}
+
+void dma_zone_free(void* addr, size_t size){
+
+	uint32_t virt = (uint32_t)addr;
+
+	if(!addr || virt < DMA_ZONE_VIRTUAL || virt >= DMA_ZONE_VIRTUAL + DMA_ZONE_SIZE)
+		return;
+
+	uint32_t first = (virt - DMA_ZONE_VIRTUAL) / PAGE_SIZE;
+	uint32_t pages = dma_zone_pages(size);
+
+	uint32_t flags = dma_zone_lock();
+
+	dma_zone_mark(first, pages, 0);
+	_dma_zone_free += pages;
+
+	dma_zone_unlock(flags);
+}
+
+physical_addr dma_zone_get_physical(void* addr){
+
+	uint32_t virt = (uint32_t)addr;
+
+	if(!_dma_zone_base || virt < DMA_ZONE_VIRTUAL || virt >= DMA_ZONE_VIRTUAL + DMA_ZONE_SIZE)
+		return 0;
+
+	return _dma_zone_base + (virt - DMA_ZONE_VIRTUAL);
+}
+
+uint32_t dma_zone_get_free_count(){
+	return _dma_zone_free;
+}
@@ -0,0 +1,180 @@
+/** @file frame_cache.c
+ *  @brief Page frame cache.
+ *
+ *	Every context has a stack of free frames. Allocations pop from the
+ *	stack and frees push to it. An empty stack is refilled with one run of
+ *	FRAME_CACHE_BATCH frames from the buddy allocator, and a full stack
+ *	gives FRAME_CACHE_BATCH frames back before taking a new one.
+ *
+ *	Frames in a cache are counted as used by the PMM. The caches are used
+ *	by every thread and by page faults, so they are only touched with
+ *	interrupts disabled, as are the PMM entry points.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include <mm/frame_cache.h>
+
+#include <mm/physmem.h>
+#include <mm/mem_zone.h>
+
+#define PMMNGR_BLOCK_SIZE 4096
+
+// Number of contexts with their own cache.
+#define FRAME_CACHE_CONTEXTS 1
+
+typedef struct {
+
+	// Stack of free frames, the top is at frames[count - 1]
+	physical_addr frames[FRAME_CACHE_SIZE];
+
+	uint32_t count;
+
+	// Set while the cache is taking frames from the PMM
+	int refilling;
+
+} frame_cache_t;
+
+static frame_cache_t _frame_caches[FRAME_CACHE_CONTEXTS];
+
+//=============================================================================
+// Helpers
+//=============================================================================
+
+// Disables interrupts and returns the previous flags
+static inline uint32_t frame_cache_lock(){
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void frame_cache_unlock(uint32_t flags){
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+static inline frame_cache_t* frame_cache_current(){
+
+	// There is only one processor, index by CPU number once there are more.
+	return &_frame_caches[0];
+}
+
+static void frame_cache_release(frame_cache_t* cache, uint32_t count);
+
+// Reclaim callbacks run by the PMM may free frames into the cache while it
+// is refilled, but the cache is not drained until the refill is done.
+static void frame_cache_refill(frame_cache_t* cache){
+
+	cache->refilling = 1;
+
+	physical_addr run = (physical_addr)pmmngr_alloc_blocks(FRAME_CACHE_BATCH);
+
+	if(run){
+
+		if(cache->count > FRAME_CACHE_SIZE - FRAME_CACHE_BATCH)
+			frame_cache_release(cache, cache->count - (FRAME_CACHE_SIZE - FRAME_CACHE_BATCH));
+
+		// Push in reverse so the lowest frame is on top
+		for(int i = FRAME_CACHE_BATCH - 1; i >= 0; --i)
+			cache->frames[cache->count++] = run + i * PMMNGR_BLOCK_SIZE;
+
+		cache->refilling = 0;
+		return;
+	}
+
+	// Memory is too fragmented for a run, take what single frames there are.
+	while(cache->count < FRAME_CACHE_BATCH){
+
+		physical_addr frame = (physical_addr)pmmngr_alloc_block();
+
+		if(!frame)
+			break;
+
+		cache->frames[cache->count++] = frame;
+	}
+
+	cache->refilling = 0;
+}
+
+static void frame_cache_release(frame_cache_t* cache, uint32_t count){
+
+	while(count-- && cache->count)
+		pmmngr_free_block((void*)cache->frames[--cache->count]);
+}
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void* frame_cache_alloc(){
+
+	uint32_t flags = frame_cache_lock();
+
+	frame_cache_t* cache = frame_cache_current();
+
+	int refilled = 0;
+
+	if(!cache->count){
+		frame_cache_refill(cache);
+		refilled = 1;
+	}
+
+	void* frame = 0;
+
+	// Out of memory otherwise
+	if(cache->count)
+		frame = (void*)cache->frames[--cache->count];
+
+	// The PMM does not balance the zones during a refill
+	if(frame && refilled)
+		mem_zone_balance();
+
+	frame_cache_unlock(flags);
+
+	return frame;
+}
+
+void frame_cache_free(void* p){
+
+	if(!p)
+		return;
+
+	// A shared frame stays with its other owners
+	if(pmmngr_unshare_block(p))
+		return;
+
+	uint32_t flags = frame_cache_lock();
+
+	frame_cache_t* cache = frame_cache_current();
+
+	if(cache->count == FRAME_CACHE_SIZE)
+		frame_cache_release(cache, FRAME_CACHE_BATCH);
+
+	cache->frames[cache->count++] = (physical_addr)p;
+
+	frame_cache_unlock(flags);
+}
+
+void frame_cache_drain(){
+
+	uint32_t flags = frame_cache_lock();
+
+	frame_cache_t* cache = frame_cache_current();
+
+	// The frames are wanted by the refill in progress
+	if(!cache->refilling)
+		frame_cache_release(cache, cache->count);
+
+	frame_cache_unlock(flags);
+}
+
+int frame_cache_is_refilling(){
+
+	return frame_cache_current()->refilling;
+}
+
+uint32_t frame_cache_get_count(){
+
+	return frame_cache_current()->count;
+}
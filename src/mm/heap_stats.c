@@ -0,0 +1,145 @@
+/** @file heap_stats.c
+ *  @brief Kernel heap accounting.
+ *
+ *	Keeps per tag statistics of the kernel heap. Comments are mapped to tags
+ *	through a small cache keyed on the comment pointer, since most comments
+ *	are string literals. On a miss the tag table is searched by name.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include <mm/heap_stats.h>
+
+#include <mm/kernel_heap.h>
+
+#include <lib/string.h>
+#include <lib/stdio.h>
+
+#define HEAP_STATS_CACHE_SIZE 64
+
+typedef struct
+{
+	const char* comment;
+	uint8_t tag;
+} heap_tag_cache_entry_t;
+
+static heap_tag_stats_t _heap_tags[HEAP_STATS_MAX_TAGS] = {{"Other"}, {"Slab"}};
+static uint32_t _heap_tag_count = 2;
+
+static heap_tag_cache_entry_t _heap_tag_cache[HEAP_STATS_CACHE_SIZE] = {{0}};
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+uint8_t heap_stats_tag(const char* comment)
+{
+	if (!comment)
+	{
+		return 0;
+	}
+
+	heap_tag_cache_entry_t* entry =
+		&_heap_tag_cache[((uintptr_t)comment >> 2) % HEAP_STATS_CACHE_SIZE];
+
+	// The name is checked as well, the comment could be a reused buffer.
+	if (entry->comment == comment &&
+		strncmp(_heap_tags[entry->tag].name, comment, HEAP_STATS_NAME_LENGTH - 1) == 0)
+	{
+		return entry->tag;
+	}
+
+	uint8_t tag = 0;
+
+	for (uint32_t i = 1; i < _heap_tag_count; ++i)
+	{
+		if (strncmp(_heap_tags[i].name, comment, HEAP_STATS_NAME_LENGTH - 1) == 0)
+		{
+			tag = i;
+			break;
+		}
+	}
+
+	// Create a new tag if there is room
+	if (!tag && _heap_tag_count < HEAP_STATS_MAX_TAGS)
+	{
+		tag = _heap_tag_count++;
+
+		memset(&_heap_tags[tag], 0, sizeof(heap_tag_stats_t));
+		strncpy(_heap_tags[tag].name, comment, HEAP_STATS_NAME_LENGTH - 1);
+		_heap_tags[tag].name[HEAP_STATS_NAME_LENGTH - 1] = 0;
+	}
+
+	entry->comment = comment;
+	entry->tag = tag;
+
+	return tag;
+}
+
+void heap_stats_alloc(uint8_t tag, uint32_t size)
+{
+	heap_tag_stats_t* stats = &_heap_tags[tag];
+
+	stats->liveBytes += size;
+	stats->liveCount++;
+	stats->allocCount++;
+
+	if (stats->liveBytes > stats->peakBytes)
+	{
+		stats->peakBytes = stats->liveBytes;
+	}
+}
+
+void heap_stats_free(uint8_t tag, uint32_t size)
+{
+	heap_tag_stats_t* stats = &_heap_tags[tag];
+
+	stats->liveBytes -= size;
+	stats->liveCount--;
+}
+
+uint32_t heap_stats_tag_count()
+{
+	return _heap_tag_count;
+}
+
+const heap_tag_stats_t* heap_stats_get_tag(uint32_t tag)
+{
+	if (tag >= _heap_tag_count)
+	{
+		return 0;
+	}
+
+	return &_heap_tags[tag];
+}
+
+void heap_stats_dump()
+{
+	heap_stats_t stats;
+
+	heap_stats_get(&stats);
+
+	serial_printf(COM1, "\n[HEAP] Heap size: %i bytes\n", stats.heapSize);
+	serial_printf(COM1, "[HEAP] Used: %i bytes (peak %i)\n", stats.usedBytes, stats.peakUsedBytes);
+	serial_printf(COM1, "[HEAP] Free: %i bytes in %i regions, largest %i\n",
+		stats.freeBytes, stats.freeRegionCount, stats.largestFreeBlock);
+	serial_printf(COM1, "[HEAP] Fragmentation: %i/1000\n", stats.fragmentation);
+	serial_printf(COM1, "[HEAP] Slabs: %i bytes, objects counted under their own tags\n", stats.slabBytes);
+	serial_printf(COM1, "[HEAP] Reclaimed: %i bytes\n", stats.reclaimedBytes);
+
+	serial_printf(COM1, "[HEAP] %-(20)s %(10)s %(8)s %(8)s %(10)s\n",
+		"Tag", "Live", "Objects", "Allocs", "Peak");
+
+	for (uint32_t i = 0; i < _heap_tag_count; ++i)
+	{
+		heap_tag_stats_t* tag = &_heap_tags[i];
+
+		if (!tag->allocCount || i == HEAP_STATS_SLAB_TAG)
+		{
+			continue;
+		}
+
+		serial_printf(COM1, "[HEAP] %-(20)s %(10)i %(8)i %(8)i %(10)i\n",
+			tag->name, tag->liveBytes, tag->liveCount, tag->allocCount, tag->peakBytes);
+	}
+}
@@ -5,32 +5,73 @@
 
 #include <mm/physmem.h>
 #include <mm/virtmem.h>
+#include <mm/slab.h>
+#include <mm/heap_stats.h>
+#include <mm/mem_zone.h>
 
 #define PLACEMENT_BEGIN   0xD0000000U
 #define PLACEMENT_END     0xD0200000U
 
-#define KERNEL_HEAP_START 0xD0200000U
-#define KERNEL_HEAP_END 0xE0000000U
-
 #define PAGE_SIZE 4096U
 
-typedef struct
+typedef struct _region_t
 {
+	// Start of the memory described by this region
+	uint8_t* address;
+
+	// Neighbouring regions in address order
+	struct _region_t* prev;
+	struct _region_t* next;
+
+	// Links in the free list, only valid if the region is not reserved
+	struct _region_t* prevFree;
+	struct _region_t* nextFree;
+
+	// Address index (AVL tree)
+	struct _region_t* left;
+	struct _region_t* right;
+	int32_t height;
+
 	uint32_t size;
 	uint32_t number;
 	uint8_t reserved;
+	uint8_t tag;
 	char comment[21];
-} __attribute__((packed)) region_t;
-
-static region_t* regions = 0;
-static uint32_t regionCount = 0;
-static uint32_t regionMaxCount = 0;
-static uint32_t firstFreeRegion = 0;
-static void* firstFreeAddr = (void*)KERNEL_HEAP_START;
+} region_t;
+
+// Region nodes are carved from pages taken from the heap itself. The pool
+// is refilled before it runs dry, while no region is being modified, so an
+// allocation always has the nodes it needs for its splits.
+#define REGION_RESERVE 8
+
+static int heapInitialized = 0;
+static region_t* unusedRegions = 0;
+static uint32_t unusedRegionCount = 0;
+static int regionPoolGrowing = 0;
+static region_t* regionTree = 0;
+static region_t* lastRegion = 0;
+static region_t* freeRegions = 0;
 static const uint8_t* HEAP_START = (const uint8_t*)KERNEL_HEAP_START;
 static uint32_t heapSize = 0;
+static uint32_t heapUsed = 0;
+static uint32_t heapPeakUsed = 0;
 static const uint32_t HEAP_MIN_GROWTH = 0x10000;
 
+// The heap is trimmed when free memory has grown by this much since the
+// lowest point after the last trim.
+static const uint32_t HEAP_TRIM_HIGH_WATER = 0x200000;
+static uint32_t heapTrimMark = 0x200000;
+static uint32_t heapReclaimed = 0;
+
+// Set while the heap is being modified. Reclaiming runs inside the PMM, and
+// the heap is only trimmed from there when nothing is half modified.
+static uint32_t heapBusy = 0;
+
+// Placement area, only used while the heap is being set up
+static uint8_t* placementNext = (uint8_t*)PLACEMENT_BEGIN;
+static uint8_t* placementEnd = (uint8_t*)PLACEMENT_BEGIN;
+static physical_addr placementFrames = 0;
+
 uint32_t alignUp(uint32_t val, uint32_t alignment);
 
 uint32_t alignDown(uint32_t val, uint32_t alignment);
@@ -40,6 +81,23 @@ void* pmalloc(size_t size, uint32_t alignment);
 int heap_grow(size_t size, uint8_t* heapEnd, int continuous);
 
 void* kmalloc_imp(size_t size, uint32_t alignment, const char* comment);
+void* heap_alloc(size_t size, uint32_t alignment, const char* comment);
+
+static uint32_t heap_reclaim(uint32_t target);
+
+region_t* region_new();
+void region_delete(region_t* region);
+void region_pool_add(void* memory, size_t size);
+void region_pool_grow();
+region_t* region_split(region_t* region, uint32_t offset);
+void region_unlink(region_t* region);
+
+void region_free_list_push(region_t* region);
+void region_free_list_remove(region_t* region);
+
+region_t* region_tree_insert(region_t* root, region_t* region);
+region_t* region_tree_remove(region_t* root, uint8_t* address);
+region_t* region_tree_find(uint8_t* address);
 
 uint32_t alignUp(uint32_t val, uint32_t alignment)
 {
@@ -67,68 +125,429 @@ uint32_t alignDown(uint32_t val, uint32_t alignment)
 
 void* pmalloc(size_t size, uint32_t alignment)
 {
-	static uint8_t* nextPlacement = (uint8_t*)PLACEMENT_BEGIN;
-
 	size = alignUp(size, 4);
 
-	uint8_t* currPlacement = (uint8_t*)alignUp((uint32_t)nextPlacement, alignment);
+	uint8_t* currPlacement = (uint8_t*)alignUp((uint32_t)placementNext, alignment);
 
-	if (((uint32_t)currPlacement + size) > PLACEMENT_END)
+	if (((uint32_t)currPlacement + size) > (uint32_t)placementEnd)
 	{
 		return 0;
 	}
 
-	nextPlacement = currPlacement + size;
+	placementNext = currPlacement + size;
 
 	return currPlacement;
 }
 
+// Gives the unused part of the placement area back to the PMM
+void placement_reclaim()
+{
+	uint32_t start = alignUp((uint32_t)placementNext, PAGE_SIZE);
+
+	if (start >= (uint32_t)placementEnd)
+	{
+		return;
+	}
+
+	uint32_t size = (uint32_t)placementEnd - start;
+
+	vmmngr_unmap_range(vmmngr_get_directory(), start, size);
+
+	// The placement area is backed by one contiguous run of frames
+	pmmngr_free_blocks((void*)(placementFrames + (start - PLACEMENT_BEGIN)), size / PAGE_SIZE);
+
+	placementEnd = (uint8_t*)start;
+}
+
+//=============================================================================
+// Address index
+//=============================================================================
+
+// All regions, free and reserved, are kept in an AVL tree keyed on their
+// address. This makes it possible to find the region owning an address in
+// O(log n) when it is freed.
+
+static int32_t region_tree_height(region_t* node)
+{
+	return node ? node->height : 0;
+}
+
+static void region_tree_update(region_t* node)
+{
+	node->height = 1 + max(region_tree_height(node->left), region_tree_height(node->right));
+}
+
+static region_t* region_tree_rotate_right(region_t* node)
+{
+	region_t* left = node->left;
+
+	node->left = left->right;
+	left->right = node;
+
+	region_tree_update(node);
+	region_tree_update(left);
+
+	return left;
+}
+
+static region_t* region_tree_rotate_left(region_t* node)
+{
+	region_t* right = node->right;
+
+	node->right = right->left;
+	right->left = node;
+
+	region_tree_update(node);
+	region_tree_update(right);
+
+	return right;
+}
+
+static region_t* region_tree_balance(region_t* node)
+{
+	region_tree_update(node);
+
+	int32_t balance = region_tree_height(node->left) - region_tree_height(node->right);
+
+	if (balance > 1)
+	{
+		if (region_tree_height(node->left->left) < region_tree_height(node->left->right))
+		{
+			node->left = region_tree_rotate_left(node->left);
+		}
+
+		return region_tree_rotate_right(node);
+	}
+
+	if (balance < -1)
+	{
+		if (region_tree_height(node->right->right) < region_tree_height(node->right->left))
+		{
+			node->right = region_tree_rotate_right(node->right);
+		}
+
+		return region_tree_rotate_left(node);
+	}
+
+	return node;
+}
+
+region_t* region_tree_insert(region_t* root, region_t* region)
+{
+	if (!root)
+	{
+		region->left = 0;
+		region->right = 0;
+		region->height = 1;
+		return region;
+	}
+
+	if (region->address < root->address)
+	{
+		root->left = region_tree_insert(root->left, region);
+	}
+	else
+	{
+		root->right = region_tree_insert(root->right, region);
+	}
+
+	return region_tree_balance(root);
+}
+
+static region_t* region_tree_remove_min(region_t* root, region_t** min)
+{
+	if (!root->left)
+	{
+		*min = root;
+		return root->right;
+	}
+
+	root->left = region_tree_remove_min(root->left, min);
+
+	return region_tree_balance(root);
+}
+
+region_t* region_tree_remove(region_t* root, uint8_t* address)
+{
+	if (!root)
+	{
+		return 0;
+	}
+
+	if (address < root->address)
+	{
+		root->left = region_tree_remove(root->left, address);
+	}
+	else if (address > root->address)
+	{
+		root->right = region_tree_remove(root->right, address);
+	}
+	else
+	{
+		region_t* left = root->left;
+		region_t* right = root->right;
+
+		if (!right)
+		{
+			return left;
+		}
+
+		// Replace the node with its successor
+		region_t* successor;
+		right = region_tree_remove_min(right, &successor);
+
+		successor->left = left;
+		successor->right = right;
+
+		return region_tree_balance(successor);
+	}
+
+	return region_tree_balance(root);
+}
+
+region_t* region_tree_find(uint8_t* address)
+{
+	region_t* node = regionTree;
+
+	while (node)
+	{
+		if (address == node->address)
+		{
+			return node;
+		}
+
+		node = (address < node->address) ? node->left : node->right;
+	}
+
+	return 0;
+}
+
+//=============================================================================
+// Region bookkeeping
+//=============================================================================
+
+region_t* region_new()
+{
+	region_t* region = unusedRegions;
+
+	if (!region)
+	{
+		return 0;
+	}
+
+	unusedRegions = region->next;
+	unusedRegionCount--;
+
+	memset(region, 0, sizeof(region_t));
+
+	return region;
+}
+
+void region_delete(region_t* region)
+{
+	region->next = unusedRegions;
+	unusedRegions = region;
+	unusedRegionCount++;
+}
+
+void region_pool_add(void* memory, size_t size)
+{
+	region_t* region = (region_t*)memory;
+
+	for (uint32_t i = 0; i < size / sizeof(region_t); ++i)
+	{
+		region_delete(&region[i]);
+	}
+}
+
+void region_pool_grow()
+{
+	// The allocation below uses nodes from the reserve
+	regionPoolGrowing = 1;
+
+	void* page = kmalloc_imp(PAGE_SIZE, PAGE_SIZE, "Heap regions");
+
+	if (page)
+	{
+		region_pool_add(page, PAGE_SIZE);
+	}
+
+	regionPoolGrowing = 0;
+}
+
+void region_free_list_push(region_t* region)
+{
+	region->prevFree = 0;
+	region->nextFree = freeRegions;
+
+	if (freeRegions)
+	{
+		freeRegions->prevFree = region;
+	}
+
+	freeRegions = region;
+}
+
+void region_free_list_remove(region_t* region)
+{
+	if (region->prevFree)
+	{
+		region->prevFree->nextFree = region->nextFree;
+	}
+	else
+	{
+		freeRegions = region->nextFree;
+	}
+
+	if (region->nextFree)
+	{
+		region->nextFree->prevFree = region->prevFree;
+	}
+
+	region->prevFree = 0;
+	region->nextFree = 0;
+}
+
+region_t* region_split(region_t* region, uint32_t offset)
+{
+	region_t* second = region_new();
+
+	if (!second)
+	{
+		return 0;
+	}
+
+	second->address = region->address + offset;
+	second->size = region->size - offset;
+	second->reserved = 0;
+	second->number = 0;
+
+	region->size = offset;
+
+	// Link it in after the region in address order
+	second->prev = region;
+	second->next = region->next;
+
+	if (region->next)
+	{
+		region->next->prev = second;
+	}
+	else
+	{
+		lastRegion = second;
+	}
+
+	region->next = second;
+
+	regionTree = region_tree_insert(regionTree, second);
+
+	return second;
+}
+
+void region_unlink(region_t* region)
+{
+	if (region->prev)
+	{
+		region->prev->next = region->next;
+	}
+
+	if (region->next)
+	{
+		region->next->prev = region->prev;
+	}
+	else
+	{
+		lastRegion = region->prev;
+	}
+
+	regionTree = region_tree_remove(regionTree, region->address);
+}
+
+//=============================================================================
+// Heap
+//=============================================================================
+
 int heap_grow(size_t size, uint8_t* heapEnd, int continuous)
 {
 	//printf("\n[heap_grow] Size:%i, Heap End: %#p, Continuous: %i", size, heapEnd, continuous);
 
-	if ((regionCount > 0) && regions[regionCount - 1].reserved && (regionCount >= regionMaxCount))
+	region_t* region = 0;
+
+	// A new region is needed unless the last region is free and can be
+	// extended.
+	if (!lastRegion || lastRegion->reserved)
 	{
-		//printf("\nError1");
+		region = region_new();
+
+		if (!region)
+		{
+			//printf("\nError1");
+			return 0;
+		}
+	}
+
+	// The pages are backed by the page fault handler when first touched.
+	if (!vmmngr_reserve_range(0, (virtual_addr)heapEnd, size, I86_PTE_WRITABLE))
+	{
+		if (region)
+		{
+			region_delete(region);
+		}
+
 		return 0;
 	}
 
-	uint32_t offset = 0;
+	// Whole 4MB windows of a big growth step are backed with large pages
+	// right away, which keeps them out of the page tables and the TLB. The
+	// kernel directory entries are shared, so other address spaces pick the
+	// window up on their first touch.
+	uint32_t window = alignUp((uint32_t)heapEnd, LARGE_PAGE_SIZE);
 
-	while (offset < size)
+	// Under memory pressure the pages are left to the page fault handler,
+	// which only takes the frames that are used.
+	while ((window + LARGE_PAGE_SIZE <= (uint32_t)heapEnd + size) &&
+		(mem_zone_get_pressure() == MEM_ZONE_PRESSURE_NONE))
 	{
-		physical_addr addr = pmmngr_alloc_block();
+		void* frames = pmmngr_alloc_blocks(LARGE_PAGE_SIZE / PAGE_SIZE);
 
-		vmmngr_mapPhysicalAddress(vmmngr_get_directory(), (uint32_t)heapEnd + offset, (uint32_t)addr, I86_PTE_PRESENT | I86_PTE_WRITABLE);
+		if (!frames)
+		{
+			break;
+		}
 
-		//printf("\nMapping %#p", heapEnd + offset);
+		if (!vmmngr_mapLargePage(vmmngr_get_directory(), window, (uint32_t)frames, I86_PDE_PRESENT | I86_PDE_WRITABLE))
+		{
+			pmmngr_free_blocks(frames, LARGE_PAGE_SIZE / PAGE_SIZE);
+		}
 
-		offset += PAGE_SIZE;
+		window += LARGE_PAGE_SIZE;
 	}
 
 	//printf("\nSize: %i", size);
 
-	if ((regionCount > 0) && !regions[regionCount - 1].reserved)
+	if (!region)
 	{
-		regions[regionCount - 1].size += size;
+		lastRegion->size += size;
 	}
 	else
 	{
+		region->address = heapEnd;
+		region->reserved = 0;
+		region->size = size;
+		region->number = 0;
 
-		//printf("\nSize: %i", size);
-
-		//printf("\n Region address: %#p", regions);
+		region->prev = lastRegion;
+		region->next = 0;
 
-		regions[regionCount].reserved = 0;
-		regions[regionCount].size = size;
-		regions[regionCount].number = 0;
+		if (lastRegion)
+		{
+			lastRegion->next = region;
+		}
 
-		//printf("\nNew Region: %i", regionCount);
-		//printf("\nRegion reserved: %i",(uint32_t) regions[regionCount].reserved);
-		//printf("\nRegion Size: %i", (uint32_t) regions[regionCount].size);
-		//printf("\nRegion Number: %i", (uint32_t) regions[regionCount].number);
+		lastRegion = region;
 
-		++regionCount;
+		regionTree = region_tree_insert(regionTree, region);
+		region_free_list_push(region);
 	}
 
 	heapSize += size;
@@ -142,24 +561,106 @@ void* heap_get_current_end()
 
 void init_kernel_heap()
 {
-	// Map placement area
+	// Map placement area, backed by one physically contiguous run
+
+	void* placement = pmmngr_alloc_blocks((PLACEMENT_END - PLACEMENT_BEGIN) / PAGE_SIZE);
+
+	vmmngr_map_range(vmmngr_get_directory(), PLACEMENT_BEGIN, (physical_addr)placement, PLACEMENT_END - PLACEMENT_BEGIN, I86_PTE_PRESENT | I86_PTE_WRITABLE);
+
+	placementFrames = (physical_addr)placement;
+	placementEnd = (uint8_t*)PLACEMENT_END;
+
+	//printf("Placement mapping done.\n");
+
+	// The first region nodes come from the placement area, later ones from
+	// the heap
+	region_pool_add(pmalloc(PAGE_SIZE, PAGE_SIZE), PAGE_SIZE);
+
+	heapInitialized = 1;
+
+	placement_reclaim();
+
+	mem_zone_register_reclaim("Kernel heap", heap_reclaim);
+
+	slab_init();
+}
+
+// How the pages of a heap range are backed
+#define HEAP_PAGES_UNBACKED		0	// no page is backed yet
+#define HEAP_PAGES_CONTINUOUS	1	// every page is, by continuous frames
+#define HEAP_PAGES_SCATTERED	2	// anything else
+
+static int heap_page_layout(uint8_t* address, size_t size)
+{
+	pdirectory* dir = vmmngr_get_directory();
 
-	uint32_t i = PLACEMENT_BEGIN;
+	uintptr_t first = alignDown((uintptr_t)address, PAGE_SIZE);
+	uintptr_t end = (uintptr_t)address + size;
 
-	for (i; i < PLACEMENT_END; i += PAGE_SIZE)
+	// Physical address the first page has if the range is continuous
+	uintptr_t base = 0;
+	uint32_t backed = 0;
+	uint32_t unbacked = 0;
+
+	for (uintptr_t virt = first; virt < end; virt += PAGE_SIZE)
 	{
-		vmmngr_mapPhysicalAddress(vmmngr_get_directory(), i, (uint32_t)pmmngr_alloc_block(), I86_PTE_PRESENT | I86_PTE_WRITABLE);
+		uintptr_t phys = (uintptr_t)vmmngr_getPhysicalAddress(dir, virt);
+
+		if (!phys)
+		{
+			unbacked++;
+			continue;
+		}
+
+		if (!backed++)
+		{
+			base = phys - (virt - first);
+		}
+		else if (phys != base + (virt - first))
+		{
+			return HEAP_PAGES_SCATTERED;
+		}
 	}
 
-	//printf("Placement mapping done.\n");
+	if (!backed)
+		return HEAP_PAGES_UNBACKED;
+
+	return unbacked ? HEAP_PAGES_SCATTERED : HEAP_PAGES_CONTINUOUS;
+}
 
-	regions = (region_t*)pmalloc(0, 0);
+// Backs the pages of [address, address + size), none of which are backed
+// yet, with one run of continuous frames. Returns 1 on success.
+static int heap_back_continuous(uint8_t* address, size_t size)
+{
+	uintptr_t first = alignDown((uintptr_t)address, PAGE_SIZE);
+	uint32_t pages = (alignUp((uintptr_t)address + size, PAGE_SIZE) - first) / PAGE_SIZE;
+
+	void* frames = pmmngr_alloc_blocks(pages);
+
+	if (!frames)
+		return 0;
+
+	if (!vmmngr_map_range(vmmngr_get_directory(), first, (physical_addr)frames, pages * PAGE_SIZE, I86_PTE_PRESENT | I86_PTE_WRITABLE))
+	{
+		pmmngr_free_blocks(frames, pages);
+		return 0;
+	}
 
-	regionCount = 0;
-	regionMaxCount = (PLACEMENT_END - (uint32_t)regions) / sizeof(region_t);
+	return 1;
 }
 
 void* kmalloc_imp(size_t size, uint32_t alignment, const char* comment)
+{
+	heapBusy++;
+
+	void* addr = heap_alloc(size, alignment, comment);
+
+	heapBusy--;
+
+	return addr;
+}
+
+void* heap_alloc(size_t size, uint32_t alignment, const char* comment)
 {
 	//printf("\n[kmalloc] Size:%i, Alignment: %i, Comment: %s", size, alignment, comment);
 
@@ -178,60 +679,71 @@ void* kmalloc_imp(size_t size, uint32_t alignment, const char* comment)
 
 	int continuous = (alignment & HEAP_CONTINUOUS) ? 1 : 0;
 
+	// Kept for the retry after the heap has grown
+	uint32_t placement = alignment;
+
 	alignment &= HEAP_ALIGNMENT_MASK;
 
 	// Check if heap is set up.
 
-	if (regions == 0)
+	if (!heapInitialized)
 	{
 		//printf("\nError2");
 		return (pmalloc(size, alignment));
 	}
 
-	size = alignUp(size, 0);
-
-	int foundFree = 0;
+	uint8_t tag = heap_stats_tag(comment);
 
-	uint8_t* regionAddress = (uint8_t*)firstFreeAddr;
-
-	for (uint32_t i = firstFreeRegion; i < regionCount;++i)
+	// Small objects without placement requirements are served by the slabs.
+	if ((alignment == 0) && (within == 0xFFFFFFFF) && !continuous &&
+		(size <= SLAB_MAX_OBJECT_SIZE))
 	{
-		//printf("\nRegion Loop: %i", i);
-		if (regions[i].reserved)
-		{
-			//printf("\nFound Free");
-			foundFree = 1;
-		}
-		else if (!foundFree)
+		void* obj = slab_alloc(size, tag);
+
+		if (obj)
 		{
-			//printf("\nNot Found Free");
-			firstFreeRegion = i;
-			firstFreeAddr = regionAddress;
+			return obj;
 		}
+	}
+
+	// Top up the region nodes while nothing is half modified
+	if ((unusedRegionCount < REGION_RESERVE) && !regionPoolGrowing)
+	{
+		region_pool_grow();
+	}
+
+	size = alignUp(size, 0);
+
+	// Regions of zero size can not be told apart in the address index.
+	if (size == 0)
+	{
+		size = 1;
+	}
+
+	for (region_t* region = freeRegions; region; region = region->nextFree)
+	{
+		uint8_t* regionAddress = region->address;
 
 		uint8_t* alignedAddress = (uint8_t*)alignUp((uintptr_t)regionAddress, alignment);
 		uintptr_t additionalSize = (uintptr_t)alignedAddress - (uintptr_t)regionAddress;
 
-		// Check whether this region is free, big enough and fits page requirements
-		if (!regions[i].reserved && (regions[i].size >= size + additionalSize) &&
+		// Check whether this region is big enough and fits page requirements
+		if ((region->size >= size + additionalSize) &&
 			(within - (uintptr_t)regionAddress%within >= additionalSize))
 		{
 			//printf("\nFound Free, big and page");
-			// Check if the region consists of continuous physical memory if required
+			// Check if the region consists of continuous physical memory if
+			// required. A region whose pages are all backed must already be
+			// continuous, and one with no page backed yet gets a run of
+			// continuous frames. Nothing is backed until the region passed.
 			if (continuous)
 			{
-				int iscontinuous = 1;
-				for (uint32_t virt1 = (uint32_t)alignDown((uintptr_t)alignedAddress, PAGE_SIZE); (uintptr_t)((uint32_t)virt1 + PAGE_SIZE) <= (uintptr_t)(alignedAddress + size); virt1 += PAGE_SIZE)
-				{
-					uintptr_t phys1 = (uintptr_t)vmmngr_getPhysicalAddress(vmmngr_get_directory(), (uint32_t)virt1);
-					uintptr_t phys2 = (uintptr_t)vmmngr_getPhysicalAddress(vmmngr_get_directory(), (uint32_t)virt1 + PAGE_SIZE);
-					if (phys1 + PAGE_SIZE != phys2)
-					{
-						iscontinuous = 0;
-						break;
-					}
-				}
-				if (!iscontinuous)
+				int layout = heap_page_layout(alignedAddress, size);
+
+				if (layout == HEAP_PAGES_SCATTERED)
+					continue;
+
+				if ((layout == HEAP_PAGES_UNBACKED) && !heap_back_continuous(alignedAddress, size))
 					continue;
 			}
 
@@ -250,73 +762,64 @@ void* kmalloc_imp(size_t size, uint32_t alignment, const char* comment)
 			// Split the pre-alignment area
 			if (alignedAddress != regionAddress)
 			{
-				// Check whether we are able to expand
-				if (regionCount >= regionMaxCount)
+				region_t* aligned = region_split(region, additionalSize);
+
+				if (!aligned)
 				{
 					//printf("\nError3");
 					return (0);
 				}
 
-				//printf("\nMoving regions");
-
-				// Move all following regions ahead to get room for a new one
-				memmove(regions + i + 1, regions + i, (regionCount - i) * sizeof(region_t));
-
-				++regionCount;
-
-				// Setup the regions
-				regions[i].size = alignedAddress - regionAddress;
-
-				regions[i].reserved = 0;
-
-				regions[i + 1].size -= regions[i].size;
-
+				// The pre-alignment area stays in the free list, the
 				// "Aligned Destination Area" becomes the "current" region
-				regionAddress += regions[i].size;
-
-				i++;
+				region = aligned;
+			}
+			else
+			{
+				region_free_list_remove(region);
 			}
 
 			// Split the leftover
-			if (regions[i].size > size + additionalSize)
+			if (region->size > size)
 			{
+				region_t* leftover = region_split(region, size);
 
-				//printf("\nSplitting leftover");
-				// Check whether we are able to expand
-				if (regionCount + 1 > regionMaxCount)
+				// If no region could be created the leftover simply stays
+				// in the reserved region.
+				if (leftover)
 				{
-					//printf("\nError4");
-					return (0);
+					region_free_list_push(leftover);
 				}
+			}
 
-				//printf("\nMoving regions 2");
+			//printf("\nSet region to reserved and return");
 
-				// Move all following regions ahead to get room for a new one
-				memmove(regions + i + 2, regions + i + 1, (regionCount - i - 1)*sizeof(region_t));
+			// Set the region to "reserved" and return its address
+			region->reserved = 1;
+			strncpy(region->comment, comment, 20);
+			region->comment[20] = 0;
+			region->number = ++consecutiveNumber;
+			region->tag = tag;
 
-				++regionCount;
+			heap_stats_alloc(tag, region->size);
 
-				// Setup the regions
-				regions[i + 1].size = regions[i].size - size;
-				regions[i + 1].reserved = 0;
-				regions[i + 1].number = 0;
+			heapUsed += region->size;
 
-				regions[i].size = size;
+			if (heapUsed > heapPeakUsed)
+			{
+				heapPeakUsed = heapUsed;
 			}
 
-			//printf("\nSet region to reserved and return");
-
-			// Set the region to "reserved" and return its address
-			regions[i].reserved = 1;
-			strncpy(regions[i].comment, comment, 20);
-			regions[i].comment[20] = 0;
-			regions[i].number = ++consecutiveNumber;
+			// Follow the free memory down, so the next trim happens after
+			// HEAP_TRIM_HIGH_WATER more bytes have been freed.
+			if (heapSize - heapUsed + HEAP_TRIM_HIGH_WATER < heapTrimMark)
+			{
+				heapTrimMark = heapSize - heapUsed + HEAP_TRIM_HIGH_WATER;
+			}
 
-			return (regionAddress);
+			return (region->address);
 
 		} //region is free and big enough
-
-		regionAddress += regions[i].size;
 	}
 
 	// There is nothing free, try to expand the heap
@@ -331,7 +834,7 @@ void* kmalloc_imp(size_t size, uint32_t alignment, const char* comment)
 	}
 
 	// Now there should be a region that is large enough
-	return kmalloc_imp(size, alignment, comment);
+	return heap_alloc(size, placement, comment);
 }
 
 void* kernel_malloc(size_t size){
@@ -357,47 +860,187 @@ void kernel_free(void* addr)
 		return;
 	}
 
-	// Walk the regions and find the correct one
-	uint8_t* regionAddress = (uint8_t*)HEAP_START;
-	for (uint32_t i = 0; i < regionCount; i++)
+	if (slab_free(addr))
+	{
+		return;
+	}
+
+	// Find the region through the address index
+	region_t* region = region_tree_find((uint8_t*)addr);
+
+	if (!region || !region->reserved)
+	{
+		return;
+	}
+
+	heapBusy++;
+
+	heap_stats_free(region->tag, region->size);
+
+	heapUsed -= region->size;
+
+	region->number = 0;
+	region->reserved = 0; // free the region
+
+	// Check for a merge with the next region
+	region_t* next = region->next;
+
+	if (next && !next->reserved)
+	{
+		region->size += next->size; // merge
+
+		region_free_list_remove(next);
+		region_unlink(next);
+		region_delete(next);
+	}
+
+	// Check for a merge with the previous region
+	region_t* prev = region->prev;
+
+	if (prev && !prev->reserved)
+	{
+		prev->size += region->size; // merge, prev is already in the free list
+
+		region_unlink(region);
+		region_delete(region);
+	}
+	else
+	{
+		region_free_list_push(region);
+	}
+
+	if (heapSize - heapUsed > heapTrimMark)
+	{
+		heap_trim();
+	}
+
+	heapBusy--;
+}
+
+// Shrinks the heap to the start of the last region if it is free
+static uint32_t heap_trim_tail()
+{
+	if (!lastRegion || lastRegion->reserved)
+	{
+		return 0;
+	}
+
+	uint32_t heapEnd = (uint32_t)HEAP_START + heapSize;
+	uint32_t newEnd = alignUp((uint32_t)lastRegion->address, PAGE_SIZE);
+
+	// Large pages are not given back, keep the heap up to the end of the
+	// last one
+	for (uint32_t window = alignDown(newEnd, LARGE_PAGE_SIZE); window < heapEnd; window += LARGE_PAGE_SIZE)
 	{
-		if (regionAddress == addr && regions[i].reserved)
+		if (vmmngr_page_size(vmmngr_get_directory(), window) == LARGE_PAGE_SIZE)
 		{
-			regions[i].number = 0;
-			regions[i].reserved = 0; // free the region
+			newEnd = max(newEnd, window + LARGE_PAGE_SIZE);
+		}
+	}
 
-										 // Check for a merge with the next region
-			if ((i + 1 < regionCount) && !regions[i + 1].reserved)
-			{
-				// Adjust the size of the now free region
-				regions[i].size += regions[i + 1].size; // merge
+	if (newEnd >= heapEnd)
+	{
+		return 0;
+	}
 
-														// Move all following regions back by one
-				memmove(regions + i + 1, regions + i + 2, (regionCount - 2 - i)*sizeof(region_t));
+	uint32_t reclaimed = vmmngr_release_range(vmmngr_get_directory(), newEnd, heapEnd - newEnd);
 
-				--regionCount;
-			}
+	vmmngr_unreserve_range(0, newEnd, heapEnd - newEnd);
 
-			// Check for a merge with the previous region
-			if (i > 0 && !regions[i - 1].reserved)
-			{
-				// Adjust the size of the previous region
-				regions[i - 1].size += regions[i].size; // merge
+	region_t* region = lastRegion;
 
-														// Move all following regions back by one
-				memmove(regions + i, regions + i + 1, (regionCount - 1 - i)*sizeof(region_t));
+	if ((uint32_t)region->address == newEnd)
+	{
+		region_free_list_remove(region);
+		region_unlink(region);
+		region_delete(region);
+	}
+	else
+	{
+		region->size = newEnd - (uint32_t)region->address;
+	}
 
-				--regionCount;
-			}
+	heapSize = newEnd - (uint32_t)HEAP_START;
 
-			if (i < firstFreeRegion)
-			{
-				firstFreeRegion = i;
-				firstFreeAddr = regionAddress;
-			}
-			return;
+	return reclaimed;
+}
+
+uint32_t heap_trim()
+{
+	uint32_t reclaimed = heap_trim_tail();
+
+	// Whole pages inside free regions stay reserved and are backed again by
+	// the page fault handler when they are reused.
+	for (region_t* region = freeRegions; region; region = region->nextFree)
+	{
+		uint32_t start = alignUp((uint32_t)region->address, PAGE_SIZE);
+		uint32_t end = alignDown((uint32_t)region->address + region->size, PAGE_SIZE);
+
+		if (end > start)
+		{
+			reclaimed += vmmngr_release_range(vmmngr_get_directory(), start, end - start);
+		}
+	}
+
+	heapReclaimed += reclaimed;
+	heapTrimMark = heapSize - heapUsed + HEAP_TRIM_HIGH_WATER;
+
+	return reclaimed;
+}
+
+// Reclaim callback, trims the heap unless it is in the middle of an
+// allocation or a free
+static uint32_t heap_reclaim(uint32_t target)
+{
+	if (heapBusy)
+	{
+		return 0;
+	}
+
+	heapBusy++;
+
+	uint32_t reclaimed = heap_trim();
+
+	heapBusy--;
+
+	return reclaimed / PAGE_SIZE;
+}
+
+void heap_stats_get(heap_stats_t* stats)
+{
+	memset(stats, 0, sizeof(heap_stats_t));
+
+	stats->heapSize = heapSize;
+	stats->reclaimedBytes = heapReclaimed;
+	stats->usedBytes = heapUsed;
+	stats->peakUsedBytes = heapPeakUsed;
+
+	for (region_t* region = freeRegions; region; region = region->nextFree)
+	{
+		stats->freeBytes += region->size;
+		stats->freeRegionCount++;
+
+		if (region->size > stats->largestFreeBlock)
+		{
+			stats->largestFreeBlock = region->size;
+		}
+	}
+
+	if (stats->freeBytes)
+	{
+		uint32_t largest = stats->largestFreeBlock;
+		uint32_t total = stats->freeBytes;
+
+		// Scale down to avoid overflow, there is no 64 bit division.
+		while (total > 0x3FFFFF)
+		{
+			largest >>= 1;
+			total >>= 1;
 		}
 
-		regionAddress += regions[i].size;
+		stats->fragmentation = 1000 - (largest * 1000) / total;
 	}
-}
\ No newline at end of file
+
+	stats->slabBytes = slab_get_memory_usage();
+	stats->tagCount = heap_stats_tag_count();
+}
@@ -0,0 +1,298 @@
+/** @file mem_zone.c
+ *  @brief Free frame accounting by zone and low memory reclaim.
+ *
+ *	The zone counters are updated by the PMM for every frame that changes
+ *	state, so they are always exact. The watermarks are derived from the
+ *	frames a zone has once the memory map is known.
+ *
+ *	Reclaim callbacks mostly give frames to the frame cache, which is
+ *	drained after each callback so the frames reach the PMM. The callbacks
+ *	run until the target is met, the cheapest ones should be registered
+ *	first.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include <mm/mem_zone.h>
+
+#include <mm/physmem.h>
+#include <mm/frame_cache.h>
+#include <mm/zero_pool.h>
+
+#include <lib/string.h>
+
+// The min watermark is this fraction of the frames of a zone, within the
+// bounds below.
+#define MEM_ZONE_MIN_DIVISOR 128
+#define MEM_ZONE_MIN_FLOOR 8
+#define MEM_ZONE_MIN_CEILING 256
+
+typedef struct {
+
+	const char* name;
+
+	mem_zone_reclaim_t callback;
+
+} mem_zone_reclaimer_t;
+
+static mem_zone_stats_t _mem_zones[MEM_ZONE_COUNT] = {
+	{ "DMA", 0, MEM_ZONE_NORMAL_FIRST_BLOCK },
+	{ "Normal", MEM_ZONE_NORMAL_FIRST_BLOCK, MEM_ZONE_NORMAL_FIRST_BLOCK },
+};
+
+static mem_zone_reclaimer_t _mem_zone_reclaimers[MEM_ZONE_MAX_RECLAIMERS];
+static uint32_t _mem_zone_reclaimer_count = 0;
+
+static int _mem_zone_reclaiming = 0;
+
+static mem_zone_reclaim_stats_t _mem_zone_reclaim_stats;
+
+// Sums of the watermarks of all zones
+static uint32_t _mem_zone_min = 0;
+static uint32_t _mem_zone_low = 0;
+static uint32_t _mem_zone_high = 0;
+
+//=============================================================================
+// Helpers
+//=============================================================================
+
+// Disables interrupts and returns the previous flags
+static inline uint32_t mem_zone_lock(){
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void mem_zone_unlock(uint32_t flags){
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+static uint32_t mem_zone_free_total(){
+
+	uint32_t free = 0;
+
+	for(uint32_t zone = 0; zone < MEM_ZONE_COUNT; ++zone)
+		free += _mem_zones[zone].free;
+
+	return free;
+}
+
+static uint32_t zero_pool_reclaim(uint32_t target){
+
+	zero_pool_stats_t stats;
+
+	zero_pool_get_stats(&stats);
+	zero_pool_drain();
+
+	return stats.count;
+}
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void mem_zone_reset(uint32_t blocks){
+
+	for(uint32_t zone = 0; zone < MEM_ZONE_COUNT; ++zone){
+
+		mem_zone_stats_t* z = &_mem_zones[zone];
+
+		z->firstBlock = (zone == MEM_ZONE_DMA) ? 0 : MEM_ZONE_NORMAL_FIRST_BLOCK;
+		z->endBlock = (zone == MEM_ZONE_DMA) ? MEM_ZONE_NORMAL_FIRST_BLOCK : blocks;
+
+		if(z->firstBlock > blocks)
+			z->firstBlock = blocks;
+
+		if(z->endBlock > blocks)
+			z->endBlock = blocks;
+
+		z->reserved = z->endBlock - z->firstBlock;
+		z->free = 0;
+		z->min = 0;
+		z->low = 0;
+		z->high = 0;
+	}
+
+	_mem_zone_min = 0;
+	_mem_zone_low = 0;
+	_mem_zone_high = 0;
+}
+
+void mem_zone_account(uint32_t block, int32_t delta){
+
+	_mem_zones[block < MEM_ZONE_NORMAL_FIRST_BLOCK ? MEM_ZONE_DMA : MEM_ZONE_NORMAL].free += delta;
+}
+
+void mem_zone_account_range(uint32_t block, uint32_t count, int32_t delta){
+
+	if(block < MEM_ZONE_NORMAL_FIRST_BLOCK){
+
+		uint32_t dma = min(count, MEM_ZONE_NORMAL_FIRST_BLOCK - block);
+
+		_mem_zones[MEM_ZONE_DMA].free += delta * (int32_t)dma;
+		count -= dma;
+	}
+
+	_mem_zones[MEM_ZONE_NORMAL].free += delta * (int32_t)count;
+}
+
+void mem_zone_init(){
+
+	_mem_zone_min = 0;
+	_mem_zone_low = 0;
+	_mem_zone_high = 0;
+
+	for(uint32_t zone = 0; zone < MEM_ZONE_COUNT; ++zone){
+
+		mem_zone_stats_t* z = &_mem_zones[zone];
+
+		// Everything that is not free by now is never handed out
+		z->reserved = z->endBlock - z->firstBlock - z->free;
+
+		uint32_t min = z->free / MEM_ZONE_MIN_DIVISOR;
+
+		if(min < MEM_ZONE_MIN_FLOOR)
+			min = MEM_ZONE_MIN_FLOOR;
+
+		if(min > MEM_ZONE_MIN_CEILING)
+			min = MEM_ZONE_MIN_CEILING;
+
+		// A zone too small for the marks does not take part
+		if(3 * min > z->free)
+			min = 0;
+
+		z->min = min;
+		z->low = 2 * min;
+		z->high = 3 * min;
+
+		_mem_zone_min += z->min;
+		_mem_zone_low += z->low;
+		_mem_zone_high += z->high;
+	}
+
+	mem_zone_register_reclaim("Zeroed pages", zero_pool_reclaim);
+}
+
+int mem_zone_register_reclaim(const char* name, mem_zone_reclaim_t callback){
+
+	for(uint32_t i = 0; i < _mem_zone_reclaimer_count; ++i){
+		if(_mem_zone_reclaimers[i].callback == callback)
+			return 1;
+	}
+
+	if(_mem_zone_reclaimer_count == MEM_ZONE_MAX_RECLAIMERS)
+		return 0;
+
+	_mem_zone_reclaimers[_mem_zone_reclaimer_count].name = name;
+	_mem_zone_reclaimers[_mem_zone_reclaimer_count].callback = callback;
+	_mem_zone_reclaimer_count++;
+
+	return 1;
+}
+
+uint32_t mem_zone_reclaim(uint32_t target){
+
+	uint32_t flags = mem_zone_lock();
+
+	if(_mem_zone_reclaiming){
+		mem_zone_unlock(flags);
+		return 0;
+	}
+
+	_mem_zone_reclaiming = 1;
+
+	mem_zone_unlock(flags);
+
+	uint32_t start = pmmngr_get_free_block_count();
+	uint32_t freed = 0;
+
+	for(uint32_t i = 0; i < _mem_zone_reclaimer_count && freed < target; ++i){
+
+		_mem_zone_reclaimers[i].callback(target - freed);
+
+		// Frames given to the cache are only useful once in the PMM
+		frame_cache_drain();
+
+		uint32_t free = pmmngr_get_free_block_count();
+
+		freed = free > start ? free - start : 0;
+	}
+
+	_mem_zone_reclaim_stats.reclaimed += freed;
+	_mem_zone_reclaiming = 0;
+
+	return freed;
+}
+
+void mem_zone_balance(){
+
+	uint32_t free = mem_zone_free_total();
+
+	if(free >= _mem_zone_low || _mem_zone_reclaiming)
+		return;
+
+	// Reclaiming would drain the cache being refilled, the frame cache
+	// balances once it is done
+	if(frame_cache_is_refilling())
+		return;
+
+	_mem_zone_reclaim_stats.lowRuns++;
+
+	mem_zone_reclaim(_mem_zone_high - free);
+}
+
+int mem_zone_reclaim_for(uint32_t count){
+
+	if(_mem_zone_reclaiming)
+		return 0;
+
+	_mem_zone_reclaim_stats.failRuns++;
+
+	if(mem_zone_reclaim(count + _mem_zone_high))
+		return 1;
+
+	_mem_zone_reclaim_stats.failures++;
+
+	return 0;
+}
+
+uint32_t mem_zone_get_pressure(){
+
+	uint32_t free = mem_zone_free_total();
+
+	if(free < _mem_zone_min)
+		return MEM_ZONE_PRESSURE_MIN;
+
+	if(free < _mem_zone_low)
+		return MEM_ZONE_PRESSURE_LOW;
+
+	return MEM_ZONE_PRESSURE_NONE;
+}
+
+int mem_zone_get_stats(uint32_t zone, mem_zone_stats_t* stats){
+
+	if(zone >= MEM_ZONE_COUNT || !stats)
+		return 0;
+
+	memcpy(stats, &_mem_zones[zone], sizeof(mem_zone_stats_t));
+
+	return 1;
+}
+
+void mem_zone_get_reclaim_stats(mem_zone_reclaim_stats_t* stats){
+
+	if(!stats)
+		return;
+
+	memcpy(stats, &_mem_zone_reclaim_stats, sizeof(mem_zone_reclaim_stats_t));
+}
+
+const char* mem_zone_get_reclaimer_name(uint32_t index){
+
+	if(index >= _mem_zone_reclaimer_count)
+		return 0;
+
+	return _mem_zone_reclaimers[index].name;
+}
@@ -2,12 +2,15 @@
  *  @brief Physical memory manager.
  *
  *	Implementation of the physical memory manager done with bitmap-based
- *	approach.
+ *	approach. The bitmap records which blocks are in use, while the free
+ *	blocks are handed out by a binary buddy allocator.
  *
  *  @author Joakim Bertils
  */
 
 #include <mm/physmem.h>
+#include <mm/zero_pool.h>
+#include <mm/mem_zone.h>
 
 #include <lib/string.h>
 #include <lib/stdio.h>
@@ -16,14 +19,74 @@
 #define PMMNGR_BLOCK_SIZE 4096
 #define PMMNGR_BLOCK_ALIGN PMMNGR_BLOCK_SIZE
 
+// Largest block handed out by the buddy allocator is 2^10 blocks (4MB)
+#define PMMNGR_MAX_ORDER 10
+
 static uint32_t _mmngr_memory_size = 0;
 static uint32_t _mmngr_used_blocks = 0;
 static uint32_t _mmngr_max_blocks = 0;
 static uint32_t* _mmngr_memory_map = 0;
 
+// Bitmap entry where the search for a free block starts. There are no free
+// blocks in the entries before it.
+static uint32_t _mmngr_free_hint = 0;
+
+// Buddy allocator state. For each order there is a bitmap with one bit for
+// each naturally aligned block of 2^order blocks. A set bit means that the
+// block is free and not part of a larger free block.
+static uint32_t* _mmngr_buddy_map[PMMNGR_MAX_ORDER + 1] = {0};
+static uint32_t _mmngr_buddy_entries[PMMNGR_MAX_ORDER + 1] = {0};
+static uint32_t _mmngr_buddy_free[PMMNGR_MAX_ORDER + 1] = {0};
+static uint32_t _mmngr_buddy_hint[PMMNGR_MAX_ORDER + 1] = {0};
+
+// Number of extra references to each block in the extents, placed after
+// the buddy maps. A block with no extra references has a single owner.
+static uint16_t* _mmngr_block_refs = 0;
+static uint32_t _mmngr_ref_count = 0;
+
+// Blocks given to the buddy allocator at a time. Chunks after the first
+// one of an extent are aligned, so they enter the buddy allocator as whole
+// blocks of the highest order.
+#define PMMNGR_EXTENT_CHUNK 1024
+
+// Usable memory in block order. The first 'released' blocks of an extent
+// have been given to the buddy allocator, the rest are pending. Pending
+// blocks are marked as used in the bitmap but counted as free.
+typedef struct {
+
+	uint32_t first;
+	uint32_t count;
+
+	// Index of the reference count of the first block
+	uint32_t refBase;
+
+	uint32_t released;
+
+} pmmngr_extent_t;
+
+static pmmngr_extent_t _mmngr_extents[PMMNGR_MAX_EXTENTS];
+static uint32_t _mmngr_extent_count = 0;
+static uint32_t _mmngr_pending_blocks = 0;
+
 // 4GB Physical address space. 32 4k blocks per entry
 //static uint32_t _mmngr_memory_map[0xFFFFFFFF/(4096*32)] = {0};
 
+// The allocation and free entry points may be called from any thread and
+// from page faults, so they run with interrupts disabled.
+
+// Disables interrupts and returns the previous flags
+static inline uint32_t pmmngr_lock(){
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void pmmngr_unlock(uint32_t flags){
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
 //===================================================================
 // Bitmap manipulation
 //===================================================================
@@ -33,6 +96,8 @@ void mmap_unset(const int bit);
 int mmap_test(const int bit);
 int mmap_first_free();
 int mmap_first_free_s(size_t size);
+void mmap_set_range(uint32_t bit, uint32_t count);
+void mmap_unset_range(uint32_t bit, uint32_t count);
 
 /*
 	
@@ -48,88 +113,521 @@ int mmap_first_free_s(size_t size);
 
 #define BITS_PER_ENTRY 32
 
+// Index of the lowest set bit in a non-zero entry
+static inline uint32_t mmap_lowest_set(uint32_t entry){
+	uint32_t bit;
+
+	asm ("bsf %1, %0" : "=r"(bit) : "rm"(entry));
+
+	return bit;
+}
+
+static inline uint32_t mmap_entry_count(){
+	return (pmmngr_get_block_count() + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+}
+
+// Every caller changes the state of the bit, which keeps the zone counters
+// exact.
 void mmap_set(const int bit){
 	_mmngr_memory_map[bit/BITS_PER_ENTRY] |= (1<<(bit%BITS_PER_ENTRY));
+
+	mem_zone_account(bit, -1);
 }
 
 void mmap_unset(const int bit){
 	_mmngr_memory_map[bit/BITS_PER_ENTRY] &= ~(1<<(bit%BITS_PER_ENTRY));
+
+	mem_zone_account(bit, 1);
+
+	if(bit/BITS_PER_ENTRY < _mmngr_free_hint)
+		_mmngr_free_hint = bit/BITS_PER_ENTRY;
 }
 
 int mmap_test(const int bit){
 	return _mmngr_memory_map[bit/BITS_PER_ENTRY] & (1<<(bit%BITS_PER_ENTRY));
 }
 
+void mmap_set_range(uint32_t bit, uint32_t count){
+	for(uint32_t i = 0; i < count; ++i){
+		mmap_set(bit + i);
+	}
+}
+
+void mmap_unset_range(uint32_t bit, uint32_t count){
+	for(uint32_t i = 0; i < count; ++i){
+		mmap_unset(bit + i);
+	}
+}
+
 int mmap_first_free(){
 
-	for(uint32_t entry = 0; 
-		entry < pmmngr_get_block_count() / BITS_PER_ENTRY; 
-		++entry){
+	uint32_t entries = mmap_entry_count();
+
+	for(uint32_t entry = _mmngr_free_hint; entry < entries; ++entry){
 
 		// If the entry is full, go to the next one
 		if(_mmngr_memory_map[entry] == 0xFFFFFFFF)
 			continue;
 
-		// Check each bit in the entry
-		for(int bit = 0; bit < BITS_PER_ENTRY;  ++bit){
-			if(!(_mmngr_memory_map[entry] & (1<<bit))){
-				return entry * BITS_PER_ENTRY + bit;
-			}
-		}
+		// Everything before this entry is in use
+		_mmngr_free_hint = entry;
+
+		uint32_t bit = entry * BITS_PER_ENTRY + mmap_lowest_set(~_mmngr_memory_map[entry]);
+
+		// The free bit is past the last block
+		if(bit >= pmmngr_get_block_count())
+			return -1;
+
+		return bit;
 	}
 
+	_mmngr_free_hint = entries;
+
 	return -1;
 }
 
 int mmap_first_free_s(size_t size){
 
-	uint32_t firstFree = mmap_first_free();
-
-	// We could not find any free blocks.
-	if(firstFree == -1)
-		return -1;
-
 	// Don't allocate if there is nothing to allocate
 	if(size == 0)
 		return -1;
 
 	// If we only want to allocate one block, we can pick first free
 	if(size == 1)
-		return firstFree;
+		return mmap_first_free();
+
+	uint32_t entries = mmap_entry_count();
 
 	// Number of free contiguous blocks found.
 	uint32_t free = 0;
 
 	// First free bit of chain
-	uint32_t first_bit_in_chain = firstFree;
+	uint32_t first_bit_in_chain = 0;
+
+	for(uint32_t entry = _mmngr_free_hint; entry < entries; ++entry){
+
+		uint32_t value = _mmngr_memory_map[entry];
 
-	// Loop through each bit from firstFree to end of memory
-	for(int bit = firstFree; bit < pmmngr_get_block_count(); ++bit){
-		// If bit is set (memory not free)
-		if(mmap_test(bit)){
-			// Reset counter
+		// A full entry breaks the chain
+		if(value == 0xFFFFFFFF){
 			free = 0;
+			continue;
+		}
+
+		// An empty entry extends the chain by a whole entry
+		if(value == 0){
+			if(free == 0)
+				first_bit_in_chain = entry * BITS_PER_ENTRY;
 
-			// Next bit is potential new start of chain.
-			first_bit_in_chain = bit + 1;
+			free += BITS_PER_ENTRY;
 		} else {
-			// Bit is free. Increase counter
-			++free;
+
+			// Check each bit in a mixed entry
+			for(int bit = 0; bit < BITS_PER_ENTRY; ++bit){
+
+				// If bit is set (memory not free)
+				if(value & (1 << bit)){
+					// Reset counter
+					free = 0;
+					continue;
+				}
+
+				if(free == 0)
+					first_bit_in_chain = entry * BITS_PER_ENTRY + bit;
+
+				// If we found enough bits, we are done
+				if(++free >= size)
+					break;
+			}
 		}
 
 		// If we found enough bits, we are done
-		if(free == size)
+		if(free >= size){
+			if(first_bit_in_chain + size > pmmngr_get_block_count())
+				return -1;
+
 			return first_bit_in_chain;
+		}
 	}
 
 	//We went through all blocks in memory and did not find a chain
 	return -1;
 }
 
+//===================================================================
+// Buddy allocator
+//===================================================================
+
+/*
+
+	Block b of order k covers the blocks [b * 2^k, (b + 1) * 2^k). Its buddy
+	is block b ^ 1 of the same order, and the two merge into block b / 2 of
+	order k + 1. Only blocks that lie completely within the memory are ever
+	marked as free, so a buddy past the end of memory is never merged.
+
+*/
+
+static inline int buddy_test(uint32_t order, uint32_t block){
+	return _mmngr_buddy_map[order][block / BITS_PER_ENTRY] & (1 << (block % BITS_PER_ENTRY));
+}
+
+static inline void buddy_set(uint32_t order, uint32_t block){
+	_mmngr_buddy_map[order][block / BITS_PER_ENTRY] |= (1 << (block % BITS_PER_ENTRY));
+	_mmngr_buddy_free[order]++;
+
+	if(block / BITS_PER_ENTRY < _mmngr_buddy_hint[order])
+		_mmngr_buddy_hint[order] = block / BITS_PER_ENTRY;
+}
+
+static inline void buddy_clear(uint32_t order, uint32_t block){
+	_mmngr_buddy_map[order][block / BITS_PER_ENTRY] &= ~(1 << (block % BITS_PER_ENTRY));
+	_mmngr_buddy_free[order]--;
+}
+
+int buddy_find(uint32_t order);
+int buddy_alloc(uint32_t order);
+void buddy_free(uint32_t frame, uint32_t order);
+void buddy_free_range(uint32_t frame, uint32_t count);
+int buddy_remove(uint32_t frame);
+uint32_t buddy_order(size_t size);
+
+int buddy_find(uint32_t order){
+
+	uint32_t* map = _mmngr_buddy_map[order];
+
+	for(uint32_t entry = _mmngr_buddy_hint[order]; entry < _mmngr_buddy_entries[order]; ++entry){
+
+		// If the entry has no free blocks, go to the next one
+		if(map[entry] == 0)
+			continue;
+
+		// Everything before this entry is in use
+		_mmngr_buddy_hint[order] = entry;
+
+		return entry * BITS_PER_ENTRY + mmap_lowest_set(map[entry]);
+	}
+
+	_mmngr_buddy_hint[order] = _mmngr_buddy_entries[order];
+
+	return -1;
+}
+
+int buddy_alloc(uint32_t order){
+
+	// Find the smallest order with a free block
+	uint32_t current = order;
+
+	while(current <= PMMNGR_MAX_ORDER && _mmngr_buddy_free[current] == 0)
+		++current;
+
+	if(current > PMMNGR_MAX_ORDER)
+		return -1;
+
+	int block = buddy_find(current);
+
+	if(block == -1)
+		return -1;
+
+	buddy_clear(current, block);
+
+	// Split the block until it has the requested order. The upper halves
+	// are put back as free blocks.
+	while(current > order){
+		--current;
+		block <<= 1;
+		buddy_set(current, block + 1);
+	}
+
+	return block << order;
+}
+
+void buddy_free(uint32_t frame, uint32_t order){
+
+	uint32_t block = frame >> order;
+
+	// Merge with the buddy for as long as it is free
+	while(order < PMMNGR_MAX_ORDER){
+
+		uint32_t buddy = block ^ 1;
+
+		if((buddy >> 5) >= _mmngr_buddy_entries[order] || !buddy_test(order, buddy))
+			break;
+
+		buddy_clear(order, buddy);
+
+		block >>= 1;
+		++order;
+	}
+
+	buddy_set(order, block);
+}
+
+void buddy_free_range(uint32_t frame, uint32_t count){
+
+	while(count){
+
+		// Use the largest aligned block that fits in the range
+		uint32_t order = 0;
+
+		while(order < PMMNGR_MAX_ORDER &&
+			  !(frame & ((2 << order) - 1)) &&
+			  (2U << order) <= count){
+			++order;
+		}
+
+		buddy_free(frame, order);
+
+		frame += 1 << order;
+		count -= 1 << order;
+	}
+}
+
+int buddy_remove(uint32_t frame){
+
+	// Find the free block containing the frame
+	for(uint32_t order = 0; order <= PMMNGR_MAX_ORDER; ++order){
+
+		uint32_t block = frame >> order;
+
+		if(!buddy_test(order, block))
+			continue;
+
+		buddy_clear(order, block);
+
+		// Split it down, freeing the halves not containing the frame.
+		while(order > 0){
+			--order;
+			buddy_set(order, (frame >> order) ^ 1);
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+uint32_t buddy_order(size_t size){
+
+	uint32_t order = 0;
+
+	while((1U << order) < size)
+		++order;
+
+	return order;
+}
+
 //===================================================================
 // Physical memory manager
 //===================================================================
 
+void pmmngr_claim_range(uint32_t frame, uint32_t count);
+void pmmngr_release_range(uint32_t frame, uint32_t count);
+void pmmngr_extent_release_to(pmmngr_extent_t* extent, uint32_t end);
+void pmmngr_extent_release_range(uint32_t first, uint32_t last);
+int pmmngr_extend(uint32_t count);
+
+void pmmngr_claim_range(uint32_t frame, uint32_t count){
+
+	for(uint32_t i = frame; i < frame + count && i < pmmngr_get_block_count(); ++i){
+
+		if(mmap_test(i))
+			continue;
+
+		buddy_remove(i);
+		mmap_set(i);
+		_mmngr_used_blocks++;
+	}
+}
+
+void pmmngr_release_range(uint32_t frame, uint32_t count){
+
+	uint32_t end = frame + count;
+
+	if(end > pmmngr_get_block_count())
+		end = pmmngr_get_block_count();
+
+	// Release runs of used blocks, skipping the ones that are already free.
+	while(frame < end){
+
+		while(frame < end && !mmap_test(frame))
+			++frame;
+
+		uint32_t first = frame;
+
+		while(frame < end && mmap_test(frame))
+			++frame;
+
+		if(frame == first)
+			break;
+
+		mmap_unset_range(first, frame - first);
+		buddy_free_range(first, frame - first);
+		_mmngr_used_blocks -= frame - first;
+	}
+}
+
+// Returns the reference count of a block, 0 for blocks outside the extents
+static inline uint16_t* pmmngr_block_refs(uint32_t frame){
+
+	for(uint32_t i = 0; i < _mmngr_extent_count; ++i){
+
+		pmmngr_extent_t* extent = &_mmngr_extents[i];
+
+		if(frame - extent->first < extent->count)
+			return &_mmngr_block_refs[extent->refBase + frame - extent->first];
+	}
+
+	return 0;
+}
+
+// Gives the pending blocks of an extent up to block 'end' to the buddy
+// allocator
+void pmmngr_extent_release_to(pmmngr_extent_t* extent, uint32_t end){
+
+	uint32_t first = extent->first + extent->released;
+
+	if(end > extent->first + extent->count)
+		end = extent->first + extent->count;
+
+	if(end <= first)
+		return;
+
+	uint32_t count = end - first;
+
+	// The blocks were already counted as free
+	_mmngr_pending_blocks -= count;
+	_mmngr_used_blocks += count;
+	mem_zone_account_range(first, count, -1);
+
+	pmmngr_release_range(first, count);
+
+	extent->released += count;
+}
+
+void pmmngr_extent_release_range(uint32_t first, uint32_t last){
+
+	for(uint32_t i = 0; i < _mmngr_extent_count; ++i){
+
+		pmmngr_extent_t* extent = &_mmngr_extents[i];
+
+		if(extent->first < last && extent->first + extent->count > first)
+			pmmngr_extent_release_to(extent, last);
+	}
+}
+
+// Gives at least count pending blocks to the buddy allocator, lowest first.
+// Returns 0 if nothing was pending.
+int pmmngr_extend(uint32_t count){
+
+	if(!_mmngr_pending_blocks)
+		return 0;
+
+	uint32_t pending = _mmngr_pending_blocks;
+
+	for(uint32_t i = 0; i < _mmngr_extent_count; ++i){
+
+		pmmngr_extent_t* extent = &_mmngr_extents[i];
+
+		while(extent->released < extent->count && pending - _mmngr_pending_blocks < count){
+
+			uint32_t first = extent->first + extent->released;
+
+			pmmngr_extent_release_to(extent, (first + PMMNGR_EXTENT_CHUNK) & ~(PMMNGR_EXTENT_CHUNK - 1));
+		}
+	}
+
+	return 1;
+}
+
+void pmmngr_add_extent(physical_addr base, size_t size){
+
+	physical_addr phys = base - 0xC0000000;
+
+	// Only whole blocks inside the extent can be used. Block 0 is never
+	// handed out.
+	uint32_t first = (phys + PMMNGR_BLOCK_SIZE - 1) / PMMNGR_BLOCK_SIZE;
+	uint32_t last = phys / PMMNGR_BLOCK_SIZE + size / PMMNGR_BLOCK_SIZE +
+		(phys % PMMNGR_BLOCK_SIZE + size % PMMNGR_BLOCK_SIZE) / PMMNGR_BLOCK_SIZE;
+
+	if(first == 0)
+		first = 1;
+
+	if(last <= first)
+		return;
+
+	// Take in the extents it overlaps or touches
+	for(uint32_t i = 0; i < _mmngr_extent_count;){
+
+		pmmngr_extent_t* extent = &_mmngr_extents[i];
+
+		if(extent->first > last || extent->first + extent->count < first){
+			++i;
+			continue;
+		}
+
+		first = min(first, extent->first);
+		last = max(last, extent->first + extent->count);
+
+		memmove(extent, extent + 1, (_mmngr_extent_count - i - 1) * sizeof(pmmngr_extent_t));
+		_mmngr_extent_count--;
+	}
+
+	if(_mmngr_extent_count == PMMNGR_MAX_EXTENTS){
+		printf("[PHYSMEM] Too many extents, %i blocks not used\n", last - first);
+		return;
+	}
+
+	uint32_t i = 0;
+
+	while(i < _mmngr_extent_count && _mmngr_extents[i].first < first)
+		++i;
+
+	memmove(&_mmngr_extents[i + 1], &_mmngr_extents[i], (_mmngr_extent_count - i) * sizeof(pmmngr_extent_t));
+
+	_mmngr_extents[i].first = first;
+	_mmngr_extents[i].count = last - first;
+	_mmngr_extents[i].refBase = 0;
+	_mmngr_extents[i].released = 0;
+
+	_mmngr_extent_count++;
+}
+
+size_t pmmngr_get_extent_memory_size(){
+
+	if(!_mmngr_extent_count)
+		return 0;
+
+	pmmngr_extent_t* extent = &_mmngr_extents[_mmngr_extent_count - 1];
+
+	return (extent->first + extent->count) * (PMMNGR_BLOCK_SIZE / 1024);
+}
+
+uint32_t pmmngr_get_metadata_size(size_t memsize){
+
+	uint32_t blocks = memsize / (PMMNGR_BLOCK_SIZE / 1024);
+	uint32_t entries = (blocks + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+
+	for(uint32_t order = 0; order <= PMMNGR_MAX_ORDER; ++order)
+		entries += ((blocks >> order) + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+
+	// One reference count for each block in the extents, as in pmmngr_init
+	uint32_t refCount = 0;
+
+	if(!_mmngr_extent_count)
+		refCount = blocks ? blocks - 1 : 0;
+
+	for(uint32_t i = 0; i < _mmngr_extent_count; ++i){
+
+		pmmngr_extent_t* extent = &_mmngr_extents[i];
+
+		if(extent->first < blocks)
+			refCount += min(extent->count, blocks - extent->first);
+	}
+
+	uint32_t refs = (refCount * sizeof(uint16_t) + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+
+	return entries * sizeof(uint32_t) + refs;
+}
 
 void pmmngr_init(size_t memsize, physical_addr bitmap){
 
@@ -145,7 +643,11 @@ void pmmngr_init(size_t memsize, physical_addr bitmap){
 	//	0xFF, 
 	//	pmmngr_get_block_count() / PMMNGR_BLOCKS_PER_BYTE); 
 
-	int entries = pmmngr_get_block_count() / BITS_PER_ENTRY;
+	int entries = mmap_entry_count();
+
+	_mmngr_free_hint = 0;
+
+	mem_zone_reset(pmmngr_get_block_count());
 
 	for(int i = 0; i < entries; ++i){
 		
@@ -153,57 +655,105 @@ void pmmngr_init(size_t memsize, physical_addr bitmap){
 		//printf("%p\n", &_mmngr_memory_map[i]);
 	}
 
+	// The buddy maps are placed right after the bitmap. Nothing is free yet.
+	uint32_t* buddyMap = _mmngr_memory_map + entries;
+
+	for(uint32_t order = 0; order <= PMMNGR_MAX_ORDER; ++order){
+
+		uint32_t blocks = pmmngr_get_block_count() >> order;
+
+		_mmngr_buddy_map[order] = buddyMap;
+		_mmngr_buddy_entries[order] = (blocks + BITS_PER_ENTRY - 1) / BITS_PER_ENTRY;
+		_mmngr_buddy_free[order] = 0;
+		_mmngr_buddy_hint[order] = 0;
+
+		memset(buddyMap, 0, _mmngr_buddy_entries[order] * sizeof(uint32_t));
+
+		buddyMap += _mmngr_buddy_entries[order];
+	}
+
+	if(!_mmngr_extent_count)
+		pmmngr_add_extent(0xC0000000, pmmngr_get_block_count() * PMMNGR_BLOCK_SIZE);
+
+	// Every block of the extents is free, but pending
+	_mmngr_ref_count = 0;
+	_mmngr_pending_blocks = 0;
+
+	for(uint32_t i = 0; i < _mmngr_extent_count; ++i){
+
+		pmmngr_extent_t* extent = &_mmngr_extents[i];
+
+		if(extent->first >= pmmngr_get_block_count()){
+			_mmngr_extent_count = i;
+			break;
+		}
+
+		extent->count = min(extent->count, pmmngr_get_block_count() - extent->first);
+		extent->refBase = _mmngr_ref_count;
+		extent->released = 0;
+
+		_mmngr_ref_count += extent->count;
+		_mmngr_pending_blocks += extent->count;
+
+		mem_zone_account_range(extent->first, extent->count, 1);
+	}
+
+	_mmngr_used_blocks -= _mmngr_pending_blocks;
+
+	// The reference counts follow the buddy maps.
+	_mmngr_block_refs = (uint16_t*)buddyMap;
+
+	memset(_mmngr_block_refs, 0, _mmngr_ref_count * sizeof(uint16_t));
+
 	printf("PMM init. with bitmap at: %#p, (Entries: %i)\n",_mmngr_memory_map, entries);
+	printf("PMM: %i extents, %i usable blocks\n", _mmngr_extent_count, _mmngr_ref_count);
 }
 
 void pmmngr_init_region(physical_addr base, size_t size){
 
-	int align = (base - 0xC0000000)/ PMMNGR_BLOCK_SIZE;
-	int blocks = size / PMMNGR_BLOCK_SIZE;
+	// Only whole blocks inside the region can be used
+	uint32_t first = ((base - 0xC0000000) + PMMNGR_BLOCK_SIZE - 1) / PMMNGR_BLOCK_SIZE;
+	uint32_t last = ((base - 0xC0000000) + size) / PMMNGR_BLOCK_SIZE;
 
 	printf("[PHYSMEM] Initiating region with size: %i\n", size);
-	
-	while(blocks-->=0){
-		//printf("[PHYSMEM] Align: %#x, Blocks:%i\n", align, blocks);
-		mmap_unset(align++);
-		_mmngr_used_blocks--;
-	}
 
-	//asm volatile("xchgw %bx, %bx");
-
-	mmap_set(0);
+	if(last > first)
+		pmmngr_extent_release_range(first, last);
 }
 
 void pmmngr_deinit_region(physical_addr base, size_t size){
 
-	int align = (base - 0xC0000000)/ PMMNGR_BLOCK_SIZE;
-	int blocks = size / PMMNGR_BLOCK_SIZE;
+	// Every block touched by the region becomes unavailable
+	uint32_t first = (base - 0xC0000000) / PMMNGR_BLOCK_SIZE;
+	uint32_t last = ((base - 0xC0000000) + size + PMMNGR_BLOCK_SIZE - 1) / PMMNGR_BLOCK_SIZE;
 
 	//printf("[PHYSMEM] Deinitiating region\n");
 
-	for(;blocks>=0; blocks--){
-		mmap_set(align++);
-		_mmngr_used_blocks++;
-	}
+	// Pending blocks are marked as used, claim them through the allocator
+	pmmngr_extent_release_range(first, last);
+
+	pmmngr_claim_range(first, last - first);
 }
 
 void* pmmngr_alloc_block(){
 
-	// Check if we have memory left
-	if(pmmngr_get_block_count() <= 0){
-		printf("[PHYSMEM] No memory left(1)\n");
-		return 0;
-	}
-		
+	uint32_t flags = pmmngr_lock();
 
-	int frame = mmap_first_free();
+	int frame = buddy_alloc(0);
+
+	while(frame == -1 && pmmngr_extend(1))
+		frame = buddy_alloc(0);
+
+	// Let the caches give memory back before failing
+	if(frame == -1 && mem_zone_reclaim_for(1))
+		frame = buddy_alloc(0);
 
 	// Out of memory
 	if(frame == -1){
-		printf("\n[PHYSMEM] No memory left(2)\n");
+		pmmngr_unlock(flags);
+		printf("\n[PHYSMEM] No memory left\n");
 		return 0;
 	}
-		
 
 	// Mark block as used
 	mmap_set(frame);
@@ -211,88 +761,160 @@ void* pmmngr_alloc_block(){
 	physical_addr addr = frame * PMMNGR_BLOCK_SIZE;
 	_mmngr_used_blocks++;
 
+	mem_zone_balance();
+
+	pmmngr_unlock(flags);
+
 	// Return address of block start
 	return (void*) addr;
 }
 
 void* pmmngr_alloc_block_z(){
 
-	// Check if we have memory left
-	if(pmmngr_get_block_count() <= 0)
-		return 0;
+	// The pool clears frames ahead of time
+	return zero_pool_alloc();
+}
 
-	int frame = mmap_first_free();
+void pmmngr_free_block(void* p){
 
-	// Out of memory
-	if(frame == -1)
-		return 0;
+	// Calculate frame of the address
+	physical_addr addr = (physical_addr)p;
+	int frame = addr / PMMNGR_BLOCK_SIZE;
 
-	// Mark block as used
-	mmap_set(frame);
+	uint32_t flags = pmmngr_lock();
 
-	physical_addr addr = frame * PMMNGR_BLOCK_SIZE;
-	_mmngr_used_blocks++;
+	// Ignore blocks that are not allocated, a shared block stays allocated
+	// for the other owners
+	if(frame < pmmngr_get_block_count() && mmap_test(frame) && !pmmngr_unshare_block(p)){
 
-	memset(addr, 0x00, PMMNGR_BLOCK_SIZE);
+		// Mark as free
+		mmap_unset(frame);
+		buddy_free(frame, 0);
 
-	// Return address of block start
-	return (void*) addr;
+		_mmngr_used_blocks--;
+	}
+
+	pmmngr_unlock(flags);
 }
 
-void pmmngr_free_block(void* p){
+void pmmngr_share_block(void* p){
 
-	// Calculate frame of the address
-	physical_addr addr = (physical_addr)p;
-	int frame = addr / PMMNGR_BLOCK_SIZE;
+	uint32_t flags = pmmngr_lock();
+
+	uint16_t* refs = pmmngr_block_refs((physical_addr)p / PMMNGR_BLOCK_SIZE);
 
-	// Mark as free
-	mmap_unset(frame);
+	if(refs)
+		(*refs)++;
 
-	_mmngr_used_blocks--;
+	pmmngr_unlock(flags);
 }
 
-void* pmmngr_alloc_blocks(size_t size){
+int pmmngr_unshare_block(void* p){
 
-	// Out of memory
-	if(pmmngr_get_block_count() <= size)
-		return 0;
+	uint32_t flags = pmmngr_lock();
 
-	int frame = mmap_first_free_s(size);
+	uint16_t* refs = pmmngr_block_refs((physical_addr)p / PMMNGR_BLOCK_SIZE);
 
-	// Out of memory
-	if(frame == -1)
+	int shared = refs && *refs;
+
+	if(shared)
+		(*refs)--;
+
+	pmmngr_unlock(flags);
+
+	return shared;
+}
+
+uint32_t pmmngr_get_block_owners(void* p){
+
+	uint32_t frame = (physical_addr)p / PMMNGR_BLOCK_SIZE;
+	uint16_t* refs = pmmngr_block_refs(frame);
+
+	if(!refs || !mmap_test(frame))
 		return 0;
 
-	for(uint32_t i = 0; i < size; ++i){
-		mmap_set(frame + i);
-	}
+	return *refs + 1;
+}
 
-	physical_addr addr = frame * PMMNGR_BLOCK_SIZE;
-	_mmngr_used_blocks += size;
+int pmmngr_alloc_run(size_t size);
 
-	return (void*) addr;
+int pmmngr_alloc_run(size_t size){
+
+	int frame;
+
+	uint32_t order = buddy_order(size);
+
+	if(order <= PMMNGR_MAX_ORDER){
+
+		frame = buddy_alloc(order);
+
+		// Out of memory
+		if(frame == -1)
+			return -1;
+
+		// Give back the part of the block that was not asked for
+		buddy_free_range(frame + size, (1 << order) - size);
+
+		mmap_set_range(frame, size);
+		_mmngr_used_blocks += size;
+
+	} else {
+
+		// Too large for the buddy allocator, search the bitmap.
+		frame = mmap_first_free_s(size);
+
+		// Out of memory
+		if(frame == -1)
+			return -1;
+
+		pmmngr_claim_range(frame, size);
+	}
+
+	return frame;
 }
 
-void* pmmngr_alloc_blocks_z(size_t size){
+void* pmmngr_alloc_blocks(size_t size){
 
-	// Out of memory
-	if(pmmngr_get_block_count() <= size)
+	if(size == 0)
 		return 0;
 
-	int frame = mmap_first_free_s(size);
+	uint32_t flags = pmmngr_lock();
+
+	int frame = -1;
+
+	if(pmmngr_get_free_block_count() >= size)
+		frame = pmmngr_alloc_run(size);
+
+	while(frame == -1 && pmmngr_extend(size))
+		frame = pmmngr_alloc_run(size);
+
+	// Let the caches give memory back before failing
+	if(frame == -1 && mem_zone_reclaim_for(size))
+		frame = pmmngr_alloc_run(size);
 
 	// Out of memory
-	if(frame == -1)
+	if(frame == -1){
+		pmmngr_unlock(flags);
 		return 0;
-
-	for(uint32_t i = 0; i < size; ++i){
-		mmap_set(frame + i);
 	}
 
+	mem_zone_balance();
+
+	pmmngr_unlock(flags);
+
 	physical_addr addr = frame * PMMNGR_BLOCK_SIZE;
-	_mmngr_used_blocks += size;
 
-	memset(addr, 0x00, PMMNGR_BLOCK_SIZE * size);
+	return (void*) addr;
+}
+
+void* pmmngr_alloc_blocks_z(size_t size){
+
+	physical_addr addr = (physical_addr)pmmngr_alloc_blocks(size);
+
+	if(!addr)
+		return 0;
+
+	memset((void*)addr, 0x00, PMMNGR_BLOCK_SIZE * size);
 
 	return (void*) addr;
 }
@@ -303,11 +925,11 @@ void pmmngr_free_blocks(void* p, size_t size){
 	physical_addr addr = (physical_addr)p;
 	int frame = addr / PMMNGR_BLOCK_SIZE;
 
-	for(uint32_t i = 0; i < size; ++i){
-		mmap_unset(frame + i);
-	}
+	uint32_t flags = pmmngr_lock();
 
-	_mmngr_used_blocks -= size;
+	pmmngr_release_range(frame, size);
+
+	pmmngr_unlock(flags);
 }
 
 size_t pmmngr_get_memory_size(){
@@ -326,10 +948,27 @@ uint32_t pmmngr_get_free_block_count(){
 	return _mmngr_max_blocks - _mmngr_used_blocks;
 }
 
+uint32_t pmmngr_get_pending_block_count(){
+	return _mmngr_pending_blocks;
+}
+
 uint32_t pmmngr_get_block_size(){
 	return PMMNGR_BLOCK_SIZE;
 }
 
+uint32_t pmmngr_get_bitmap_size(){
+
+	uint32_t entries = mmap_entry_count();
+
+	for(uint32_t order = 0; order <= PMMNGR_MAX_ORDER; ++order){
+		entries += _mmngr_buddy_entries[order];
+	}
+
+	uint32_t refs = (_mmngr_ref_count * sizeof(uint16_t) + sizeof(uint32_t) - 1) & ~(sizeof(uint32_t) - 1);
+
+	return entries * sizeof(uint32_t) + refs;
+}
+
 void pmmngr_paging_enable(int b){
 
 	uint32_t cr0_reg;
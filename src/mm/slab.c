@@ -0,0 +1,357 @@
+/** @file slab.c
+ *  @brief Kernel slab allocator.
+ *
+ *	Size-classed object caches in front of the region allocator. Each slab
+ *	is a SLAB_SIZE chunk allocated from the kernel heap and aligned at its
+ *	own size. The slab header lives in the first bytes of the chunk and the
+ *	rest is split into objects of the cache size.
+ *
+ *	The header is followed by one tag byte per object, recording which heap
+ *	statistics tag the object is accounted to.
+ *
+ *	Free objects are kept in a singly linked list threaded through the objects
+ *	themselves. Objects that have never been handed out are not put on the
+ *	list, they are carved from the end of the used area instead, so creating
+ *	a slab does not touch the whole chunk.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include <mm/slab.h>
+
+#include <mm/kernel_heap.h>
+#include <mm/heap_stats.h>
+
+#include <lib/string.h>
+
+// The header area is rounded up to this, to keep the objects aligned.
+#define SLAB_HEADER_ALIGN 64U
+
+struct _slab_cache_t;
+
+typedef struct _slab_t
+{
+	// Cache this slab belongs to
+	struct _slab_cache_t* cache;
+
+	// Links in the partial list of the cache
+	struct _slab_t* next;
+	struct _slab_t* prev;
+
+	// Objects that have been freed
+	void* freeList;
+
+	// Number of allocated objects
+	uint32_t inUse;
+
+	// Number of objects handed out from the uncarved area
+	uint32_t carved;
+
+	// Statistics tag of each object
+	uint8_t tags[];
+} slab_t;
+
+typedef struct _slab_cache_t
+{
+	uint32_t objectSize;
+	uint32_t objectShift;
+	uint32_t objectsPerSlab;
+
+	// Size of the header including the tag array
+	uint32_t headerSize;
+
+	// Slabs with at least one free object
+	slab_t* partial;
+
+	// A completely free slab kept around to avoid heap churn
+	slab_t* empty;
+
+	uint32_t slabCount;
+} slab_cache_t;
+
+static slab_cache_t _slab_caches[SLAB_CACHE_COUNT];
+
+// One bit for each SLAB_SIZE chunk of the kernel heap, set if the chunk is
+// a slab.
+#define SLAB_BITMAP_ENTRIES \
+	((KERNEL_HEAP_END - KERNEL_HEAP_START) / SLAB_SIZE / 32)
+
+static uint32_t _slab_bitmap[SLAB_BITMAP_ENTRIES] = {0};
+
+slab_cache_t* slab_find_cache(size_t size);
+slab_t* slab_create(slab_cache_t* cache);
+void slab_destroy(slab_t* slab);
+void slab_list_push(slab_t** list, slab_t* slab);
+void slab_list_remove(slab_t** list, slab_t* slab);
+void slab_mark(slab_t* slab, int isSlab);
+
+static inline uint32_t slab_object_index(slab_t* slab, void* obj)
+{
+	uint32_t offset = (uintptr_t)obj - (uintptr_t)slab - slab->cache->headerSize;
+
+	return offset >> slab->cache->objectShift;
+}
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void slab_mark(slab_t* slab, int isSlab)
+{
+	uint32_t chunk = ((uintptr_t)slab - KERNEL_HEAP_START) / SLAB_SIZE;
+
+	if (isSlab)
+	{
+		_slab_bitmap[chunk / 32] |= (1 << (chunk % 32));
+	}
+	else
+	{
+		_slab_bitmap[chunk / 32] &= ~(1 << (chunk % 32));
+	}
+}
+
+int slab_owns(void* addr)
+{
+	uintptr_t a = (uintptr_t)addr;
+
+	if (a < KERNEL_HEAP_START || a >= KERNEL_HEAP_END)
+	{
+		return 0;
+	}
+
+	uint32_t chunk = (a - KERNEL_HEAP_START) / SLAB_SIZE;
+
+	return _slab_bitmap[chunk / 32] & (1 << (chunk % 32));
+}
+
+void slab_list_push(slab_t** list, slab_t* slab)
+{
+	slab->prev = 0;
+	slab->next = *list;
+
+	if (*list)
+	{
+		(*list)->prev = slab;
+	}
+
+	*list = slab;
+}
+
+void slab_list_remove(slab_t** list, slab_t* slab)
+{
+	if (slab->prev)
+	{
+		slab->prev->next = slab->next;
+	}
+	else
+	{
+		*list = slab->next;
+	}
+
+	if (slab->next)
+	{
+		slab->next->prev = slab->prev;
+	}
+
+	slab->next = 0;
+	slab->prev = 0;
+}
+
+slab_cache_t* slab_find_cache(size_t size)
+{
+	if (size > SLAB_MAX_OBJECT_SIZE)
+	{
+		return 0;
+	}
+
+	uint32_t objectSize = SLAB_MIN_OBJECT_SIZE;
+	uint32_t i = 0;
+
+	while (objectSize < size)
+	{
+		objectSize <<= 1;
+		++i;
+	}
+
+	return &_slab_caches[i];
+}
+
+slab_t* slab_create(slab_cache_t* cache)
+{
+	slab_t* slab = (slab_t*)kernel_malloc_ac(SLAB_SIZE, SLAB_SIZE, "Slab");
+
+	if (!slab)
+	{
+		return 0;
+	}
+
+	slab->cache = cache;
+	slab->next = 0;
+	slab->prev = 0;
+	slab->freeList = 0;
+	slab->inUse = 0;
+	slab->carved = 0;
+
+	slab_mark(slab, 1);
+
+	cache->slabCount++;
+
+	return slab;
+}
+
+void slab_destroy(slab_t* slab)
+{
+	slab->cache->slabCount--;
+
+	// Clear the mark first, or kernel_free would hand the slab back to us.
+	slab_mark(slab, 0);
+
+	kernel_free(slab);
+}
+
+static uint32_t slab_header_size(uint32_t objects)
+{
+	uint32_t size = sizeof(slab_t) + objects;
+
+	return (size + SLAB_HEADER_ALIGN - 1) & ~(SLAB_HEADER_ALIGN - 1);
+}
+
+void slab_init()
+{
+	for (uint32_t i = 0; i < SLAB_CACHE_COUNT; ++i)
+	{
+		uint32_t objectSize = SLAB_MIN_OBJECT_SIZE << i;
+
+		// Fit as many objects as possible next to the header and tag array
+		uint32_t objects = SLAB_SIZE / objectSize;
+
+		while (slab_header_size(objects) + objects * objectSize > SLAB_SIZE)
+		{
+			--objects;
+		}
+
+		_slab_caches[i].objectSize = objectSize;
+		_slab_caches[i].objectShift = 4 + i;
+		_slab_caches[i].objectsPerSlab = objects;
+		_slab_caches[i].headerSize = slab_header_size(objects);
+		_slab_caches[i].partial = 0;
+		_slab_caches[i].empty = 0;
+		_slab_caches[i].slabCount = 0;
+	}
+
+	memset(_slab_bitmap, 0, sizeof(_slab_bitmap));
+}
+
+uint32_t slab_get_memory_usage()
+{
+	uint32_t slabs = 0;
+
+	for (uint32_t i = 0; i < SLAB_CACHE_COUNT; ++i)
+	{
+		slabs += _slab_caches[i].slabCount;
+	}
+
+	return slabs * SLAB_SIZE;
+}
+
+void* slab_alloc(size_t size, uint8_t tag)
+{
+	slab_cache_t* cache = slab_find_cache(size);
+
+	if (!cache)
+	{
+		return 0;
+	}
+
+	slab_t* slab = cache->partial;
+
+	if (!slab)
+	{
+		// Reuse the spare empty slab if we have one.
+		if (cache->empty)
+		{
+			slab = cache->empty;
+			cache->empty = 0;
+		}
+		else
+		{
+			slab = slab_create(cache);
+
+			if (!slab)
+			{
+				return 0;
+			}
+		}
+
+		slab_list_push(&cache->partial, slab);
+	}
+
+	void* obj;
+
+	if (slab->freeList)
+	{
+		obj = slab->freeList;
+		slab->freeList = *(void**)obj;
+	}
+	else
+	{
+		obj = (uint8_t*)slab + cache->headerSize + (slab->carved << cache->objectShift);
+		slab->carved++;
+	}
+
+	slab->inUse++;
+
+	slab->tags[slab_object_index(slab, obj)] = tag;
+	heap_stats_alloc(tag, cache->objectSize);
+
+	// A full slab is not tracked, it comes back when an object is freed.
+	if (slab->inUse == cache->objectsPerSlab)
+	{
+		slab_list_remove(&cache->partial, slab);
+	}
+
+	return obj;
+}
+
+int slab_free(void* addr)
+{
+	if (!slab_owns(addr))
+	{
+		return 0;
+	}
+
+	slab_t* slab = (slab_t*)((uintptr_t)addr & ~(SLAB_SIZE - 1));
+	slab_cache_t* cache = slab->cache;
+
+	heap_stats_free(slab->tags[slab_object_index(slab, addr)], cache->objectSize);
+
+	// The slab was full and therefore not on any list.
+	if (slab->inUse == cache->objectsPerSlab)
+	{
+		slab_list_push(&cache->partial, slab);
+	}
+
+	*(void**)addr = slab->freeList;
+	slab->freeList = addr;
+
+	slab->inUse--;
+
+	if (slab->inUse == 0)
+	{
+		slab_list_remove(&cache->partial, slab);
+
+		// Keep one empty slab per cache, give the rest back to the heap.
+		if (!cache->empty)
+		{
+			slab->freeList = 0;
+			slab->carved = 0;
+			cache->empty = slab;
+		}
+		else
+		{
+			slab_destroy(slab);
+		}
+	}
+
+	return 1;
+}
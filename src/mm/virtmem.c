@@ -1,5 +1,12 @@
 #include <mm/virtmem.h>
 
+#include <mm/frame_cache.h>
+#include <mm/zero_pool.h>
+
+#include <hal/hal.h>
+#include <hal/cpu.h>
+
+#include <lib/string.h>
 #include <lib/stdio.h>
 
 //===================================================================
@@ -66,8 +73,9 @@ physical_addr pd_entry_pfn (pd_entry e){
 	return e & I86_PDE_FRAME;
 }
 
-void pd_entry_enable_global (pd_entry e){
-	// Empty for now.	
+void pd_entry_enable_global (pd_entry* e){
+	// Only meaningful for 4MB pages, page tables have the bit in each PTE.
+	*e |= I86_PDE_CPU_GLOBAL;
 }
 
 //===================================================================
@@ -84,84 +92,241 @@ pdirectory* _cur_directory = 0;
 // current page directory base register
 physical_addr _cur_pdbr = 0;
 
+// Above this many pages a range flush drops the whole TLB instead of
+// invalidating page by page
+#define VMMNGR_INVLPG_LIMIT 32
+
+// I86_PTE_CPU_GLOBAL once global pages are enabled
+static uint32_t _global_flag = 0;
+
+// Disables interrupts and returns the previous flags
+static inline uint32_t vmmngr_lock(){
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void vmmngr_unlock(uint32_t flags){
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+// Nesting depth of vmmngr_begin, and whether a directory that is not
+// current has been mapped at the scratch slots since the outermost began
+static uint32_t _walk_depth = 0;
+static int _walk_foreign = 0;
+
+// Starts working on a directory. Directories that are not current are
+// reached through scratch pages, so this disables interrupts until the
+// matching vmmngr_end.
+static inline uint32_t vmmngr_begin(){
+
+	uint32_t flags = vmmngr_lock();
+
+	_walk_depth++;
+
+	return flags;
+}
+
+static inline void vmmngr_end(uint32_t flags){
+
+	if (--_walk_depth == 0 && _walk_foreign) {
+		vmmngr_unmap_temp(VMMNGR_TEMP_DIR);
+		vmmngr_unmap_temp(VMMNGR_TEMP_TABLE);
+		_walk_foreign = 0;
+	}
+
+	vmmngr_unlock(flags);
+}
+
+// Maps a frame of a directory that is not current at a scratch slot until
+// the outermost vmmngr_end
+static inline void* vmmngr_map_foreign(uint32_t slot, physical_addr frame){
+
+	_walk_foreign = 1;
+
+	return vmmngr_map_temp(slot, frame);
+}
+
+// Returns the entries of a page directory. The current directory is
+// reached through the self-map, others through a scratch page, so the
+// caller must be between vmmngr_begin and vmmngr_end. Directories are not
+// used through their physical address, which is only mapped for the first
+// 4MB.
+static inline pd_entry* vmmngr_entries_of(pdirectory* dir){
+
+	if (dir == _cur_directory)
+		return (pd_entry*)VMMNGR_SELF_MAP_DIRECTORY;
+
+	return (pd_entry*)vmmngr_map_foreign(VMMNGR_TEMP_DIR, (physical_addr)dir);
+}
+
+// Returns the page table covering an address, reached like the directory.
+// The directory entry must point to a page table.
+static inline pt_entry* vmmngr_table_of(pdirectory* dir, virtual_addr virt){
+
+	if (dir == _cur_directory)
+		return (pt_entry*)(VMMNGR_SELF_MAP_TABLES + PAGE_DIRECTORY_INDEX(virt) * PAGE_SIZE);
+
+	pd_entry entry = vmmngr_entries_of(dir)[PAGE_DIRECTORY_INDEX(virt)];
+
+	return (pt_entry*)vmmngr_map_foreign(VMMNGR_TEMP_TABLE, entry & ~0xfff);
+}
+
+// Drops the cached self-map translation of a page table after its
+// directory entry changed
+static inline void vmmngr_flush_table_of(pdirectory* dir, virtual_addr virt){
+
+	if (dir == _cur_directory) {
+		virtual_addr table = VMMNGR_SELF_MAP_TABLES + PAGE_DIRECTORY_INDEX(virt) * PAGE_SIZE;
+		asm volatile ("invlpg (%0)" :: "r"(table) : "memory");
+	}
+}
+
+// First directory entry of the kernel half
+#define VMMNGR_KERNEL_INDEX PAGE_DIRECTORY_INDEX(VMMNGR_KERNEL_SPACE)
+
+// Kernel directory entries as last set in any address space. The kernel
+// half is copied when an address space is cloned, so entries set later are
+// picked up from here by the other address spaces the first time they look.
+// Removing a kernel entry is only seen by address spaces that have not
+// copied it yet, kernel page tables and large pages are meant to stay.
+static pd_entry _kernel_entries[PAGES_PER_DIR - VMMNGR_KERNEL_INDEX];
+
+static inline int vmmngr_is_shared_entry(uint32_t index){
+	return index >= VMMNGR_KERNEL_INDEX && index != VMMNGR_SELF_MAP_INDEX;
+}
+
+// Sets a directory entry, kernel entries are recorded for all address spaces
+static inline void vmmngr_set_entry(pd_entry* pagedir, uint32_t index, pd_entry entry){
+
+	pagedir[index] = entry;
+
+	if (vmmngr_is_shared_entry(index))
+		_kernel_entries[index - VMMNGR_KERNEL_INDEX] = entry;
+}
+
+// Returns a directory entry. A kernel entry that is missing here but was
+// set in another address space is copied in first. Missing entries are
+// never cached, so no flush is needed.
+static inline pd_entry vmmngr_get_entry(pd_entry* pagedir, uint32_t index){
+
+	if (!(pagedir[index] & I86_PDE_PRESENT) && vmmngr_is_shared_entry(index))
+		pagedir[index] = _kernel_entries[index - VMMNGR_KERNEL_INDEX];
+
+	return pagedir[index];
+}
+
+static void vmmngr_clone_reserved_ranges(pdirectory* from, pdirectory* to);
+
+void* vmmngr_map_temp(uint32_t slot, physical_addr frame){
+
+	// The scratch table is shared, reach it through the self-map of
+	// whatever address space is current
+	pt_entry* table = (pt_entry*)(VMMNGR_SELF_MAP_TABLES + VMMNGR_TEMP_MAP_INDEX * PAGE_SIZE);
+	virtual_addr virt = VMMNGR_TEMP_MAP_BASE + slot * PAGE_SIZE;
+
+	table[slot] = (frame & ~0xfff) | I86_PTE_PRESENT | I86_PTE_WRITABLE;
+
+	asm volatile ("invlpg (%0)" :: "r"(virt) : "memory");
+
+	return (void*)virt;
+}
+
+void vmmngr_unmap_temp(uint32_t slot){
+
+	pt_entry* table = (pt_entry*)(VMMNGR_SELF_MAP_TABLES + VMMNGR_TEMP_MAP_INDEX * PAGE_SIZE);
+	virtual_addr virt = VMMNGR_TEMP_MAP_BASE + slot * PAGE_SIZE;
+
+	table[slot] = 0;
+
+	asm volatile ("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+// Reads the directory entry covering an address and, if it points to a
+// page table, the page table entry
+static pd_entry vmmngr_lookup(pdirectory* dir, virtual_addr virt, pt_entry* page){
+
+	uint32_t flags = vmmngr_begin();
+
+	pd_entry entry = vmmngr_get_entry(vmmngr_entries_of(dir), PAGE_DIRECTORY_INDEX(virt));
+
+	*page = 0;
+
+	if ((entry & I86_PDE_PRESENT) && !(entry & I86_PDE_4MB))
+		*page = vmmngr_table_of(dir, virt)[PAGE_TABLE_INDEX(virt)];
+
+	vmmngr_end(flags);
+
+	return entry;
+}
+
 void vmmngr_map_page(void* phys, void* virt){
 
 	// Get page directory
 	pdirectory* pageDirectory = vmmngr_get_directory();
 
-	pd_entry* e = 
-		&pageDirectory->m_entries[PAGE_DIRECTORY_INDEX((uint32_t) virt)];
+	uint32_t flags = vmmngr_begin();
 
-	if((*e & I86_PTE_PRESENT) != I86_PTE_PRESENT){
+	pd_entry* pagedir = vmmngr_entries_of(pageDirectory);
+	uint32_t index = PAGE_DIRECTORY_INDEX((uint32_t) virt);
 
-		// Allocate page table
-		ptable* table = (ptable*)pmmngr_alloc_block();
+	pd_entry* e = &pagedir[index];
 
-		if(!table)
-			return;
+	if((vmmngr_get_entry(pagedir, index) & I86_PTE_PRESENT) != I86_PTE_PRESENT){
 
-		memset(table,0,sizeof(ptable));
+		// Allocate a cleared page table
+		ptable* table = (ptable*)zero_pool_alloc();
 
-		pd_entry* entry = 
-			&pageDirectory->m_entries[PAGE_DIRECTORY_INDEX((uint32_t) virt)];
+		if(!table){
+			vmmngr_end(flags);
+			return;
+		}
 
-		pd_entry_add_attrib(entry, I86_PDE_PRESENT);
-		pd_entry_add_attrib(entry, I86_PDE_WRITABLE);
-		pd_entry_set_frame(entry, (physical_addr)table);
-	}
+		pd_entry_add_attrib(e, I86_PDE_PRESENT);
+		pd_entry_add_attrib(e, I86_PDE_WRITABLE);
+		pd_entry_set_frame(e, (physical_addr)table);
+		vmmngr_set_entry(pagedir, index, *e);
 
-	// Get table
-	ptable* table = (ptable*) PAGE_GET_PHYSICAL_ADDRESS(e);
+		vmmngr_flush_table_of(pageDirectory, (virtual_addr)virt);
+	}
 
 	// Get page
-	pt_entry* page = &table->m_entries[PAGE_TABLE_INDEX((uint32_t) virt)];
+	pt_entry* page = &vmmngr_table_of(pageDirectory, (virtual_addr)virt)[PAGE_TABLE_INDEX((uint32_t) virt)];
 
 	pt_entry_set_frame(page, (physical_addr)phys);
 	pt_entry_add_attrib(page, I86_PTE_PRESENT);
+
+	vmmngr_end(flags);
 }
 
 void vmmngr_initialize(){
 
-	// allocate default page table
-	ptable* table = (ptable*) pmmngr_alloc_block ();
-	if (!table){
-		return;
-	}
-    	
-
-	// allocates 3gb page table
+	// allocates identity page table
 	ptable* table2 = (ptable*) pmmngr_alloc_block ();
 	if (!table2){
 		return;
 	}
 
 	// clear page table
-	memset (table, 0, sizeof (ptable));
+	memset (table2, 0, sizeof (ptable));
 
 	// 1st 4mb are idenitity mapped
 	for (int i=0, frame=0x0, virt=0x00000000; i<1024; i++, frame+=4096, virt+=4096) {
 
-		// create a new page
+		// create a new page. It is writable, the kernel still reaches low
+		// memory through these addresses and CR0.WP makes read-only pages
+		// binding for it.
 		pt_entry page=0;
 		pt_entry_add_attrib (&page, I86_PTE_PRESENT);
+		pt_entry_add_attrib (&page, I86_PTE_WRITABLE);
 		pt_entry_set_frame (&page, frame);
 
 		// ...and add it to the page table
 		table2->m_entries [PAGE_TABLE_INDEX (virt) ] = page;
 	}
 
-	// map 1mb to 3gb (where we are at)
-	for (int i=0, frame=0x000000, virt=0xc0000000; i<1024; i++, frame+=4096, virt+=4096) {
-
-		// create a new page
-		pt_entry page=0;
-		pt_entry_add_attrib (&page, I86_PTE_PRESENT);
-		pt_entry_set_frame (&page, frame);
-
-		// ...and add it to the page table
-		table->m_entries [PAGE_TABLE_INDEX (virt) ] = page;
-	}
-
 	// create default directory table
 	pdirectory*   dir = (pdirectory*) pmmngr_alloc_blocks (3);
 	if (!dir){
@@ -171,17 +336,43 @@ void vmmngr_initialize(){
 	// clear directory table and set it as current
 	memset (dir, 0, sizeof (pdirectory));
 
-	// get first entry in dir table and set it up to point to our table
+	// map the first 4mb to 3gb (where we are at) with a single large page.
+	// PSE is enabled by the loader.
 	pd_entry* entry = &dir->m_entries [PAGE_DIRECTORY_INDEX (0xc0000000) ];
 	pd_entry_add_attrib (entry, I86_PDE_PRESENT);
 	pd_entry_add_attrib (entry, I86_PDE_WRITABLE);
-	pd_entry_set_frame (entry, (physical_addr)table);
+	pd_entry_add_attrib (entry, I86_PDE_4MB);
+	pd_entry_set_frame (entry, 0x00000000);
 
 	pd_entry* entry2 = &dir->m_entries [PAGE_DIRECTORY_INDEX (0x00000000) ];
 	pd_entry_add_attrib (entry2, I86_PDE_PRESENT);
 	pd_entry_add_attrib (entry2, I86_PDE_WRITABLE);
 	pd_entry_set_frame (entry2, (physical_addr)table2);
 
+	// empty table for the scratch pages. It is set up before any address
+	// space is cloned, so all of them share it.
+	ptable* temp = (ptable*) pmmngr_alloc_block ();
+	if (!temp){
+		return;
+	}
+
+	memset (temp, 0, sizeof (ptable));
+
+	pd_entry* tempEntry = &dir->m_entries [VMMNGR_TEMP_MAP_INDEX];
+	pd_entry_add_attrib (tempEntry, I86_PDE_PRESENT);
+	pd_entry_add_attrib (tempEntry, I86_PDE_WRITABLE);
+	pd_entry_set_frame (tempEntry, (physical_addr)temp);
+
+	// map the directory into itself
+	pd_entry* self = &dir->m_entries [VMMNGR_SELF_MAP_INDEX];
+	pd_entry_add_attrib (self, I86_PDE_PRESENT);
+	pd_entry_add_attrib (self, I86_PDE_WRITABLE);
+	pd_entry_set_frame (self, (physical_addr)dir);
+
+	// every address space made from now on shares these kernel entries
+	memcpy (_kernel_entries, &dir->m_entries [VMMNGR_KERNEL_INDEX], sizeof (_kernel_entries));
+	_kernel_entries [VMMNGR_SELF_MAP_INDEX - VMMNGR_KERNEL_INDEX] = 0;
+
 	// store current PDBR
 	_cur_pdbr = (physical_addr) &dir->m_entries;
 
@@ -219,14 +410,75 @@ int vmmngr_switch_pdirectory(pdirectory* dir){
 		return 0;
 
 	_cur_directory = dir;
+	_cur_pdbr = (physical_addr) &dir->m_entries;
 
-	printf("%#0(10)p\n", _cur_pdbr);
-
+	// Global kernel mappings stay in the TLB
 	pmmngr_load_PBDR(_cur_pdbr);
 
 	return 1;
 }
 
+int vmmngr_enable_global_pages(){
+
+	if(!(get_cpu_features() & CPU_FEATURE_PGE))
+		return 0;
+
+	pdirectory* dir = vmmngr_get_directory();
+
+	uint32_t flags = vmmngr_begin();
+
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+
+	for(uint32_t i = PAGE_DIRECTORY_INDEX(VMMNGR_KERNEL_SPACE); i < PAGES_PER_DIR; ++i){
+
+		pd_entry* entry = &pagedir[i];
+
+		// The self-map differs between address spaces
+		if(i == VMMNGR_SELF_MAP_INDEX)
+			continue;
+
+		if(!pd_entry_is_present(*entry))
+			continue;
+
+		if(pd_entry_is_4mb(*entry)){
+			pd_entry_enable_global(entry);
+			vmmngr_set_entry(pagedir, i, *entry);
+			continue;
+		}
+
+		pt_entry* table = vmmngr_table_of(dir, i << 22);
+
+		for(uint32_t j = 0; j < PAGES_PER_TABLE; ++j){
+			if(pt_entry_is_present(table[j]))
+				pt_entry_add_attrib(&table[j], I86_PTE_CPU_GLOBAL);
+		}
+	}
+
+	vmmngr_end(flags);
+
+	// Kernel mappings made from now on are global as well
+	_global_flag = I86_PTE_CPU_GLOBAL;
+
+	vmmngr_set_global_pages(1);
+
+	return 1;
+}
+
+void vmmngr_set_global_pages(int enable){
+
+	uint32_t cr4;
+
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+
+	if(enable)
+		cr4 |= 0x80;
+	else
+		cr4 &= ~0x80;
+
+	// Changing PGE flushes the whole TLB, global entries included
+	asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
 pdirectory* vmmngr_get_directory(){
 	return _cur_directory;
 }
@@ -278,76 +530,728 @@ pd_entry* vmmngr_pdirectory_lookup_entry(pdirectory* p, virtual_addr addr){
 
 int vmmngr_createPageTable(pdirectory* dir, uint32_t virt, uint32_t flags) {
 
-	pd_entry* pagedir = dir->m_entries;
-	if (pagedir[virt >> 22] == 0) {
-		void* block = pmmngr_alloc_block();
-		if (!block)
+	uint32_t lockFlags = vmmngr_begin();
+
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+	if (vmmngr_get_entry(pagedir, virt >> 22) == 0) {
+		void* block = zero_pool_alloc();
+		if (!block) {
+			vmmngr_end(lockFlags);
 			return 0; /* Should call debugger */
-		pagedir[virt >> 22] = ((uint32_t)block) | flags;
-		memset((uint32_t*)pagedir[virt >> 22], 0, 4096);
+		}
+		vmmngr_set_entry(pagedir, virt >> 22, ((uint32_t)block) | flags);
 
-		/* map page table into directory */
-		vmmngr_mapPhysicalAddress(dir, (uint32_t)block, (uint32_t)block, flags);
+		/* the table is reachable through the self-map, no mapping needed */
+		vmmngr_flush_table_of(dir, virt);
 	}
+
+	vmmngr_end(lockFlags);
 	return 1; /* success */
 }
 
 void vmmngr_mapPhysicalAddress(pdirectory* dir, uint32_t virt, uint32_t phys, uint32_t flags) {
 
-	pd_entry* pagedir = dir->m_entries;
-	if (pagedir[virt >> 22] == 0)
-		vmmngr_createPageTable(dir, virt, flags);
-	((uint32_t*)(pagedir[virt >> 22] & ~0xfff))[virt << 10 >> 10 >> 12] = phys | flags;
+	uint32_t lockFlags = vmmngr_begin();
+
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+	if (vmmngr_get_entry(pagedir, virt >> 22) == 0 && !vmmngr_createPageTable(dir, virt, flags)) {
+		vmmngr_end(lockFlags);
+		return;
+	}
+
+	/* the address is already covered by a large page */
+	if (pagedir[virt >> 22] & I86_PDE_4MB) {
+		vmmngr_end(lockFlags);
+		return;
+	}
+
+	if (virt >= VMMNGR_KERNEL_SPACE)
+		flags |= _global_flag;
+
+	vmmngr_table_of(dir, virt)[PAGE_TABLE_INDEX(virt)] = phys | flags;
+
+	vmmngr_end(lockFlags);
+}
+
+int vmmngr_mapLargePage(pdirectory* dir, uint32_t virt, uint32_t phys, uint32_t flags) {
+
+	if ((virt | phys) & (LARGE_PAGE_SIZE - 1))
+		return 0;
+
+	uint32_t lockFlags = vmmngr_begin();
+
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+
+	/* a page table is already in the way */
+	if (vmmngr_get_entry(pagedir, virt >> 22) != 0) {
+		vmmngr_end(lockFlags);
+		return 0;
+	}
+
+	if (virt >= VMMNGR_KERNEL_SPACE)
+		flags |= _global_flag;
+
+	/* the entry was empty, so there is nothing cached to flush. Kernel
+	   large pages reach the other address spaces like kernel tables. */
+	vmmngr_set_entry(pagedir, virt >> 22, (phys & 0xFFC00000) | flags | I86_PDE_4MB);
+
+	vmmngr_end(lockFlags);
+	return 1;
+}
+
+void vmmngr_mapPhysicalRegion(pdirectory* dir, uint32_t virt, uint32_t phys, size_t size, uint32_t flags) {
+
+	uint32_t offset = 0;
+
+	while (offset < size) {
+
+		/* use a large page if the rest of a 4mb window is to be mapped */
+		if (!((virt + offset) & (LARGE_PAGE_SIZE - 1)) &&
+			!((phys + offset) & (LARGE_PAGE_SIZE - 1)) &&
+			size - offset >= LARGE_PAGE_SIZE &&
+			vmmngr_mapLargePage(dir, virt + offset, phys + offset, flags)) {
+
+			offset += LARGE_PAGE_SIZE;
+			continue;
+		}
+
+		/* map the rest of the window, or of the region, with small pages */
+		uint32_t run = LARGE_PAGE_SIZE - ((virt + offset) & (LARGE_PAGE_SIZE - 1));
+
+		if (run > size - offset)
+			run = size - offset;
+
+		vmmngr_map_range(dir, virt + offset, phys + offset, run, flags);
+		offset += (run + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	}
+}
+
+static void vmmngr_flush_range(pdirectory* dir, virtual_addr virt, uint32_t pages) {
+
+	/* other address spaces are flushed when they are loaded */
+	if (dir != vmmngr_get_directory())
+		return;
+
+	if (pages <= VMMNGR_INVLPG_LIMIT) {
+		for (uint32_t i = 0; i < pages; ++i)
+			asm volatile ("invlpg (%0)" :: "r"(virt + i * PAGE_SIZE) : "memory");
+		return;
+	}
+
+	/* a CR3 reload keeps global entries, toggling PGE drops them as well */
+	if (virt + pages * PAGE_SIZE > VMMNGR_KERNEL_SPACE && _global_flag) {
+		vmmngr_set_global_pages(0);
+		vmmngr_set_global_pages(1);
+	} else {
+		pmmngr_load_PBDR(_cur_pdbr);
+	}
+}
+
+int vmmngr_map_range(pdirectory* dir, virtual_addr virt, physical_addr phys, size_t size, uint32_t flags) {
+
+	uint32_t lockFlags = vmmngr_begin();
+
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+
+	uint32_t pages = (size + (virt & (PAGE_SIZE - 1)) + PAGE_SIZE - 1) / PAGE_SIZE;
+	uint32_t pteFlags = flags;
+
+	virt &= ~(PAGE_SIZE - 1);
+	phys &= ~(PAGE_SIZE - 1);
+
+	if (virt >= VMMNGR_KERNEL_SPACE)
+		pteFlags |= _global_flag;
+
+	uint32_t replaced = 0;
+	uint32_t done = 0;
+
+	while (done < pages) {
+
+		virtual_addr addr = virt + done * PAGE_SIZE;
+
+		if (vmmngr_get_entry(pagedir, addr >> 22) == 0 && !vmmngr_createPageTable(dir, addr, flags)) {
+			vmmngr_end(lockFlags);
+			return 0;
+		}
+
+		/* skip the part covered by a large page */
+		if (pagedir[addr >> 22] & I86_PDE_4MB) {
+			done += PAGES_PER_TABLE - PAGE_TABLE_INDEX(addr);
+			continue;
+		}
+
+		/* fill this page table in one go */
+		pt_entry* table = vmmngr_table_of(dir, addr);
+
+		for (uint32_t index = PAGE_TABLE_INDEX(addr); index < PAGES_PER_TABLE && done < pages; ++index, ++done) {
+
+			if (table[index] & I86_PTE_PRESENT)
+				replaced++;
+
+			table[index] = (phys + done * PAGE_SIZE) | pteFlags;
+		}
+	}
+
+	vmmngr_end(lockFlags);
+
+	/* new entries were never cached, only replaced ones need flushing */
+	if (replaced)
+		vmmngr_flush_range(dir, virt, pages);
+
+	return 1;
+}
+
+void vmmngr_unmap_range(pdirectory* dir, virtual_addr virt, size_t size) {
+
+	uint32_t lockFlags = vmmngr_begin();
+
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+
+	uint32_t pages = (size + (virt & (PAGE_SIZE - 1)) + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	virt &= ~(PAGE_SIZE - 1);
+
+	uint32_t removed = 0;
+	uint32_t done = 0;
+
+	while (done < pages) {
+
+		virtual_addr addr = virt + done * PAGE_SIZE;
+		uint32_t index = PAGE_TABLE_INDEX(addr);
+		uint32_t left = PAGES_PER_TABLE - index;
+
+		if (!(vmmngr_get_entry(pagedir, addr >> 22) & I86_PDE_PRESENT)) {
+			done += left;
+			continue;
+		}
+
+		/* a large page is only removed if the whole window is unmapped */
+		if (pagedir[addr >> 22] & I86_PDE_4MB) {
+			if (index == 0 && pages - done >= PAGES_PER_TABLE) {
+				vmmngr_set_entry(pagedir, addr >> 22, 0);
+				removed += PAGES_PER_TABLE;
+			}
+			done += left;
+			continue;
+		}
+
+		pt_entry* table = vmmngr_table_of(dir, addr);
+
+		for (; index < PAGES_PER_TABLE && done < pages; ++index, ++done) {
+
+			if (table[index] & I86_PTE_PRESENT)
+				removed++;
+
+			table[index] = 0;
+		}
+	}
+
+	vmmngr_end(lockFlags);
+
+	if (removed)
+		vmmngr_flush_range(dir, virt, pages);
+}
+
+uint32_t vmmngr_release_range(pdirectory* dir, virtual_addr virt, size_t size) {
+
+	uint32_t lockFlags = vmmngr_begin();
+
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+
+	uint32_t pages = size / PAGE_SIZE;
+	uint32_t removed = 0;
+	uint32_t done = 0;
+
+	while (done < pages) {
+
+		virtual_addr addr = virt + done * PAGE_SIZE;
+		uint32_t index = PAGE_TABLE_INDEX(addr);
+		uint32_t left = PAGES_PER_TABLE - index;
+
+		if (!(vmmngr_get_entry(pagedir, addr >> 22) & I86_PDE_PRESENT)) {
+			done += left;
+			continue;
+		}
+
+		/* large pages are left alone, other directories may have copies
+		   of the entry */
+		if (pagedir[addr >> 22] & I86_PDE_4MB) {
+			done += left;
+			continue;
+		}
+
+		pt_entry* table = vmmngr_table_of(dir, addr);
+
+		for (; index < PAGES_PER_TABLE && done < pages; ++index, ++done) {
+
+			if (!(table[index] & I86_PTE_PRESENT))
+				continue;
+
+			frame_cache_free((void*)pt_entry_pfn(table[index]));
+			table[index] = 0;
+			removed++;
+		}
+	}
+
+	vmmngr_end(lockFlags);
+
+	if (removed)
+		vmmngr_flush_range(dir, virt, pages);
+
+	return removed * PAGE_SIZE;
+}
+
+uint32_t vmmngr_page_size(pdirectory* dir, virtual_addr virt) {
+
+	pt_entry page;
+	pd_entry entry = vmmngr_lookup(dir, virt, &page);
+
+	if (!(entry & I86_PDE_PRESENT))
+		return 0;
+
+	if (entry & I86_PDE_4MB)
+		return LARGE_PAGE_SIZE;
+
+	if (!(page & I86_PTE_PRESENT))
+		return 0;
+
+	return PAGE_SIZE;
 }
 
 void vmmngr_unmapPageTable(pdirectory* dir, uint32_t virt) {
-	pd_entry* pagedir = dir->m_entries;
-	if (pagedir[virt >> 22] != 0) {
+
+	uint32_t flags = vmmngr_begin();
+
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+
+	/* the owner frees the memory behind a large page */
+	if (vmmngr_get_entry(pagedir, virt >> 22) & I86_PDE_4MB) {
+		vmmngr_set_entry(pagedir, virt >> 22, 0);
+	} else if (pagedir[virt >> 22] != 0) {
 
 		/* get mapped frame */
 		void* frame = (void*)(pagedir[virt >> 22] & 0x7FFFF000);
 
 		/* unmap frame */
-		pmmngr_free_block(frame);
-		pagedir[virt >> 22] = 0;
+		frame_cache_free(frame);
+		vmmngr_set_entry(pagedir, virt >> 22, 0);
+		vmmngr_flush_table_of(dir, virt);
 	}
+
+	vmmngr_end(flags);
 }
 
 void vmmngr_unmapPhysicalAddress(pdirectory* dir, uint32_t virt) {
 	/* note: we don't unallocate physical address here; callee does that */
-	pd_entry* pagedir = dir->m_entries;
-	if (pagedir[virt >> 22] != 0)
-		vmmngr_unmapPageTable(dir, virt);
-	//      ((uint32_t*) (pagedir[virt >> 22] & ~0xfff))[virt << 10 >> 10 >> 12] = 0;
+	vmmngr_unmap_range(dir, virt, PAGE_SIZE);
 }
 
 pdirectory* vmmngr_createAddressSpace() {
-	pdirectory* dir = 0;
 
 	/* allocate page directory */
-	dir = (pdirectory*)pmmngr_alloc_block();
+	pdirectory* dir = (pdirectory*)pmmngr_alloc_block();
 	if (!dir)
 		return 0;
 
+	/* the directory is not mapped anywhere yet, fill it through a scratch page */
+	uint32_t flags = vmmngr_begin();
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+
 	/* clear memory (marks all page tables as not present) */
-	memset(dir, 0, sizeof(pdirectory));
+	memset(pagedir, 0, sizeof(pdirectory));
+
+	/* map the directory into itself */
+	pagedir[VMMNGR_SELF_MAP_INDEX] = (physical_addr)dir | I86_PDE_PRESENT | I86_PDE_WRITABLE;
+
+	vmmngr_end(flags);
+
 	return dir;
 }
 
+// Frees the user page tables of an address space that is not current
+static void vmmngr_release_user_tables(pdirectory* dir) {
+
+	uint32_t flags = vmmngr_begin();
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+
+	for (uint32_t i = 0; i < 768; ++i) {
+
+		pd_entry entry = pagedir[i];
+
+		if (!(entry & I86_PDE_PRESENT) || !(entry & I86_PDE_USER))
+			continue;
+
+		if (entry & I86_PDE_4MB) {
+			pagedir[i] = 0;
+			continue;
+		}
+
+		pt_entry* table = vmmngr_table_of(dir, i << 22);
+
+		for (uint32_t j = 0; j < PAGES_PER_TABLE; ++j) {
+			pt_entry page = table[j];
+
+			if ((page & I86_PTE_PRESENT) && (page & I86_PTE_USER))
+				pmmngr_free_block((void*)pt_entry_pfn(page));
+		}
+
+		frame_cache_free((void*)(entry & ~0xfff));
+		pagedir[i] = 0;
+	}
+
+	vmmngr_end(flags);
+}
+
 pdirectory* vmmngr_cloneAddressSpace()
 {
 	pdirectory* dir = vmmngr_createAddressSpace();
 
+	if (!dir)
+		return 0;
+
 	pdirectory* current = vmmngr_get_directory();
 
-	memcpy(&dir->m_entries[768], &current->m_entries[768], 256*sizeof(pd_entry));
+	uint32_t flags = vmmngr_begin();
+
+	pd_entry* from = vmmngr_entries_of(current);
+	pd_entry* to = vmmngr_entries_of(dir);
+
+	// User page tables are copied. Writable user pages are made read-only
+	// in both address spaces and copied on the first write.
+	for (uint32_t i = 0; i < 768; ++i) {
+
+		pd_entry entry = from[i];
+
+		if (!(entry & I86_PDE_PRESENT) || !(entry & I86_PDE_USER))
+			continue;
+
+		// Large pages map device memory, share them as they are
+		if (entry & I86_PDE_4MB) {
+			to[i] = entry;
+			continue;
+		}
+
+		pt_entry* table = vmmngr_table_of(current, i << 22);
+		physical_addr copyFrame = (physical_addr)frame_cache_alloc();
+
+		if (!copyFrame) {
+			vmmngr_end(flags);
+
+			vmmngr_release_user_tables(dir);
+			pmmngr_free_block(dir);
+			return 0;
+		}
+
+		// The copy is not linked into the new directory yet
+		pt_entry* copy = (pt_entry*)vmmngr_map_foreign(VMMNGR_TEMP_TABLE, copyFrame);
+
+		for (uint32_t j = 0; j < PAGES_PER_TABLE; ++j) {
+
+			pt_entry page = table[j];
+
+			if (!(page & I86_PTE_PRESENT)) {
+				copy[j] = 0;
+				continue;
+			}
+
+			if (page & I86_PTE_USER) {
+
+				if (page & I86_PTE_WRITABLE) {
+					page = (page & ~I86_PTE_WRITABLE) | I86_PTE_COW;
+					table[j] = page;
+				}
+
+				pmmngr_share_block((void*)pt_entry_pfn(page));
+			}
+
+			copy[j] = page;
+		}
+
+		to[i] = copyFrame | (entry & 0xfff);
+	}
+
+	memcpy(&to[VMMNGR_KERNEL_INDEX], _kernel_entries, sizeof(_kernel_entries));
+
+	to[VMMNGR_SELF_MAP_INDEX] = (physical_addr)dir | I86_PDE_PRESENT | I86_PDE_WRITABLE;
+
+	vmmngr_end(flags);
+
+	vmmngr_clone_reserved_ranges(current, dir);
+
+	// Drop the writable translations of the pages that are now shared
+	pmmngr_load_PBDR(pmmngr_get_PBDR());
 
 	return dir;
 }
 
+void vmmngr_destroyAddressSpace(pdirectory* dir)
+{
+	if (!dir || dir == vmmngr_get_directory())
+		return;
+
+	vmmngr_release_user_tables(dir);
+	pmmngr_free_block(dir);
+}
+
 void* vmmngr_getPhysicalAddress(pdirectory* dir, uint32_t virt) {
-	pd_entry* pagedir = dir->m_entries;
-	if (pagedir[virt >> 22] == 0)
+
+	pt_entry page;
+	pd_entry entry = vmmngr_lookup(dir, virt, &page);
+
+	if (entry == 0)
+		return 0;
+	if (entry & I86_PDE_4MB)
+		return (void*)((entry & 0xFFC00000) | (virt & (LARGE_PAGE_SIZE - 1)));
+
+	if (!(page & I86_PTE_PRESENT))
 		return 0;
-	return (void*)((uint32_t*)(pagedir[virt >> 22] & ~0xfff))[virt << 10 >> 10 >> 12];
+	return (void*)(pt_entry_pfn(page) | (virt & (PAGE_SIZE - 1)));
+}
+
+//===================================================================
+// Demand paging
+//===================================================================
+
+typedef struct {
+
+	// Directory the range belongs to, 0 for kernel ranges
+	pdirectory* dir;
+
+	virtual_addr start;
+	virtual_addr end;
+
+	uint32_t flags;
+
+} vmmngr_reserved_range_t;
+
+static vmmngr_reserved_range_t _reserved_ranges[VMMNGR_MAX_RESERVED_RANGES];
+static uint32_t _reserved_range_count = 0;
+
+static vmmngr_reserved_range_t* vmmngr_find_range(pdirectory* dir, virtual_addr addr){
+
+	for(uint32_t i = 0; i < _reserved_range_count; ++i){
+
+		vmmngr_reserved_range_t* range = &_reserved_ranges[i];
+
+		if(range->dir && range->dir != dir)
+			continue;
+
+		if(addr >= range->start && addr < range->end)
+			return range;
+	}
+
+	return 0;
+}
+
+static int vmmngr_is_mapped(pdirectory* dir, virtual_addr addr){
+
+	pt_entry page;
+	pd_entry entry = vmmngr_lookup(dir, addr, &page);
+
+	if (entry == 0)
+		return 0;
+
+	if (entry & I86_PDE_4MB)
+		return 1;
+
+	return page & I86_PTE_PRESENT;
+}
+
+static int vmmngr_back_page(pdirectory* dir, vmmngr_reserved_range_t* range, virtual_addr addr){
+
+	void* frame;
+
+	// User memory must not leak old contents, kernel memory is initialized
+	// by its owner.
+	if(range->flags & I86_PTE_USER)
+		frame = zero_pool_alloc();
+	else
+		frame = frame_cache_alloc();
+
+	// Out of memory
+	if(!frame)
+		return 0;
+
+	vmmngr_mapPhysicalAddress(dir, addr & ~(PAGE_SIZE - 1), (uint32_t)frame, range->flags | I86_PTE_PRESENT);
+
+	return 1;
+}
+
+int vmmngr_reserve_range(pdirectory* dir, virtual_addr start, size_t size, uint32_t flags){
+
+	virtual_addr end = (start + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	start &= ~(PAGE_SIZE - 1);
+
+	if(end <= start)
+		return 0;
+
+	// Grow a range ending where this one begins, the heap grows like that.
+	for(uint32_t i = 0; i < _reserved_range_count; ++i){
+
+		vmmngr_reserved_range_t* range = &_reserved_ranges[i];
+
+		if(range->dir == dir && range->flags == flags && range->end == start){
+			range->end = end;
+			return 1;
+		}
+	}
+
+	if(_reserved_range_count == VMMNGR_MAX_RESERVED_RANGES)
+		return 0;
+
+	vmmngr_reserved_range_t* range = &_reserved_ranges[_reserved_range_count++];
+
+	range->dir = dir;
+	range->start = start;
+	range->end = end;
+	range->flags = flags;
+
+	return 1;
+}
+
+void vmmngr_unreserve_range(pdirectory* dir, virtual_addr start, size_t size){
+
+	virtual_addr end = start + size;
+
+	for(uint32_t i = 0; i < _reserved_range_count; ++i){
+
+		vmmngr_reserved_range_t* range = &_reserved_ranges[i];
+
+		if(range->dir != dir || range->end <= start || range->start >= end)
+			continue;
+
+		if(range->start >= start && range->end <= end){
+
+			// Covered completely, move the last range into its slot
+			*range = _reserved_ranges[--_reserved_range_count];
+			--i;
+
+		} else if(range->start < start && range->end > end){
+
+			// Split in two, if there is room for the second half
+			if(_reserved_range_count < VMMNGR_MAX_RESERVED_RANGES){
+				vmmngr_reserved_range_t* tail = &_reserved_ranges[_reserved_range_count++];
+
+				*tail = *range;
+				tail->start = end;
+			}
+
+			range->end = start;
+
+		} else if(range->start < start){
+			range->end = start;
+		} else {
+			range->start = end;
+		}
+	}
+}
+
+void vmmngr_commit_range(pdirectory* dir, virtual_addr start, size_t size){
+
+	virtual_addr end = start + size;
+
+	for(virtual_addr addr = start & ~(PAGE_SIZE - 1); addr < end; addr += PAGE_SIZE){
+
+		if(vmmngr_is_mapped(dir, addr))
+			continue;
+
+		vmmngr_reserved_range_t* range = vmmngr_find_range(dir, addr);
+
+		if(range)
+			vmmngr_back_page(dir, range, addr);
+	}
+}
+
+static void vmmngr_clone_reserved_ranges(pdirectory* from, pdirectory* to){
+
+	uint32_t count = _reserved_range_count;
+
+	for(uint32_t i = 0; i < count; ++i){
+
+		vmmngr_reserved_range_t range = _reserved_ranges[i];
+
+		if(range.dir != from)
+			continue;
+
+		vmmngr_reserve_range(to, range.start, range.end - range.start, range.flags);
+	}
+}
+
+static int vmmngr_copy_on_write(pdirectory* dir, virtual_addr addr, uint32_t err){
+
+	// Faults are resolved in the current directory, which is reached
+	// through the self-map and needs no scratch pages
+	pd_entry* pagedir = vmmngr_entries_of(dir);
+
+	if (!(pagedir[addr >> 22] & I86_PDE_PRESENT) || (pagedir[addr >> 22] & I86_PDE_4MB))
+		return 0;
+
+	pt_entry* page = &vmmngr_table_of(dir, addr)[PAGE_TABLE_INDEX(addr)];
+
+	if(!(*page & I86_PTE_COW))
+		return 0;
+
+	if((err & PAGE_FAULT_USER) && !(*page & I86_PTE_USER))
+		return 0;
+
+	virtual_addr pageAddr = addr & ~(PAGE_SIZE - 1);
+	void* frame = (void*)pt_entry_pfn(*page);
+
+	// Copy the page unless this is the last address space using it
+	if(pmmngr_get_block_owners(frame) > 1){
+
+		void* copy = frame_cache_alloc();
+
+		// Out of memory
+		if(!copy)
+			return 0;
+
+		// The new frame is not mapped yet, fill it through a scratch page
+		uint32_t flags = vmmngr_lock();
+
+		memcpy(vmmngr_map_temp(VMMNGR_TEMP_COPY, (physical_addr)copy), (void*)pageAddr, PAGE_SIZE);
+		vmmngr_unmap_temp(VMMNGR_TEMP_COPY);
+
+		vmmngr_unlock(flags);
+
+		pt_entry_set_frame(page, (physical_addr)copy);
+		pmmngr_unshare_block(frame);
+	}
+
+	*page = (*page & ~I86_PTE_COW) | I86_PTE_WRITABLE;
+
+	asm volatile ("invlpg (%0)" :: "r"(pageAddr) : "memory");
+
+	return 1;
+}
+
+int vmmngr_handle_fault(virtual_addr addr, uint32_t err){
+
+	pdirectory* dir = vmmngr_get_directory();
+
+	// The only protection violation we fix is a write to a shared page
+	if(err & PAGE_FAULT_PRESENT){
+
+		if(err & PAGE_FAULT_WRITE)
+			return vmmngr_copy_on_write(dir, addr, err);
+
+		return 0;
+	}
+
+	// The kernel part may have been mapped in another address space since
+	// this one was cloned. Looking it up copies the directory entry over.
+	if(addr >= VMMNGR_KERNEL_SPACE && vmmngr_is_mapped(dir, addr))
+		return 1;
+
+	vmmngr_reserved_range_t* range = vmmngr_find_range(dir, addr);
+
+	if(!range)
+		return 0;
+
+	// User code may only touch user ranges
+	if((err & PAGE_FAULT_USER) && !(range->flags & I86_PTE_USER))
+		return 0;
+
+	return vmmngr_back_page(dir, range, addr);
 }
@@ -0,0 +1,152 @@
+/** @file zero_pool.c
+ *  @brief Zeroed page pool.
+ *
+ *	The pool is a stack of cleared frames. The frames are not mapped
+ *	anywhere while they are in the pool, so each one is cleared through a
+ *	scratch page of the virtual memory manager.
+ *
+ *	The refill thread can be preempted by a thread allocating from the pool,
+ *	so the stack is only touched with interrupts disabled. The frame cache
+ *	and the PMM disable interrupts themselves. A frame is cleared with
+ *	interrupts disabled as well, since the scratch page is shared.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include <mm/zero_pool.h>
+
+#include <mm/physmem.h>
+#include <mm/frame_cache.h>
+#include <mm/mem_zone.h>
+#include <mm/virtmem.h>
+
+#include <lib/string.h>
+
+#define PMMNGR_BLOCK_SIZE 4096
+
+static physical_addr _zero_pool[ZERO_POOL_SIZE];
+static uint32_t _zero_pool_count = 0;
+
+static uint32_t _zero_pool_hits = 0;
+static uint32_t _zero_pool_misses = 0;
+static uint32_t _zero_pool_refilled = 0;
+
+//=============================================================================
+// Helpers
+//=============================================================================
+
+// Disables interrupts and returns the previous flags
+static inline uint32_t zero_pool_lock(){
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void zero_pool_unlock(uint32_t flags){
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+// Clears a frame through the scratch page
+static void zero_pool_clear(physical_addr frame){
+
+	uint32_t flags = zero_pool_lock();
+
+	memset(vmmngr_map_temp(VMMNGR_TEMP_ZERO, frame), 0, PMMNGR_BLOCK_SIZE);
+	vmmngr_unmap_temp(VMMNGR_TEMP_ZERO);
+
+	zero_pool_unlock(flags);
+}
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void* zero_pool_alloc(){
+
+	physical_addr frame = 0;
+
+	uint32_t flags = zero_pool_lock();
+
+	if(_zero_pool_count){
+		frame = _zero_pool[--_zero_pool_count];
+		_zero_pool_hits++;
+	} else {
+		_zero_pool_misses++;
+	}
+
+	zero_pool_unlock(flags);
+
+	if(frame)
+		return (void*)frame;
+
+	frame = (physical_addr)frame_cache_alloc();
+
+	// Out of memory
+	if(!frame)
+		return 0;
+
+	zero_pool_clear(frame);
+
+	return (void*)frame;
+}
+
+uint32_t zero_pool_refill(){
+
+	uint32_t added = 0;
+
+	while(_zero_pool_count < ZERO_POOL_SIZE){
+
+		// The pool would only be drained again by the reclaim callbacks
+		if(mem_zone_get_pressure() != MEM_ZONE_PRESSURE_NONE)
+			break;
+
+		physical_addr frame = (physical_addr)frame_cache_alloc();
+
+		// Out of memory
+		if(!frame)
+			break;
+
+		zero_pool_clear(frame);
+
+		uint32_t flags = zero_pool_lock();
+
+		// The pool might have been filled while we were clearing the frame
+		if(_zero_pool_count == ZERO_POOL_SIZE){
+			zero_pool_unlock(flags);
+			frame_cache_free((void*)frame);
+			break;
+		}
+
+		_zero_pool[_zero_pool_count++] = frame;
+		_zero_pool_refilled++;
+
+		zero_pool_unlock(flags);
+
+		added++;
+	}
+
+	return added;
+}
+
+void zero_pool_drain(){
+
+	uint32_t flags = zero_pool_lock();
+
+	while(_zero_pool_count)
+		frame_cache_free((void*)_zero_pool[--_zero_pool_count]);
+
+	zero_pool_unlock(flags);
+}
+
+void zero_pool_get_stats(zero_pool_stats_t* stats){
+
+	if(!stats)
+		return;
+
+	stats->hits = _zero_pool_hits;
+	stats->misses = _zero_pool_misses;
+	stats->refilled = _zero_pool_refilled;
+	stats->count = _zero_pool_count;
+}
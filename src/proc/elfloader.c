@@ -26,20 +26,14 @@ int verifyImage(char* buffer);
 
 void mapSegment(uint32_t vaddr, uint32_t size)
 {
-	uint32_t numBlocks = MIN_NUM_BLOCKS(size, 0x1000);
-
-	for(int i = 0; i < numBlocks; ++i)
-	{
-		// TODO: Keep track of these so they can be free'd later.
-		uint32_t physAddr = pmmngr_alloc_block();
-
-		// TODO: Check flags of header and map accordingly.
-		vmmngr_mapPhysicalAddress(
-			vmmngr_get_directory(),
-			vaddr + 0x1000*i, 
-			physAddr, 
-			I86_PTE_WRITABLE | I86_PTE_PRESENT | I86_PTE_USER);
-	}
+	// The segment is backed page by page as it is touched, starting with
+	// the copy of the image.
+	// TODO: Check flags of header and map accordingly.
+	vmmngr_reserve_range(
+		vmmngr_get_directory(),
+		vaddr,
+		size,
+		I86_PTE_WRITABLE | I86_PTE_USER);
 }
 
 int verifyImage(char* buffer)
@@ -0,0 +1,107 @@
+#include <proc/run_queue.h>
+
+#include <proc/task.h>
+
+#include <lib/string.h>
+
+//=============================================================================
+// Helpers
+//=============================================================================
+
+static inline uint32_t run_queue_bsr(uint32_t value)
+{
+	uint32_t bit;
+
+	asm ("bsr %1, %0" : "=r"(bit) : "rm"(value));
+
+	return bit;
+}
+
+static inline uint32_t run_queue_bsf(uint32_t value)
+{
+	uint32_t bit;
+
+	asm ("bsf %1, %0" : "=r"(bit) : "rm"(value));
+
+	return bit;
+}
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void run_queue_init(RunQueue* queue)
+{
+	memset(queue, 0, sizeof(RunQueue));
+}
+
+void run_queue_push(RunQueue* queue, Thread* thread)
+{
+	uint32_t level = thread->priority;
+
+	if (thread->queued)
+		return;
+
+	thread->nextQueued = 0;
+	thread->prevQueued = queue->tail[level];
+
+	if (queue->tail[level])
+		queue->tail[level]->nextQueued = thread;
+	else
+		queue->head[level] = thread;
+
+	queue->tail[level] = thread;
+	queue->levels |= 1 << level;
+	queue->count++;
+
+	thread->queued = 1;
+}
+
+void run_queue_remove(RunQueue* queue, Thread* thread)
+{
+	uint32_t level = thread->priority;
+
+	if (!thread->queued)
+		return;
+
+	if (thread->prevQueued)
+		thread->prevQueued->nextQueued = thread->nextQueued;
+	else
+		queue->head[level] = thread->nextQueued;
+
+	if (thread->nextQueued)
+		thread->nextQueued->prevQueued = thread->prevQueued;
+	else
+		queue->tail[level] = thread->prevQueued;
+
+	if (!queue->head[level])
+		queue->levels &= ~(1 << level);
+
+	thread->nextQueued = 0;
+	thread->prevQueued = 0;
+	thread->queued = 0;
+
+	queue->count--;
+}
+
+Thread* run_queue_pop(RunQueue* queue, int lowest)
+{
+	if (!queue->levels)
+		return 0;
+
+	uint32_t level = lowest ? run_queue_bsf(queue->levels) : run_queue_bsr(queue->levels);
+
+	Thread* thread = queue->head[level];
+
+	run_queue_remove(queue, thread);
+
+	return thread;
+}
+
+int run_queue_highest(RunQueue* queue)
+{
+	if (!queue->levels)
+		return -1;
+
+	return run_queue_bsr(queue->levels);
+}
@@ -0,0 +1,151 @@
+#include <proc/stack_pool.h>
+
+#include <mm/frame_cache.h>
+
+#include <lib/string.h>
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+//=============================================================================
+// Helpers
+//=============================================================================
+
+// Disables interrupts and returns the previous flags
+static inline uint32_t stack_pool_lock()
+{
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void stack_pool_unlock(uint32_t flags)
+{
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
+static inline virtual_addr stack_pool_bottom(StackPool* pool, uint32_t slot)
+{
+	return pool->base + slot * pool->slotSize + STACK_POOL_GUARD_PAGES * PAGE_SIZE;
+}
+
+// Frames of freed kernel stacks stay mapped for the next thread
+static inline int stack_pool_retains(StackPool* pool)
+{
+	return !(pool->flags & I86_PTE_USER);
+}
+
+static int stack_pool_map(StackPool* pool, pdirectory* dir, uint32_t slot)
+{
+	virtual_addr bottom = stack_pool_bottom(pool, slot);
+
+	for (uint32_t i = 0; i < pool->pages; ++i)
+	{
+		physical_addr frame = (physical_addr)frame_cache_alloc();
+
+		if (!frame)
+		{
+			vmmngr_release_range(dir, bottom, i * PAGE_SIZE);
+			return 0;
+		}
+
+		vmmngr_mapPhysicalAddress(dir, bottom + i * PAGE_SIZE, frame, pool->flags);
+	}
+
+	return 1;
+}
+
+static void stack_pool_push(StackPool* pool, uint32_t slot)
+{
+	uint32_t flags = stack_pool_lock();
+
+	pool->freeSlots[pool->freeCount++] = slot;
+
+	stack_pool_unlock(flags);
+}
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void stack_pool_init(StackPool* pool, virtual_addr base, uint32_t pages, uint32_t maxSlots, uint32_t flags)
+{
+	memset(pool, 0, sizeof(StackPool));
+
+	if (maxSlots > STACK_POOL_MAX_SLOTS)
+		maxSlots = STACK_POOL_MAX_SLOTS;
+
+	pool->base = base;
+	pool->pages = pages;
+	pool->slotSize = (pages + STACK_POOL_GUARD_PAGES) * PAGE_SIZE;
+	pool->maxSlots = maxSlots;
+	pool->flags = flags;
+}
+
+void* stack_pool_alloc(StackPool* pool, pdirectory* dir)
+{
+	uint32_t slot;
+
+	uint32_t flags = stack_pool_lock();
+
+	if (pool->freeCount)
+	{
+		slot = pool->freeSlots[--pool->freeCount];
+	}
+	else if (pool->usedSlots < pool->maxSlots)
+	{
+		slot = pool->usedSlots++;
+	}
+	else
+	{
+		stack_pool_unlock(flags);
+		return 0;
+	}
+
+	stack_pool_unlock(flags);
+
+	if (!pool->mapped[slot])
+	{
+		if (!stack_pool_map(pool, dir, slot))
+		{
+			stack_pool_push(pool, slot);
+			return 0;
+		}
+
+		pool->mapped[slot] = 1;
+	}
+
+	return (void*)(stack_pool_bottom(pool, slot) + pool->pages * PAGE_SIZE);
+}
+
+void stack_pool_free(StackPool* pool, pdirectory* dir, void* top)
+{
+	virtual_addr addr = (virtual_addr)top;
+
+	if (!top || addr <= pool->base || addr > pool->base + pool->usedSlots * pool->slotSize)
+		return;
+
+	uint32_t slot = (addr - pool->base - 1) / pool->slotSize;
+
+	if (!stack_pool_retains(pool))
+	{
+		vmmngr_release_range(dir, stack_pool_bottom(pool, slot), pool->pages * PAGE_SIZE);
+		pool->mapped[slot] = 0;
+	}
+
+	stack_pool_push(pool, slot);
+}
+
+void stack_pool_get_stats(StackPool* pool, StackPoolStats* stats)
+{
+	if (!stats)
+		return;
+
+	stats->inUse = pool->usedSlots - pool->freeCount;
+	stats->free = pool->freeCount;
+	stats->capacity = pool->maxSlots;
+	stats->stackSize = pool->pages * PAGE_SIZE;
+}
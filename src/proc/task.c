@@ -1,14 +1,19 @@
 #include <proc/task.h>
 
 #include <hal/hal.h>
+#include <hal/pit.h>
+#include <hal/fpu.h>
 
 #include <mm/physmem.h>
 #include <mm/virtmem.h>
+#include <mm/frame_cache.h>
 
 #include <lib/string.h>
 #include <lib/stdio.h>
 
 #include <proc/elfloader.h>
+#include <proc/stack_pool.h>
+#include <proc/run_queue.h>
 
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 4096
@@ -46,23 +51,67 @@ Process* _currentProcess = 0;
 Thread* _currentThread = 0;
 
 void* create_kernel_stack();
-void* create_user_stack();
+void* create_user_stack(pdirectory* dir);
 
 extern void scheduler_isr();
 void sheduler_tick();
 
-extern uint32_t _pit_ticks;
-
 uint32_t sched_current_time = 0;
 
 void thread_set_state(Thread* thread, uint32_t state);
 uint32_t thread_get_state(Thread* thread, uint32_t state);
 void thread_clear_state(Thread* thread, uint32_t state);
 
+//=============================================================================
+// Scheduler state
+//=============================================================================
+
+// Every SCHED_STARVATION_INTERVAL dispatches the lowest ready priority runs
+// instead of the highest one
+#define SCHED_STARVATION_INTERVAL 16
+
+// Ticks a thread runs before others that are ready get a turn
+#define SCHED_TIMESLICE 1
+
+static RunQueue _run_queue;
+
+static uint32_t _dispatch_count = 0;
+
+// Runs when no other thread is ready, never in the run queue
+static Thread* _idleThread = 0;
+
+static TimerWheel _timer_wheel;
+
+// A thread that terminated itself, freed once we have switched away
+static Thread* _zombieThread = 0;
+
+// Thread whose registers are in the FPU
+static Thread* _fpuOwner = 0;
+
+void scheduler_wake_sleepers();
+void scheduler_remove_sleeper(Thread* thread);
+static void scheduler_arm_timer();
+static void scheduler_kick();
+
 //=============================================================================
 // Implementation
 //=============================================================================
 
+// Disables interrupts and returns the previous flags
+static inline uint32_t scheduler_lock()
+{
+	uint32_t flags;
+
+	asm volatile ("pushf; pop %0; cli" : "=r"(flags) :: "memory");
+
+	return flags;
+}
+
+static inline void scheduler_unlock(uint32_t flags)
+{
+	asm volatile ("push %0; popf" :: "r"(flags) : "memory", "cc");
+}
+
 unsigned int readBit(unsigned int bit)
 {
 	unsigned int entry = bit / 32;
@@ -189,53 +238,25 @@ void mapKernelSpace(pdirectory* addressSpace)
 }
 
 #define KERNEL_STACK_ALLOC_BASE 0xF0000000
+#define USER_STACK_ALLOC_BASE 0x70000000
 
-int _kernel_stack_index = 0;
+static StackPool _kernel_stack_pool;
+static StackPool _user_stack_pool;
 
 void* create_kernel_stack()
 {
-	physical_addr	p;
-	virtual_addr	location;
-	void*			ret;
-
-	p = (physical_addr) pmmngr_alloc_block();
-	if(!p)
-		return 0;
-
-	location = KERNEL_STACK_ALLOC_BASE + _kernel_stack_index * PAGE_SIZE;
-
-	vmmngr_mapPhysicalAddress(vmmngr_get_directory(), location, p, 3);
-
-	ret = (void*) (location + PAGE_SIZE);
-	
-	_kernel_stack_index++;
-
-	return ret;
+	return stack_pool_alloc(&_kernel_stack_pool, vmmngr_get_directory());
 }
 
-#define USER_STACK_ALLOC_BASE 0x70000000
-
-int _user_stack_index = 0;
-
-void* create_user_stack()
+void* create_user_stack(pdirectory* dir)
 {
-	physical_addr	p;
-	virtual_addr	location;
-	void*			ret;
-
-	p = (physical_addr) pmmngr_alloc_block();
-	if(!p)
-		return 0;
-	
-	location = USER_STACK_ALLOC_BASE + _user_stack_index * PAGE_SIZE;
-
-	vmmngr_mapPhysicalAddress(vmmngr_get_directory(), location, p, 7);
-
-	ret = (void*)(location + PAGE_SIZE);
-
-	_user_stack_index++;
+	return stack_pool_alloc(&_user_stack_pool, dir);
+}
 
-	return ret;
+void thread_get_stack_stats(StackPoolStats* kernel, StackPoolStats* user)
+{
+	stack_pool_get_stats(&_kernel_stack_pool, kernel);
+	stack_pool_get_stats(&_user_stack_pool, user);
 }
 
 #define KERNEL_THREAD 1
@@ -270,7 +291,7 @@ int createProcess(char* appname, int is_kernel)
 	// Setup process info.
 	process->id = getNextFreeID();
 	process->pageDirectory = addressSpace;
-	process->priority = 1;
+	process->priority = THREAD_PRIORITY_NORMAL;
 	process->state = PROCESS_STATE_ACTIVE;
 	process->is_kernel = is_kernel;
 
@@ -321,19 +342,52 @@ Thread* createThread(Process* process, void(*entry)(void), int is_kernel)
 
 	uint32_t esp;
 
+	pdirectory* dir = process->pageDirectory ? process->pageDirectory : vmmngr_get_directory();
+
 	if(is_kernel)
 	{
-		esp = create_kernel_stack();
+		esp = (uint32_t)create_kernel_stack();
 	}
 	else
 	{
-		esp = create_user_stack();
+		esp = (uint32_t)create_user_stack(dir);
+	}
+
+	if(!esp)
+	{
+		return 0;
 	}
 
 	//printf("%#x\n", esp);
 
+	StackPool* stackPool = is_kernel ? &_kernel_stack_pool : &_user_stack_pool;
+	pdirectory* stackDir = is_kernel ? vmmngr_get_directory() : dir;
+
 	thread = (Thread*)kmalloc(sizeof(Thread));
+
+	if(!thread)
+	{
+		stack_pool_free(stackPool, stackDir, (void*)esp);
+		return 0;
+	}
+
 	memset(thread, 0, sizeof(Thread));
+
+	if(i86_fpu_is_present())
+	{
+		thread->fpuState = kmalloc_a(FPU_STATE_SIZE, FPU_STATE_ALIGN);
+
+		if(!thread->fpuState)
+		{
+			kfree(thread);
+			stack_pool_free(stackPool, stackDir, (void*)esp);
+			return 0;
+		}
+
+		i86_fpu_init_state(thread->fpuState);
+	}
+
+	thread->stack = (void*)esp;
 	
 	esp -= sizeof(TrapFrame);
 
@@ -375,12 +429,14 @@ Thread* createThread(Process* process, void(*entry)(void), int is_kernel)
 
 	thread->id = getNextFreeID();
 	thread->parent = process;
-	thread->priority = 1;
+	thread->priority = min((uint32_t)process->priority, THREAD_PRIORITY_MAX);
 	thread->state = 0;
 	thread->sleepTimeDelta = 0;
 
 	thread->is_kernel = is_kernel;
 
+	uint32_t flags = scheduler_lock();
+
 	Thread* prevThread = getLastThread(process);
 
 	if(prevThread)
@@ -390,30 +446,59 @@ Thread* createThread(Process* process, void(*entry)(void), int is_kernel)
 
 	process->threadCount += 1;
 
+	run_queue_push(&_run_queue, thread);
+	scheduler_kick();
+
+	scheduler_unlock(flags);
+
 	return thread;
 }
 
+// Runs when every other thread is sleeping
+static void scheduler_idle()
+{
+	for(;;)
+		asm volatile ("sti; hlt");
+}
+
 void initialize_scheduler()
 {
 	Process* kernelProcess = (Process*) kmalloc(sizeof(Process));
 	memset(kernelProcess, 0, sizeof(Process));
 
 	kernelProcess->id = getNextFreeID();
-	kernelProcess->priority = 1;
+	kernelProcess->priority = THREAD_PRIORITY_NORMAL;
 	kernelProcess->state = PROCESS_STATE_ACTIVE;
 	kernelProcess->pageDirectory = vmmngr_get_directory();
 
+	stack_pool_init(&_kernel_stack_pool, KERNEL_STACK_ALLOC_BASE, KERNEL_STACK_PAGES, STACK_POOL_MAX_SLOTS, I86_PTE_PRESENT | I86_PTE_WRITABLE);
+	stack_pool_init(&_user_stack_pool, USER_STACK_ALLOC_BASE, USER_STACK_PAGES, STACK_POOL_MAX_SLOTS, I86_PTE_PRESENT | I86_PTE_WRITABLE | I86_PTE_USER);
+
 	_rootProcess = kernelProcess;
 	_kernelProcess = kernelProcess;
 
+	run_queue_init(&_run_queue);
+	timer_wheel_init(&_timer_wheel, sched_current_time);
+
+	_idleThread = createThread(kernelProcess, scheduler_idle, 1);
+	run_queue_remove(&_run_queue, _idleThread);
+	_idleThread->priority = THREAD_PRIORITY_IDLE;
+
 	setvect(32, scheduler_isr, 0x80);
 }
 
 void thread_execute(Thread* t)
 {
+	run_queue_remove(&_run_queue, t);
+
 	_currentThread = t;
 	_currentProcess = t->parent;
 
+	// Ticks are only needed once threads run
+	i86_pit_start_oneshot();
+	sched_current_time = i86_pit_update_tick_count();
+	scheduler_arm_timer();
+
 	asm volatile ("mov %0, %%esp"::"g" (t->esp));
 	asm volatile ("pop	%gs");
 	asm volatile ("pop	%fs");
@@ -423,71 +508,105 @@ void thread_execute(Thread* t)
 	asm volatile ("iret");
 }
 
-Thread* find_next_thread(Thread* thread)
+void dispatch()
 {
-	// Return next thread if there is one.
-	if(thread->nextThread)
+	Thread* current = getCurrentThread();
+
+	// The current thread goes to the back of its level, unless it is
+	// sleeping or gone
+	if(current && current != _idleThread && !current->state)
+		run_queue_push(&_run_queue, current);
+
+	int lowest = (++_dispatch_count % SCHED_STARVATION_INTERVAL) == 0;
+
+	Thread* t = run_queue_pop(&_run_queue, lowest);
+
+	if(!t)
+		t = _idleThread;
+
+	_currentThread = t;
+	_currentProcess = t->parent;
+
+	// The first FPU instruction of another thread faults and switches
+	i86_fpu_set_ts(t != _fpuOwner);
+
+	// Nothing runs on the terminated thread any more
+	if(_zombieThread)
 	{
-		return thread->nextThread;
+		kfree(_zombieThread);
+		_zombieThread = 0;
 	}
+}
 
-	Process* process = thread->parent;
+void scheduler_wake_sleepers()
+{
+	Thread* t = timer_wheel_advance(&_timer_wheel, sched_current_time);
 
-	if(process->nextProcess)
+	while(t)
 	{
-		process = process->nextProcess;
+		Thread* next = t->nextSleeping;
 
-		if(process->firstThread)
-		{
-			return process->firstThread;
-		}
-	}
+		t->nextSleeping = 0;
 
-	process = _rootProcess;
+		thread_clear_state(t, THREAD_STATE_SLEEP);
+		run_queue_push(&_run_queue, t);
 
-	return process->firstThread;
+		t = next;
+	}
 }
 
-void dispatch()
+void scheduler_remove_sleeper(Thread* thread)
 {
-	Thread* t = getCurrentThread();
-	
-	int thread_found = 0;
+	timer_wheel_remove(&_timer_wheel, thread);
+}
 
-	while(!thread_found)
-	{
-	   	t = find_next_thread(t);
+// Arms the timer for the next thing the scheduler has to do: end the
+// timeslice of the current thread if others are ready, or wake a sleeper.
+// A thread that runs alone, or the idle thread, is not interrupted before
+// the next wakeup.
+static void scheduler_arm_timer()
+{
+	uint32_t ticks = i86_pit_get_oneshot_max_ticks();
 
-		if(!thread_get_state(t, THREAD_STATE_SLEEP))
-	   	{
-			thread_found = 1;
-			break;
-		}
+	if(_currentThread != _idleThread && _run_queue.count)
+		ticks = min(ticks, SCHED_TIMESLICE);
 
-		if(t->sleepTimeEnd < sched_current_time)
-		{
-			thread_clear_state(t, THREAD_STATE_SLEEP);
-			thread_found = 1;
-			break;
-		}
-	}
+	i86_pit_arm_oneshot(timer_wheel_next_expiry(&_timer_wheel, ticks));
+}
 
-	_currentThread = t;
-	_currentProcess = t->parent;
+// Called when a thread becomes ready between ticks, so the timer does not
+// leave it waiting for the next wakeup
+static void scheduler_kick()
+{
+	i86_pit_update_tick_count();
+	i86_pit_arm_oneshot(SCHED_TIMESLICE);
 }
 
 void scheduler_tick()
 {
-	// This have to be moved or based on an independent source.
-	sched_current_time = _pit_ticks++;
+	// Also runs on yields, so time is read from the timer rather than
+	// counted in calls
+	sched_current_time = i86_pit_update_tick_count();
+
+	scheduler_wake_sleepers();
 	
 	dispatch();
+
+	scheduler_arm_timer();
 }
 
 void TerminateThread(Thread* thread)
 {
 	Process* parent = thread->parent;
 	
+	uint32_t flags = scheduler_lock();
+
+	run_queue_remove(&_run_queue, thread);
+	scheduler_remove_sleeper(thread);
+
+	if(thread->waitQueue)
+		wait_queue_remove(thread->waitQueue, thread);
+
 	Thread* prevThread = parent->firstThread;
 
 	// Relink thread list.
@@ -505,13 +624,41 @@ void TerminateThread(Thread* thread)
 
 	//printf("Terminating thread %i\n", thread->id);
 
-	// TODO: Unmap stack
+	// Mutexes are not tracked per thread, so unlike the resources released
+	// below, any mutex the thread still holds stays locked. Threads must
+	// unlock them before they terminate.
+
+	// The kernel stack is not touched until it is handed out again, which
+	// can not happen before we have switched away below.
+	if(thread->is_kernel)
+	{
+		stack_pool_free(&_kernel_stack_pool, vmmngr_get_directory(), thread->stack);
+	}
+	else
+	{
+		stack_pool_free(&_user_stack_pool, parent->pageDirectory ? parent->pageDirectory : vmmngr_get_directory(), thread->stack);
+	}
 
 	freeID(thread->id);
 
 	parent->threadCount--;
 
-	kfree(thread);
+	if(_fpuOwner == thread)
+		_fpuOwner = 0;
+
+	kfree(thread->fpuState);
+	thread->fpuState = 0;
+
+	if(thread != getCurrentThread())
+	{
+		kfree(thread);
+		scheduler_unlock(flags);
+		return;
+	}
+
+	// The scheduler frees the thread once it has switched away
+	thread_set_state(thread, THREAD_STATE_TERMINATED);
+	_zombieThread = thread;
 
 	asm volatile ("int $32");
 }
@@ -553,13 +700,93 @@ void thread_sleep(uint32_t ticks)
 
 	//printf("Thread %i sleeping for %i ticks\n", thread->id, ticks);
 
+	uint32_t flags = scheduler_lock();
+
 	thread_set_state(thread, THREAD_STATE_SLEEP);
 
+	// In one-shot mode the time is only read on scheduler ticks, so it can
+	// be several ticks old by now
+	sched_current_time = i86_pit_update_tick_count();
+
 	thread->sleepTimeStart = sched_current_time;
 	thread->sleepTimeDelta = ticks;
 	thread->sleepTimeEnd = sched_current_time + ticks;
 
+	timer_wheel_add(&_timer_wheel, thread);
+
+	asm volatile ("int $32");
+
+	scheduler_unlock(flags);
+}
+
+void thread_set_priority(Thread* thread, uint32_t priority)
+{
+	uint32_t flags = scheduler_lock();
+
+	int queued = thread->queued;
+
+	run_queue_remove(&_run_queue, thread);
+
+	thread->priority = min(priority, THREAD_PRIORITY_MAX);
+
+	if(queued)
+		run_queue_push(&_run_queue, thread);
+
+	scheduler_unlock(flags);
+}
+
+void thread_block()
+{
+	Thread* thread = getCurrentThread();
+
+	uint32_t flags = scheduler_lock();
+
+	thread_set_state(thread, THREAD_STATE_BLOCKED);
+
 	asm volatile ("int $32");
+
+	scheduler_unlock(flags);
+}
+
+void thread_unblock(Thread* thread)
+{
+	uint32_t flags = scheduler_lock();
+
+	if(thread_get_state(thread, THREAD_STATE_BLOCKED))
+	{
+		thread_clear_state(thread, THREAD_STATE_BLOCKED);
+		run_queue_push(&_run_queue, thread);
+
+		// Only cut the current timeslice short for a thread that outranks
+		// the current one. Others wait for the timer that is already armed,
+		// at most the one-shot maximum away.
+		if(!_currentThread || _currentThread == _idleThread || thread->priority > _currentThread->priority)
+			scheduler_kick();
+	}
+
+	scheduler_unlock(flags);
+}
+
+int thread_fpu_fault()
+{
+	Thread* thread = getCurrentThread();
+
+	if(!thread || !thread->fpuState)
+		return 0;
+
+	i86_fpu_set_ts(0);
+
+	if(_fpuOwner == thread)
+		return 1;
+
+	if(_fpuOwner)
+		i86_fpu_save(_fpuOwner->fpuState);
+
+	i86_fpu_restore(thread->fpuState);
+
+	_fpuOwner = thread;
+
+	return 1;
 }
 
 void thread_set_state(Thread* thread, uint32_t state)
@@ -589,7 +816,7 @@ void printProcessTree()
 
 		while(t)
 		{
-			printf("->[t:%i]", t->id);
+			printf("->[t:%i p:%i]", t->id, t->priority);
 			t = t->nextThread;
 		}
 		printf("\n");
@@ -0,0 +1,182 @@
+#include <proc/timer_wheel.h>
+
+#include <proc/task.h>
+
+#include <lib/string.h>
+
+//=============================================================================
+// Helpers
+//=============================================================================
+
+static void timer_wheel_link(TimerWheel* wheel, Thread* thread, uint32_t level, uint32_t slot)
+{
+	Thread** head = &wheel->slots[level][slot];
+
+	thread->prevSleeping = 0;
+	thread->nextSleeping = *head;
+
+	if (*head)
+		(*head)->prevSleeping = thread;
+
+	*head = thread;
+	thread->sleepSlot = head;
+}
+
+static void timer_wheel_unlink(Thread* thread)
+{
+	if (thread->prevSleeping)
+		thread->prevSleeping->nextSleeping = thread->nextSleeping;
+	else
+		*thread->sleepSlot = thread->nextSleeping;
+
+	if (thread->nextSleeping)
+		thread->nextSleeping->prevSleeping = thread->prevSleeping;
+
+	thread->nextSleeping = 0;
+	thread->prevSleeping = 0;
+	thread->sleepSlot = 0;
+}
+
+// Puts a thread in the slot for its wake tick, relative to wheel->now
+static void timer_wheel_place(TimerWheel* wheel, Thread* thread)
+{
+	uint32_t expires = thread->sleepTimeEnd;
+
+	// Already due, wake on the next tick processed
+	if ((int32_t)(expires - wheel->now) < 0)
+		expires = wheel->now;
+
+	uint32_t delta = expires - wheel->now;
+
+	// Too far away, park it and place it again later
+	if (delta >= TIMER_WHEEL_RANGE)
+	{
+		delta = TIMER_WHEEL_RANGE - 1;
+		expires = wheel->now + delta;
+	}
+
+	uint32_t level = 0;
+
+	while (delta >= (1u << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+
+	uint32_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+	timer_wheel_link(wheel, thread, level, slot);
+}
+
+// Empties a slot and places its threads again, returns the slot index
+static uint32_t timer_wheel_cascade(TimerWheel* wheel, uint32_t level)
+{
+	uint32_t slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+	Thread* thread = wheel->slots[level][slot];
+
+	wheel->slots[level][slot] = 0;
+
+	while (thread)
+	{
+		Thread* next = thread->nextSleeping;
+
+		timer_wheel_place(wheel, thread);
+
+		thread = next;
+	}
+
+	return slot;
+}
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void timer_wheel_init(TimerWheel* wheel, uint32_t now)
+{
+	memset(wheel, 0, sizeof(TimerWheel));
+
+	wheel->now = now;
+}
+
+void timer_wheel_add(TimerWheel* wheel, Thread* thread)
+{
+	if (thread->sleepSlot)
+		return;
+
+	timer_wheel_place(wheel, thread);
+
+	wheel->count++;
+}
+
+void timer_wheel_remove(TimerWheel* wheel, Thread* thread)
+{
+	if (!thread->sleepSlot)
+		return;
+
+	timer_wheel_unlink(thread);
+
+	wheel->count--;
+}
+
+Thread* timer_wheel_advance(TimerWheel* wheel, uint32_t now)
+{
+	Thread* expired = 0;
+
+	while ((int32_t)(now - wheel->now) >= 0)
+	{
+		// Nothing to wake or move, catch up at once
+		if (!wheel->count)
+		{
+			wheel->now = now + 1;
+			break;
+		}
+
+		uint32_t slot = wheel->now & TIMER_WHEEL_MASK;
+
+		// Move the threads of the next slot of each level down when the
+		// level below wraps around
+		for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS && slot == 0; ++level)
+			slot = timer_wheel_cascade(wheel, level);
+
+		slot = wheel->now & TIMER_WHEEL_MASK;
+
+		Thread* thread = wheel->slots[0][slot];
+
+		wheel->slots[0][slot] = 0;
+
+		while (thread)
+		{
+			Thread* next = thread->nextSleeping;
+
+			thread->prevSleeping = 0;
+			thread->sleepSlot = 0;
+			thread->nextSleeping = expired;
+			expired = thread;
+
+			wheel->count--;
+
+			thread = next;
+		}
+
+		wheel->now++;
+	}
+
+	return expired;
+}
+
+uint32_t timer_wheel_next_expiry(TimerWheel* wheel, uint32_t limit)
+{
+	if (!wheel->count)
+		return limit;
+
+	for (uint32_t delta = 0; delta < limit && delta < TIMER_WHEEL_SLOTS; ++delta)
+	{
+		uint32_t slot = (wheel->now + delta) & TIMER_WHEEL_MASK;
+
+		// A cascade may bring threads down to level 0. The slot is for tick
+		// now + delta, which is delta + 1 ticks after the last one processed.
+		if (wheel->slots[0][slot] || slot == 0)
+			return delta + 1;
+	}
+
+	return limit;
+}
@@ -0,0 +1,33 @@
+#include <sync/condvar.h>
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void condvar_init(condvar_t* cv)
+{
+	wait_queue_init(&cv->waiters);
+}
+
+void condvar_wait(condvar_t* cv, mutex_t* m)
+{
+	uint32_t flags = wait_queue_lock();
+
+	mutex_unlock(m);
+
+	wait_queue_wait(&cv->waiters);
+
+	wait_queue_unlock(flags);
+
+	mutex_lock(m);
+}
+
+void condvar_signal(condvar_t* cv)
+{
+	wait_queue_wake_one(&cv->waiters);
+}
+
+void condvar_broadcast(condvar_t* cv)
+{
+	wait_queue_wake_all(&cv->waiters);
+}
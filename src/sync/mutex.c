@@ -1,19 +1,70 @@
 #include <sync/mutex.h>
 
-void lock(mutex_t* m)
+#include <proc/task.h>
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void mutex_init(mutex_t* m)
 {
-	asm volatile (	"mov			$1, %%al		;"
-				  	"try_lock:						;"
-					"xchg			%%al, (%%edi)	;"
-					"test			%%al, %%al		;"
-					"jz				exit			;"
-					"hlt							;"
-					"jmp			try_lock		;"
-					"exit:							;"
-					:: "D"(m));
+	m->locked = 0;
+	m->owner = 0;
+
+	wait_queue_init(&m->waiters);
 }
 
-void unlock(mutex_t* m)
+int mutex_trylock(mutex_t* m)
 {
-	asm volatile ("movb $0, (%%edi)" :: "D" (m));
+	uint32_t locked = 1;
+
+	asm volatile ("xchg %0, %1" : "+r"(locked), "+m"(m->locked) :: "memory");
+
+	if (locked)
+		return 0;
+
+	m->owner = getCurrentThread();
+
+	return 1;
+}
+
+void mutex_lock(mutex_t* m)
+{
+	Thread* self = getCurrentThread();
+
+	if (mutex_trylock(m))
+		return;
+
+	uint32_t flags = wait_queue_lock();
+
+	for (;;)
+	{
+		if (mutex_trylock(m))
+			break;
+
+		// mutex_unlock has handed the mutex over
+		if (wait_queue_wait(&m->waiters) && m->owner == self)
+			break;
+	}
+
+	wait_queue_unlock(flags);
+}
+
+void mutex_unlock(mutex_t* m)
+{
+	uint32_t flags = wait_queue_lock();
+
+	Thread* next = wait_queue_wake_one(&m->waiters);
+
+	if (next)
+	{
+		m->owner = next;
+	}
+	else
+	{
+		m->owner = 0;
+		m->locked = 0;
+	}
+
+	wait_queue_unlock(flags);
 }
@@ -0,0 +1,61 @@
+#include <sync/semaphore.h>
+
+#include <proc/task.h>
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void semaphore_init(semaphore_t* s, uint32_t count)
+{
+	s->count = count;
+
+	wait_queue_init(&s->waiters);
+}
+
+void semaphore_wait(semaphore_t* s)
+{
+	uint32_t flags = wait_queue_lock();
+
+	for (;;)
+	{
+		if (s->count)
+		{
+			s->count--;
+			break;
+		}
+
+		// semaphore_signal has handed the unit over
+		if (wait_queue_wait(&s->waiters))
+			break;
+	}
+
+	wait_queue_unlock(flags);
+}
+
+int semaphore_trywait(semaphore_t* s)
+{
+	uint32_t flags = wait_queue_lock();
+
+	int taken = 0;
+
+	if (s->count)
+	{
+		s->count--;
+		taken = 1;
+	}
+
+	wait_queue_unlock(flags);
+
+	return taken;
+}
+
+void semaphore_signal(semaphore_t* s)
+{
+	uint32_t flags = wait_queue_lock();
+
+	if (!wait_queue_wake_one(&s->waiters))
+		s->count++;
+
+	wait_queue_unlock(flags);
+}
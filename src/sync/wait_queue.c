@@ -0,0 +1,101 @@
+#include <sync/wait_queue.h>
+
+#include <proc/task.h>
+
+//=============================================================================
+// Implementation
+//=============================================================================
+
+void wait_queue_init(WaitQueue* queue)
+{
+	queue->head = 0;
+	queue->tail = 0;
+}
+
+int wait_queue_wait(WaitQueue* queue)
+{
+	Thread* thread = getCurrentThread();
+
+	// Nothing to switch to yet
+	if (!thread)
+	{
+		asm volatile ("sti; hlt; cli" ::: "memory");
+		return 0;
+	}
+
+	thread->nextWaiting = 0;
+	thread->waitQueue = queue;
+
+	if (queue->tail)
+		queue->tail->nextWaiting = thread;
+	else
+		queue->head = thread;
+
+	queue->tail = thread;
+
+	thread_block();
+
+	return 1;
+}
+
+Thread* wait_queue_wake_one(WaitQueue* queue)
+{
+	uint32_t flags = wait_queue_lock();
+
+	Thread* thread = queue->head;
+
+	if (thread)
+	{
+		queue->head = thread->nextWaiting;
+
+		if (!queue->head)
+			queue->tail = 0;
+
+		thread->nextWaiting = 0;
+		thread->waitQueue = 0;
+
+		thread_unblock(thread);
+	}
+
+	wait_queue_unlock(flags);
+
+	return thread;
+}
+
+uint32_t wait_queue_wake_all(WaitQueue* queue)
+{
+	uint32_t count = 0;
+
+	while (wait_queue_wake_one(queue))
+		count++;
+
+	return count;
+}
+
+void wait_queue_remove(WaitQueue* queue, Thread* thread)
+{
+	uint32_t flags = wait_queue_lock();
+
+	Thread* prev = 0;
+
+	for (Thread* t = queue->head; t; prev = t, t = t->nextWaiting)
+	{
+		if (t != thread)
+			continue;
+
+		if (prev)
+			prev->nextWaiting = t->nextWaiting;
+		else
+			queue->head = t->nextWaiting;
+
+		if (queue->tail == t)
+			queue->tail = prev;
+
+		thread->nextWaiting = 0;
+		thread->waitQueue = 0;
+
+		break;
+	}
+
+	wait_queue_unlock(flags);
+}
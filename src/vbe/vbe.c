@@ -319,17 +319,13 @@ int vesa_set_vbe_mode(uint16_t mode)
 	
 	uint32_t buf = (uint32_t)current_context.framebuffer;
 	
-	// Identity map vid buffer
-    for(size_t i = 0;
-		i < (current_context.pitch*current_context.height);
-		i+=PAGE_SIZE)
-	{
-    	vmmngr_mapPhysicalAddress(
-			vmmngr_get_directory(),
-			buf + i, // Virtual Address
-			buf + i, // Physical Address
-			I86_PTE_PRESENT | I86_PTE_WRITABLE);
-    }
+	// Identity map vid buffer, with large pages where possible
+	vmmngr_mapPhysicalRegion(
+		vmmngr_get_directory(),
+		buf, // Virtual Address
+		buf, // Physical Address
+		current_context.pitch*current_context.height,
+		I86_PTE_PRESENT | I86_PTE_WRITABLE);
 
 	serial_printf(COM1, "Buffer mapped\n");
 
@@ -463,14 +459,13 @@ void vbe_bochs_set_gfx(uint16_t width, uint16_t height, uint16_t bpp)
 	vbe_current_context.framebuffer = (uint32_t)0xE0000000;
 	
 	unsigned int buf_size = width*height*bpp;
-	for(unsigned int c = 0; c < buf_size; c += 0x1000)
-	{
-		vmmngr_mapPhysicalAddress(
-			vmmngr_get_directory(),
-			vbe_current_context.framebuffer + c,
-			vbe_current_context.framebuffer + c,
-			3);
-	}
+
+	vmmngr_mapPhysicalRegion(
+		vmmngr_get_directory(),
+		vbe_current_context.framebuffer,
+		vbe_current_context.framebuffer,
+		buf_size,
+		3);
 }
 
 void vbe_clear_screen(vesa_pixel_t pixel)
@@ -0,0 +1,467 @@
+/** @file bench.c
+ *  @brief Host side benchmark and fuzzer for the kernel allocators.
+ *
+ *	Runs randomized allocation workloads against kernel_heap.c and
+ *	physmem.c, built for the host with a stub page mapper. The contents of
+ *	every allocation are checked before it is freed, and the allocator
+ *	invariants are checked after every operation (or every n operations).
+ *
+ *	Usage: allocbench [heap|pmm|all] [operations] [seed] [check interval]
+ *
+ *	Latencies are measured in TSC cycles around the allocator call only,
+ *	the checks are not included.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include "host.h"
+#include "checks.h"
+
+#include <mm/physmem.h>
+#include <mm/kernel_heap.h>
+#include <mm/heap_stats.h>
+#include <mm/mem_zone.h>
+#include <mm/frame_cache.h>
+
+#include <lib/string.h>
+#include <lib/stdio.h>
+
+#define PAGE_SIZE 4096
+
+// Simulated physical memory, in KB
+#define BENCH_MEMORY_KB (64 * 1024)
+
+// Live allocation slots of a workload
+#define BENCH_SLOTS 2000
+
+// Most operations that can be timed in one run
+#define BENCH_MAX_OPS 1000000
+
+static uint32_t _bench_bitmap[32768];
+
+static uint32_t _bench_seed = 12345;
+
+static uint8_t* _bench_ptr[BENCH_SLOTS];
+static uint32_t _bench_size[BENCH_SLOTS];
+
+// Cycles of each allocation and free
+static uint32_t _bench_alloc_cycles[BENCH_MAX_OPS];
+static uint32_t _bench_free_cycles[BENCH_MAX_OPS];
+static uint32_t _bench_alloc_count;
+static uint32_t _bench_free_count;
+
+// Owner of every block in the PMM workload
+static uint8_t _bench_block_owned[BENCH_MEMORY_KB / 4];
+
+// Every block, while memory is filled up
+static void* _bench_blocks[BENCH_MEMORY_KB / 4];
+
+// Free frames left scattered in memory for the low memory check, fewer
+// than the low watermark
+#define BENCH_SCATTERED_FRAMES 200
+
+//=============================================================================
+// Helpers
+//=============================================================================
+
+static uint32_t bench_random()
+{
+	_bench_seed = _bench_seed * 1103515245 + 12345;
+
+	return _bench_seed >> 8;
+}
+
+static void bench_sort(uint32_t* values, uint32_t count)
+{
+	// Heap sort, the sample arrays are too large for anything quadratic
+	for (uint32_t start = count / 2; start-- > 0;)
+	{
+		for (uint32_t root = start; 2 * root + 1 < count;)
+		{
+			uint32_t child = 2 * root + 1;
+
+			if (child + 1 < count && values[child + 1] > values[child])
+				child++;
+
+			if (values[root] >= values[child])
+				break;
+
+			uint32_t tmp = values[root];
+			values[root] = values[child];
+			values[child] = tmp;
+			root = child;
+		}
+	}
+
+	for (uint32_t end = count; end-- > 1;)
+	{
+		uint32_t tmp = values[0];
+		values[0] = values[end];
+		values[end] = tmp;
+
+		for (uint32_t root = 0; 2 * root + 1 < end;)
+		{
+			uint32_t child = 2 * root + 1;
+
+			if (child + 1 < end && values[child + 1] > values[child])
+				child++;
+
+			if (values[root] >= values[child])
+				break;
+
+			tmp = values[root];
+			values[root] = values[child];
+			values[child] = tmp;
+			root = child;
+		}
+	}
+}
+
+static void bench_report_latency(const char* name, uint32_t* cycles, uint32_t count)
+{
+	if (!count)
+		return;
+
+	bench_sort(cycles, count);
+
+	printf("  %s: %i ops, p50 %i cycles, p99 %i cycles, max %i cycles\n",
+		name, count, cycles[count / 2], cycles[count - count / 100 - 1], cycles[count - 1]);
+}
+
+static void bench_report_rate(uint32_t ops, uint32_t us)
+{
+	uint32_t ms = us / 1000;
+
+	if (!ms)
+		ms = 1;
+
+	// No 64 bit division without libgcc
+	uint32_t rate = (ops / ms) * 1000 + ((ops % ms) * 1000) / ms;
+
+	printf("  %i operations in %i ms, %i ops/sec (including checks)\n", ops, ms, rate);
+}
+
+static void bench_setup_pmm()
+{
+	// Leave the first megabyte out, like the kernel does, and put a hole in
+	// the middle of memory
+	pmmngr_add_extent(0xC0000000 + 0x100000, BENCH_MEMORY_KB * 512 - 0x100000);
+	pmmngr_add_extent(0xC0000000 + BENCH_MEMORY_KB * 512 + 0x100000, BENCH_MEMORY_KB * 512 - 0x100000);
+
+	uint32_t metadataSize = pmmngr_get_metadata_size(BENCH_MEMORY_KB);
+
+	if (metadataSize > sizeof(_bench_bitmap))
+		host_fail("PMM metadata does not fit", 0);
+
+	pmmngr_init(BENCH_MEMORY_KB, (physical_addr)_bench_bitmap);
+
+	if (pmmngr_get_bitmap_size() != metadataSize)
+		host_fail("PMM metadata size estimate is wrong", 0);
+
+	mem_zone_init();
+}
+
+//=============================================================================
+// Workloads
+//=============================================================================
+
+// Refills the frame cache with single frames below the low watermark, when
+// no run of frames is left
+static void bench_pmm_low_memory()
+{
+	uint32_t freeBlocks = pmmngr_get_free_block_count();
+	uint32_t count = 0;
+
+	while ((_bench_blocks[count] = pmmngr_alloc_block()))
+		count++;
+
+	for (uint32_t i = 0; i < count && i < 2 * BENCH_SCATTERED_FRAMES; i += 2)
+	{
+		pmmngr_free_block(_bench_blocks[i]);
+		_bench_blocks[i] = 0;
+	}
+
+	if (mem_zone_get_pressure() == MEM_ZONE_PRESSURE_NONE)
+		host_fail("no memory pressure", 0);
+
+	void* frames[FRAME_CACHE_BATCH * 2];
+
+	for (uint32_t i = 0; i < FRAME_CACHE_BATCH * 2; ++i)
+	{
+		frames[i] = frame_cache_alloc();
+
+		if (!frames[i])
+			host_fail("frame cache found no frames", i);
+	}
+
+	for (uint32_t i = 0; i < FRAME_CACHE_BATCH * 2; ++i)
+		frame_cache_free(frames[i]);
+
+	frame_cache_drain();
+
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		if (_bench_blocks[i])
+			pmmngr_free_block(_bench_blocks[i]);
+	}
+
+	const char* error = pmm_check();
+
+	if (error)
+		host_fail(error, 0);
+
+	if (pmmngr_get_free_block_count() != freeBlocks)
+		host_fail("blocks leaked under memory pressure", 0);
+
+	printf("  low memory: frame cache refilled from %i scattered frames\n", BENCH_SCATTERED_FRAMES);
+}
+
+static void bench_heap(uint32_t ops, uint32_t interval)
+{
+	printf("\nKernel heap, %i operations\n", ops);
+
+	bench_setup_pmm();
+	init_kernel_heap();
+
+	uint32_t peakFragmentation = 0;
+	uint32_t peakHeapSize = 0;
+	uint32_t liveBytes = 0;
+	uint32_t peakLiveBytes = 0;
+	uint32_t start = host_time_us();
+
+	for (uint32_t op = 0; op < ops; ++op)
+	{
+		uint32_t i = bench_random() % BENCH_SLOTS;
+
+		if (_bench_ptr[i])
+		{
+			for (uint32_t k = 0; k < _bench_size[i]; k += 7)
+			{
+				if (_bench_ptr[i][k] != (uint8_t)i)
+					host_fail("allocation contents overwritten", op);
+			}
+
+			uint32_t t = host_cycles();
+			kfree(_bench_ptr[i]);
+			_bench_free_cycles[_bench_free_count++] = host_cycles() - t;
+
+			liveBytes -= _bench_size[i];
+			_bench_ptr[i] = 0;
+		}
+		else
+		{
+			// Mostly small objects, some page sized and a few large buffers
+			uint32_t kind = bench_random() % 100;
+			uint32_t size = kind < 80 ? 1 + bench_random() % 256 :
+				kind < 97 ? 1 + bench_random() % 4096 : 1 + bench_random() % 400000;
+			uint32_t alignment = (bench_random() % 10 == 0) ? PAGE_SIZE : 0;
+
+			uint32_t t = host_cycles();
+			uint8_t* ptr = alignment ? kmalloc_a(size, alignment) : kmalloc(size);
+			_bench_alloc_cycles[_bench_alloc_count++] = host_cycles() - t;
+
+			if (!ptr)
+				host_fail("out of memory", op);
+
+			if (alignment && ((uint32_t)ptr & (alignment - 1)))
+				host_fail("misaligned allocation", op);
+
+			memset(ptr, (uint8_t)i, size);
+
+			_bench_ptr[i] = ptr;
+			_bench_size[i] = size;
+
+			liveBytes += size;
+			peakLiveBytes = max(peakLiveBytes, liveBytes);
+		}
+
+		if (op % interval == 0)
+		{
+			const char* error = heap_check();
+
+			if (error)
+				host_fail(error, op);
+
+			heap_stats_t stats;
+			heap_stats_get(&stats);
+
+			peakFragmentation = max(peakFragmentation, stats.fragmentation);
+			peakHeapSize = max(peakHeapSize, stats.heapSize);
+		}
+	}
+
+	uint32_t elapsed = host_time_us() - start;
+
+	for (uint32_t i = 0; i < BENCH_SLOTS; ++i)
+	{
+		if (_bench_ptr[i])
+		{
+			kfree(_bench_ptr[i]);
+			_bench_ptr[i] = 0;
+		}
+	}
+
+	heap_trim();
+
+	const char* error = heap_check();
+
+	if (error)
+		host_fail(error, ops);
+
+	heap_stats_t stats;
+	heap_stats_get(&stats);
+
+	bench_report_rate(ops, elapsed);
+	bench_report_latency("kmalloc", _bench_alloc_cycles, _bench_alloc_count);
+	bench_report_latency("kfree", _bench_free_cycles, _bench_free_count);
+
+	printf("  peak fragmentation %i/1000, peak heap %i bytes for %i live bytes\n",
+		peakFragmentation, peakHeapSize, peakLiveBytes);
+	printf("  metadata: %i bytes of region nodes, %i bytes of PMM bitmaps\n",
+		heap_check_node_bytes(), pmmngr_get_bitmap_size());
+	printf("  after freeing everything: heap %i bytes, %i reclaimed by trimming, %i regions\n",
+		stats.heapSize, stats.reclaimedBytes, heap_check_region_count());
+}
+
+static void bench_pmm(uint32_t ops, uint32_t interval)
+{
+	printf("\nPhysical memory manager, %i operations\n", ops);
+
+	bench_setup_pmm();
+
+	uint32_t freeBlocks = pmmngr_get_free_block_count();
+	uint32_t start = host_time_us();
+
+	for (uint32_t op = 0; op < ops; ++op)
+	{
+		uint32_t i = bench_random() % BENCH_SLOTS;
+
+		if (_bench_size[i])
+		{
+			uint32_t first = (uint32_t)_bench_ptr[i] / PAGE_SIZE;
+
+			for (uint32_t k = 0; k < _bench_size[i]; ++k)
+				_bench_block_owned[first + k] = 0;
+
+			uint32_t t = host_cycles();
+
+			if (_bench_size[i] == 1)
+				pmmngr_free_block(_bench_ptr[i]);
+			else
+				pmmngr_free_blocks(_bench_ptr[i], _bench_size[i]);
+
+			_bench_free_cycles[_bench_free_count++] = host_cycles() - t;
+
+			_bench_size[i] = 0;
+		}
+		else
+		{
+			// Mostly single frames, some short runs and a few long ones
+			uint32_t count = bench_random() % 4 ? 1 :
+				1 + bench_random() % (bench_random() % 8 == 0 ? 1500 : 20);
+
+			uint32_t t = host_cycles();
+			void* block = count == 1 ? pmmngr_alloc_block() : pmmngr_alloc_blocks(count);
+			_bench_alloc_cycles[_bench_alloc_count++] = host_cycles() - t;
+
+			if (!block)
+				continue;
+
+			uint32_t first = (uint32_t)block / PAGE_SIZE;
+
+			for (uint32_t k = 0; k < count; ++k)
+			{
+				if (_bench_block_owned[first + k] || !pmm_check_block_used(first + k))
+					host_fail("block handed out twice", op);
+
+				_bench_block_owned[first + k] = 1;
+			}
+
+			_bench_ptr[i] = block;
+			_bench_size[i] = count;
+		}
+
+		if (op % interval == 0)
+		{
+			const char* error = pmm_check();
+
+			if (error)
+				host_fail(error, op);
+		}
+	}
+
+	uint32_t elapsed = host_time_us() - start;
+
+	for (uint32_t i = 0; i < BENCH_SLOTS; ++i)
+	{
+		if (_bench_size[i])
+		{
+			pmmngr_free_blocks(_bench_ptr[i], _bench_size[i]);
+			_bench_size[i] = 0;
+			_bench_ptr[i] = 0;
+		}
+	}
+
+	const char* error = pmm_check();
+
+	if (error)
+		host_fail(error, ops);
+
+	if (pmmngr_get_free_block_count() != freeBlocks)
+		host_fail("blocks leaked", ops);
+
+	bench_pmm_low_memory();
+
+	bench_report_rate(ops, elapsed);
+	bench_report_latency("alloc", _bench_alloc_cycles, _bench_alloc_count);
+	bench_report_latency("free", _bench_free_cycles, _bench_free_count);
+
+	printf("  metadata: %i bytes of bitmaps for %i blocks\n",
+		pmmngr_get_bitmap_size(), pmmngr_get_block_count());
+
+	mem_zone_reclaim_stats_t reclaim;
+	mem_zone_get_reclaim_stats(&reclaim);
+
+	printf("  reclaim: %i runs below the low watermark, %i on failed allocations\n",
+		reclaim.lowRuns, reclaim.failRuns);
+}
+
+//=============================================================================
+// Entry
+//=============================================================================
+
+int main(int argc, char** argv)
+{
+	host_init();
+
+	const char* workload = argc > 1 ? argv[1] : "all";
+	uint32_t ops = argc > 2 ? atoi(argv[2]) : 0;
+	uint32_t interval = argc > 4 ? atoi(argv[4]) : 1;
+
+	if (argc > 3)
+		_bench_seed = atoi(argv[3]);
+
+	if (ops > BENCH_MAX_OPS)
+		ops = BENCH_MAX_OPS;
+
+	if (!interval)
+		interval = 1;
+
+	int all = strcmp(workload, "all") == 0;
+
+	// The PMM workload runs first, the heap keeps its state afterwards
+	if (all || strcmp(workload, "pmm") == 0)
+	{
+		bench_pmm(ops ? ops : 5000, interval);
+
+		_bench_alloc_count = 0;
+		_bench_free_count = 0;
+	}
+
+	if (all || strcmp(workload, "heap") == 0)
+		bench_heap(ops ? ops : 100000, interval);
+
+	printf("\nAll checks passed\n");
+
+	return 0;
+}
@@ -0,0 +1,30 @@
+/** @file checks.h
+ *  @brief Invariant checks used by the allocator bench.
+ *
+ *	Each check returns 0 when the allocator is consistent, or a description
+ *	of the first broken invariant.
+ *
+ *  @author Joakim Bertils
+ */
+
+#ifndef _ALLOCBENCH_CHECKS_H
+#define _ALLOCBENCH_CHECKS_H
+
+#include <lib/stdint.h>
+
+/** @brief Checks the region lists and the address index of the heap. */
+const char* heap_check();
+
+/** @brief Returns the number of heap regions, free and reserved. */
+uint32_t heap_check_region_count();
+
+/** @brief Returns the bytes spent on region nodes. */
+uint32_t heap_check_node_bytes();
+
+/** @brief Checks the block bitmap, buddy maps and hints of the PMM. */
+const char* pmm_check();
+
+/** @brief Returns non-zero if a block is marked used. */
+int pmm_check_block_used(uint32_t block);
+
+#endif
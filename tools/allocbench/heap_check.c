@@ -0,0 +1,168 @@
+/** @file heap_check.c
+ *  @brief Invariant checks of the kernel heap.
+ *
+ *	Includes kernel_heap.c to get at its region lists. Every region has to
+ *	follow the previous one without a gap, free neighbours have to be
+ *	merged, the free list has to hold exactly the free regions, and the
+ *	address index has to be a balanced search tree over all regions.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include "../../src/mm/kernel_heap.c"
+
+#include "checks.h"
+
+static const char* heap_check_tree(region_t* node, uint8_t* low, uint8_t* high, uint32_t* count)
+{
+	if (!node)
+	{
+		return 0;
+	}
+
+	if (node->address < low || node->address > high)
+	{
+		return "address index out of order";
+	}
+
+	int32_t left = region_tree_height(node->left);
+	int32_t right = region_tree_height(node->right);
+
+	if (node->height != 1 + max(left, right) || left - right > 1 || right - left > 1)
+	{
+		return "address index out of balance";
+	}
+
+	(*count)++;
+
+	const char* error = heap_check_tree(node->left, low, node->address, count);
+
+	if (error)
+	{
+		return error;
+	}
+
+	return heap_check_tree(node->right, node->address, high, count);
+}
+
+const char* heap_check()
+{
+	if (!regionTree)
+	{
+		return 0;
+	}
+
+	region_t* region = regionTree;
+
+	while (region->left)
+	{
+		region = region->left;
+	}
+
+	uint8_t* address = (uint8_t*)HEAP_START;
+	region_t* prev = 0;
+	uint32_t count = 0;
+	uint32_t freeCount = 0;
+
+	for (; region; region = region->next)
+	{
+		if (region->address != address)
+		{
+			return "gap between regions";
+		}
+
+		if (region->prev != prev)
+		{
+			return "broken region links";
+		}
+
+		if (!region->reserved)
+		{
+			if (prev && !prev->reserved)
+			{
+				return "free neighbours not merged";
+			}
+
+			freeCount++;
+		}
+
+		if (region_tree_find(region->address) != region)
+		{
+			return "region missing from the address index";
+		}
+
+		address += region->size;
+		prev = region;
+		count++;
+	}
+
+	if (prev != lastRegion)
+	{
+		return "wrong last region";
+	}
+
+	if (address != HEAP_START + heapSize)
+	{
+		return "regions do not add up to the heap size";
+	}
+
+	uint32_t listed = 0;
+
+	for (region_t* free = freeRegions; free; free = free->nextFree)
+	{
+		if (free->reserved)
+		{
+			return "reserved region in the free list";
+		}
+
+		listed++;
+	}
+
+	if (listed != freeCount)
+	{
+		return "free list does not match the free regions";
+	}
+
+	uint32_t indexed = 0;
+	const char* error = heap_check_tree(regionTree, 0, (uint8_t*)0xFFFFFFFF, &indexed);
+
+	if (error)
+	{
+		return error;
+	}
+
+	if (indexed != count)
+	{
+		return "address index does not match the regions";
+	}
+
+	return 0;
+}
+
+uint32_t heap_check_region_count()
+{
+	uint32_t count = 0;
+
+	for (region_t* region = lastRegion; region; region = region->prev)
+	{
+		count++;
+	}
+
+	return count;
+}
+
+uint32_t heap_check_node_bytes()
+{
+	// The first page of nodes comes from the placement area
+	const heap_tag_stats_t* tag = 0;
+
+	for (uint32_t i = 0; i < heap_stats_tag_count(); ++i)
+	{
+		if (strcmp(heap_stats_get_tag(i)->name, "Heap regions") == 0)
+		{
+			tag = heap_stats_get_tag(i);
+		}
+	}
+
+	return PAGE_SIZE + (tag ? tag->liveBytes : 0);
+}
@@ -0,0 +1,204 @@
+/** @file host.c
+ *  @brief Host platform layer of the allocator bench.
+ *
+ *	Entry point, console output and memory mapping through int 0x80. The
+ *	kernel vsprintf formats the output, so the same format strings work
+ *	here as in the kernel.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include "host.h"
+
+#include <lib/string.h>
+#include <lib/stdarg.h>
+#include <lib/stdio.h>
+
+#define SYS_EXIT			1
+#define SYS_WRITE			4
+#define SYS_MUNMAP			91
+#define SYS_MMAP2			192
+#define SYS_RT_SIGACTION	174
+#define SYS_CLOCK_GETTIME	265
+
+#define PROT_READ_WRITE		3
+#define MAP_PRIVATE_FIXED_ANON	0x32
+
+#define CLOCK_MONOTONIC		1
+
+#define SIGSEGV				11
+#define SA_SIGINFO			0x00000004
+#define SA_RESTORER			0x04000000
+
+// Offset of the saved eip in the i386 ucontext
+#define UCONTEXT_EIP		76
+
+#define OPCODE_CLI			0xFA
+#define OPCODE_STI			0xFB
+
+int main(int argc, char** argv);
+
+asm (
+	".globl _start\n"
+	"_start:\n"
+	"	xor %ebp, %ebp\n"
+	"	mov (%esp), %eax\n"
+	"	lea 4(%esp), %edx\n"
+	"	and $-16, %esp\n"
+	"	sub $8, %esp\n"
+	"	push %edx\n"
+	"	push %eax\n"
+	"	call main\n"
+	"	push %eax\n"
+	"	call host_exit\n"
+);
+
+static int host_syscall(int n, int a, int b, int c)
+{
+	int ret;
+
+	asm volatile ("int $0x80" : "=a"(ret) : "a"(n), "b"(a), "c"(b), "d"(c) : "memory");
+
+	return ret;
+}
+
+static int host_syscall6(int n, int a, int b, int c, int d, int e, int f)
+{
+	int ret;
+
+	asm volatile (
+		"push %%ebp\n"
+		"mov %7, %%ebp\n"
+		"int $0x80\n"
+		"pop %%ebp\n"
+		: "=a"(ret)
+		: "a"(n), "b"(a), "c"(b), "d"(c), "S"(d), "D"(e), "g"(f)
+		: "memory");
+
+	return ret;
+}
+
+static void host_write(const char* str);
+
+void host_sigreturn();
+
+asm (
+	"host_sigreturn:\n"
+	"	mov $173, %eax\n" // rt_sigreturn
+	"	int $0x80\n"
+);
+
+// The allocators disable interrupts around their critical sections, which
+// faults in user mode. There is only one thread here, so the instruction is
+// simply skipped.
+static void host_segv(int sig, void* info, void* context)
+{
+	uint32_t* eip = (uint32_t*)((uint8_t*)context + UCONTEXT_EIP);
+	uint8_t opcode = *(uint8_t*)*eip;
+
+	if (opcode != OPCODE_CLI && opcode != OPCODE_STI)
+	{
+		host_write("FAILED: segmentation fault\n");
+		host_exit(3);
+	}
+
+	*eip += 1;
+}
+
+static void host_write(const char* str)
+{
+	host_syscall(SYS_WRITE, 1, (int)str, strlen(str));
+}
+
+//=============================================================================
+// Platform
+//=============================================================================
+
+void* host_map(uint32_t addr, uint32_t size)
+{
+	return (void*)host_syscall6(SYS_MMAP2, addr, size, PROT_READ_WRITE, MAP_PRIVATE_FIXED_ANON, -1, 0);
+}
+
+void host_unmap(uint32_t addr, uint32_t size)
+{
+	host_syscall(SYS_MUNMAP, addr, size, 0);
+}
+
+void host_init()
+{
+	struct
+	{
+		void* handler;
+		uint32_t flags;
+		void* restorer;
+		uint32_t mask[2];
+	} action = { host_segv, SA_SIGINFO | SA_RESTORER, host_sigreturn, { 0, 0 } };
+
+	host_syscall6(SYS_RT_SIGACTION, SIGSEGV, (int)&action, 0, sizeof(action.mask), 0, 0);
+}
+
+void host_exit(int code)
+{
+	host_syscall(SYS_EXIT, code, 0, 0);
+
+	for (;;);
+}
+
+uint32_t host_time_us()
+{
+	struct
+	{
+		int32_t sec;
+		int32_t nsec;
+	} ts;
+
+	host_syscall(SYS_CLOCK_GETTIME, CLOCK_MONOTONIC, (int)&ts, 0);
+
+	return ts.sec * 1000000 + ts.nsec / 1000;
+}
+
+void host_fail(const char* what, uint32_t op)
+{
+	printf("FAILED: %s after operation %i\n", what, op);
+	host_exit(1);
+}
+
+//=============================================================================
+// Kernel services used by the allocators
+//=============================================================================
+
+int printf(const char* format, ...)
+{
+	char buffer[512] = {0};
+	va_list args;
+
+	va_start(args, format);
+	vsprintf(buffer, format, args);
+	va_end(args);
+
+	host_write(buffer);
+
+	return 0;
+}
+
+int serial_printf(COM_port port, const char* format, ...)
+{
+	char buffer[512] = {0};
+	va_list args;
+
+	va_start(args, format);
+	vsprintf(buffer, format, args);
+	va_end(args);
+
+	host_write(buffer);
+
+	return 0;
+}
+
+void kernel_panic(const char* format, ...)
+{
+	host_write("PANIC: ");
+	host_write(format);
+	host_write("\n");
+	host_exit(2);
+}
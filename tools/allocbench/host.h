@@ -0,0 +1,48 @@
+/** @file host.h
+ *  @brief Host platform layer of the allocator bench.
+ *
+ *  The allocators are built against the kernel headers, which clash with
+ *	the host C library, so the bench does not link one. The few services it
+ *	needs are made directly through the i386 Linux system call interface.
+ *
+ *  @author Joakim Bertils
+ */
+
+#ifndef _ALLOCBENCH_HOST_H
+#define _ALLOCBENCH_HOST_H
+
+#include <lib/stdint.h>
+
+/** @brief Sets up the process, must be called first.
+ *
+ *	Lets the interrupt flag instructions of the kernel locks through.
+ */
+void host_init();
+
+/** @brief Maps anonymous memory at a fixed address. */
+void* host_map(uint32_t addr, uint32_t size);
+
+/** @brief Unmaps memory mapped by host_map. */
+void host_unmap(uint32_t addr, uint32_t size);
+
+/** @brief Terminates the bench with an exit code. */
+void host_exit(int code);
+
+/** @brief Returns a monotonic time in microseconds. */
+uint32_t host_time_us();
+
+/** @brief Reads the low half of the time stamp counter. */
+static inline uint32_t host_cycles()
+{
+	uint32_t lo;
+	uint32_t hi;
+
+	asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+
+	return lo;
+}
+
+/** @brief Prints a failed invariant and exits. */
+void host_fail(const char* what, uint32_t op);
+
+#endif
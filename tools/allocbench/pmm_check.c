@@ -0,0 +1,136 @@
+/** @file pmm_check.c
+ *  @brief Invariant checks of the physical memory manager.
+ *
+ *	Includes physmem.c to get at its bitmaps. A block has to be free in
+ *	exactly one buddy order when it is free in the block bitmap, buddies
+ *	have to be merged, only blocks in the extents may be free, the free
+ *	count and the zone counters have to match, counting the pending blocks,
+ *	and the search hints must not skip free memory.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include "../../src/mm/physmem.c"
+
+#include "checks.h"
+
+const char* pmm_check()
+{
+	uint32_t blocks = pmmngr_get_block_count();
+	uint32_t free = 0;
+	uint32_t zoneFree[MEM_ZONE_COUNT] = {0};
+
+	for (uint32_t block = 0; block < blocks; ++block)
+	{
+		uint32_t orders = 0;
+
+		for (uint32_t order = 0; order <= PMMNGR_MAX_ORDER; ++order)
+		{
+			uint32_t buddy = block >> order;
+
+			if (((buddy + 1) << order) <= blocks && buddy_test(order, buddy))
+			{
+				orders++;
+			}
+		}
+
+		if (orders > 1)
+		{
+			return "block free in more than one order";
+		}
+
+		if ((orders == 1) == (mmap_test(block) != 0))
+		{
+			return "block bitmap and buddy maps disagree";
+		}
+
+		if (orders && !pmmngr_block_refs(block))
+		{
+			return "block outside the extents is free";
+		}
+
+		free += orders;
+
+		if (orders)
+		{
+			zoneFree[block < MEM_ZONE_NORMAL_FIRST_BLOCK ? MEM_ZONE_DMA : MEM_ZONE_NORMAL]++;
+		}
+	}
+
+	uint32_t pending = 0;
+
+	for (uint32_t i = 0; i < _mmngr_extent_count; ++i)
+	{
+		pmmngr_extent_t* extent = &_mmngr_extents[i];
+
+		for (uint32_t block = extent->first + extent->released; block < extent->first + extent->count; ++block)
+		{
+			if (!mmap_test(block))
+			{
+				return "pending block is not marked as used";
+			}
+
+			zoneFree[block < MEM_ZONE_NORMAL_FIRST_BLOCK ? MEM_ZONE_DMA : MEM_ZONE_NORMAL]++;
+			pending++;
+		}
+	}
+
+	if (pending != pmmngr_get_pending_block_count())
+	{
+		return "pending block count is wrong";
+	}
+
+	if (free + pending != pmmngr_get_free_block_count())
+	{
+		return "free block count is wrong";
+	}
+
+	for (uint32_t zone = 0; zone < MEM_ZONE_COUNT; ++zone)
+	{
+		mem_zone_stats_t stats;
+
+		mem_zone_get_stats(zone, &stats);
+
+		if (stats.free != zoneFree[zone])
+		{
+			return "zone free count is wrong";
+		}
+	}
+
+	for (uint32_t order = 0; order < PMMNGR_MAX_ORDER; ++order)
+	{
+		for (uint32_t buddy = 0; buddy + 1 < (blocks >> order); buddy += 2)
+		{
+			if (buddy_test(order, buddy) && buddy_test(order, buddy + 1))
+			{
+				return "free buddies not merged";
+			}
+		}
+	}
+
+	for (uint32_t entry = 0; entry < _mmngr_free_hint && entry < mmap_entry_count(); ++entry)
+	{
+		if (_mmngr_memory_map[entry] != 0xFFFFFFFF)
+		{
+			return "free hint skips free blocks";
+		}
+	}
+
+	for (uint32_t order = 0; order <= PMMNGR_MAX_ORDER; ++order)
+	{
+		for (uint32_t entry = 0; entry < _mmngr_buddy_hint[order] && entry < _mmngr_buddy_entries[order]; ++entry)
+		{
+			if (_mmngr_buddy_map[order][entry])
+			{
+				return "buddy hint skips free blocks";
+			}
+		}
+	}
+
+	return 0;
+}
+
+int pmm_check_block_used(uint32_t block)
+{
+	return mmap_test(block) != 0;
+}
@@ -0,0 +1,205 @@
+/** @file vmm_stub.c
+ *  @brief Stub page mapper for the allocator bench.
+ *
+ *	Stands in for virtmem.c. Mapping a page maps host memory at the same
+ *	address and records the frame it was given. Reserved ranges are backed
+ *	right away, since there is no page fault handler to do it later, with
+ *	frames taken from the PMM like the kernel would. Released pages keep
+ *	their host memory but are filled with a poison pattern, so an allocator
+ *	using memory it gave back is caught by the content checks of the bench.
+ *
+ *  @author Joakim Bertils
+ */
+
+#include "host.h"
+
+#include <mm/virtmem.h>
+#include <mm/physmem.h>
+#include <mm/frame_cache.h>
+
+#include <kernel/panic.h>
+
+#include <lib/string.h>
+
+#define PAGE_SIZE 4096
+
+#define VMM_STUB_PRESENT 1
+#define VMM_STUB_HOST 2
+
+#define VMM_STUB_POISON 0xCC
+
+static pdirectory _stub_directory;
+
+// Frame and state of every page of the 4GB address space
+static uint32_t _stub_pages[1 << 20];
+
+static void stub_map(uint32_t virt, uint32_t phys)
+{
+	uint32_t* page = &_stub_pages[virt / PAGE_SIZE];
+
+	if (!(*page & VMM_STUB_HOST))
+	{
+		host_map(virt & ~(PAGE_SIZE - 1), PAGE_SIZE);
+	}
+
+	*page = (phys & ~(PAGE_SIZE - 1)) | VMM_STUB_PRESENT | VMM_STUB_HOST;
+}
+
+static uint32_t stub_release(uint32_t virt, int unmap)
+{
+	uint32_t* page = &_stub_pages[virt / PAGE_SIZE];
+
+	if (!(*page & VMM_STUB_PRESENT))
+	{
+		return 0;
+	}
+
+	frame_cache_free((void*)(*page & ~(PAGE_SIZE - 1)));
+
+	if (unmap)
+	{
+		host_unmap(virt & ~(PAGE_SIZE - 1), PAGE_SIZE);
+		*page = 0;
+	}
+	else
+	{
+		memset((void*)(virt & ~(PAGE_SIZE - 1)), VMM_STUB_POISON, PAGE_SIZE);
+		*page = VMM_STUB_HOST;
+	}
+
+	return PAGE_SIZE;
+}
+
+//=============================================================================
+// virtmem.c interface
+//=============================================================================
+
+pdirectory* vmmngr_get_directory()
+{
+	return &_stub_directory;
+}
+
+void vmmngr_mapPhysicalAddress(pdirectory* dir, uint32_t virt, uint32_t phys, uint32_t flags)
+{
+	stub_map(virt, phys);
+}
+
+void vmmngr_unmapPhysicalAddress(pdirectory* dir, uint32_t virt)
+{
+	if (_stub_pages[virt / PAGE_SIZE] & VMM_STUB_HOST)
+	{
+		host_unmap(virt & ~(PAGE_SIZE - 1), PAGE_SIZE);
+	}
+
+	_stub_pages[virt / PAGE_SIZE] = 0;
+}
+
+void* vmmngr_getPhysicalAddress(pdirectory* dir, uint32_t virt)
+{
+	uint32_t page = _stub_pages[virt / PAGE_SIZE];
+
+	if (!(page & VMM_STUB_PRESENT))
+	{
+		return 0;
+	}
+
+	return (void*)((page & ~(PAGE_SIZE - 1)) | (virt & (PAGE_SIZE - 1)));
+}
+
+void vmmngr_flush_tlb_entry(virtual_addr addr)
+{
+}
+
+// Frame contents are not simulated, writes through a scratch slot land in
+// a buffer of its own
+static uint8_t _stub_temp[VMMNGR_TEMP_MAP_SLOTS][PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+void* vmmngr_map_temp(uint32_t slot, physical_addr frame)
+{
+	return _stub_temp[slot];
+}
+
+void vmmngr_unmap_temp(uint32_t slot)
+{
+}
+
+int vmmngr_map_range(pdirectory* dir, virtual_addr virt, physical_addr phys, size_t size, uint32_t flags)
+{
+	for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE)
+	{
+		stub_map(virt + offset, phys + offset);
+	}
+
+	return 1;
+}
+
+void vmmngr_unmap_range(pdirectory* dir, virtual_addr virt, size_t size)
+{
+	for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE)
+	{
+		vmmngr_unmapPhysicalAddress(dir, virt + offset);
+	}
+}
+
+uint32_t vmmngr_release_range(pdirectory* dir, virtual_addr virt, size_t size)
+{
+	uint32_t released = 0;
+
+	for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE)
+	{
+		released += stub_release(virt + offset, 0);
+	}
+
+	return released;
+}
+
+uint32_t vmmngr_page_size(pdirectory* dir, virtual_addr virt)
+{
+	return (_stub_pages[virt / PAGE_SIZE] & VMM_STUB_PRESENT) ? PAGE_SIZE : 0;
+}
+
+int vmmngr_mapLargePage(pdirectory* dir, uint32_t virt, uint32_t phys, uint32_t flags)
+{
+	// Everything is mapped with 4KB pages here
+	return 0;
+}
+
+int vmmngr_reserve_range(pdirectory* dir, virtual_addr start, size_t size, uint32_t flags)
+{
+	vmmngr_commit_range(dir, start, size);
+
+	return 1;
+}
+
+void vmmngr_unreserve_range(pdirectory* dir, virtual_addr start, size_t size)
+{
+	for (uint32_t offset = 0; offset < size; offset += PAGE_SIZE)
+	{
+		stub_release(start + offset, 1);
+
+		if (_stub_pages[(start + offset) / PAGE_SIZE] & VMM_STUB_HOST)
+		{
+			vmmngr_unmapPhysicalAddress(dir, start + offset);
+		}
+	}
+}
+
+void vmmngr_commit_range(pdirectory* dir, virtual_addr start, size_t size)
+{
+	for (uint32_t virt = start & ~(PAGE_SIZE - 1); virt < start + size; virt += PAGE_SIZE)
+	{
+		if (_stub_pages[virt / PAGE_SIZE] & VMM_STUB_PRESENT)
+		{
+			continue;
+		}
+
+		uint32_t frame = (uint32_t)frame_cache_alloc();
+
+		if (!frame)
+		{
+			kernel_panic("allocbench: out of frames");
+		}
+
+		stub_map(virt, frame);
+	}
+}